@@ -0,0 +1,219 @@
+#include "BenchmarkReader.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <zlib.h>
+
+namespace {
+
+bool gunzip(const std::vector<char>& in, std::vector<char>& out) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  // Accept a gzip header only (16 + max window).
+  if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) return false;
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(&in[0]));
+  z.avail_in = in.size();
+  char chunk[1 << 16];
+  int ret;
+  for (;;) {
+	z.next_out = reinterpret_cast<Bytef*>(chunk);
+	z.avail_out = sizeof(chunk);
+	ret = inflate(&z, Z_NO_FLUSH);
+	out.insert(out.end(), chunk, chunk + (sizeof(chunk) - z.avail_out));
+	if (ret == Z_STREAM_END) {
+	  if (z.avail_in == 0) break;
+	  // Concatenated gzip members.
+	  inflateReset(&z);
+	} else if (ret != Z_OK) {
+	  break;
+	}
+  }
+  inflateEnd(&z);
+  return ret == Z_STREAM_END;
+}
+
+/*
+ * Decompresses the output of compress(1): LZW with 9 to maxbits bit codes,
+ * packed least significant bit first in groups of n_bits bytes. Whenever the
+ * code width changes (or the table is cleared) the rest of the current group
+ * is padding.
+ */
+bool uncompress(const std::vector<char>& in, std::vector<char>& out) {
+  if (in.size() < 3) return false;
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(&in[0]);
+  const unsigned int maxbits = data[2] & 0x1f;
+  const bool blockMode = (data[2] & 0x80) != 0;
+  if (maxbits < 9 || maxbits > 16) return false;
+  const uint32_t maxmaxcode = 1u << maxbits;
+  const uint32_t CLEAR = 256;
+
+  std::vector<uint16_t> prefix(maxmaxcode, 0);
+  std::vector<unsigned char> suffix(maxmaxcode, 0);
+  for (uint32_t c = 0; c < 256; ++c) suffix[c] = c;
+  std::vector<unsigned char> stack;
+
+  const size_t totalBits = (in.size() - 3) * 8;
+  size_t origin = 0;// Bit offset the current groups are aligned to.
+  size_t pos = 0;// Bit offset from origin.
+  unsigned int nbits = 9;
+  uint32_t maxcode = (1u << nbits) - 1;
+  uint32_t freeEnt = blockMode ? 257 : 256;
+  int32_t oldcode = -1;
+  unsigned char finchar = 0;
+  data += 3;
+
+  for (;;) {
+	if (freeEnt > maxcode) {
+	  // Skip to the end of the current group, and widen the codes.
+	  const size_t group = nbits * 8;
+	  if (pos > 0) pos = ((pos - 1) / group + 1) * group;
+	  origin += pos;
+	  pos = 0;
+	  ++nbits;
+	  maxcode = (nbits == maxbits) ? maxmaxcode : (1u << nbits) - 1;
+	}
+	if (origin + pos + nbits > totalBits) break;
+
+	const size_t bit = origin + pos;
+	uint32_t window = 0;
+	for (size_t b = 0; b < 3 && (bit >> 3) + b < totalBits / 8; ++b) {
+	  window |= static_cast<uint32_t>(data[(bit >> 3) + b]) << (8 * b);
+	}
+	uint32_t code = (window >> (bit & 7)) & ((1u << nbits) - 1);
+	pos += nbits;
+
+	if (oldcode == -1) {
+	  if (code >= 256) return false;
+	  finchar = code;
+	  oldcode = code;
+	  out.push_back(finchar);
+	  continue;
+	}
+	if (code == CLEAR && blockMode) {
+	  const size_t group = nbits * 8;
+	  pos = ((pos - 1) / group + 1) * group;
+	  origin += pos;
+	  pos = 0;
+	  nbits = 9;
+	  maxcode = (1u << nbits) - 1;
+	  freeEnt = 256;
+	  continue;
+	}
+
+	const uint32_t incode = code;
+	stack.clear();
+	if (code >= freeEnt) {
+	  // The KwKwK case: the code being defined right now.
+	  if (code > freeEnt) return false;
+	  stack.push_back(finchar);
+	  code = oldcode;
+	}
+	while (code >= 256) {
+	  stack.push_back(suffix[code]);
+	  code = prefix[code];
+	}
+	finchar = code;
+	stack.push_back(finchar);
+	out.insert(out.end(), stack.rbegin(), stack.rend());
+
+	if (freeEnt < maxmaxcode) {
+	  prefix[freeEnt] = oldcode;
+	  suffix[freeEnt] = finchar;
+	  ++freeEnt;
+	}
+	oldcode = incode;
+  }
+  return true;
+}
+
+// Offset just past the n-th newline at or after from, or size if there are fewer.
+size_t skipLines(const std::vector<char>& text, size_t from, size_t n) {
+  while (n > 0 && from < text.size()) {
+	const void* nl = memchr(&text[from], '\n', text.size() - from);
+	if (!nl) return text.size();
+	from = static_cast<const char*>(nl) - &text[0] + 1;
+	--n;
+  }
+  return from;
+}
+
+}
+
+BenchmarkReader::BenchmarkReader(const char* _path)
+  :path(_path)
+  ,syntax(strstr(_path, ".intohylo") ? KFormula::INTOHYLO : KFormula::LWB)
+  ,text()
+  ,pos(0)
+  ,last(0)
+  ,line(0)
+  ,currentLabel()
+{
+  std::ifstream file(_path, std::ios::in | std::ios::binary);
+  if (!file) {
+	std::cerr << "ERROR: Could not open benchmark file " << path << "." << std::endl;
+	exit(1);
+  }
+  std::vector<char> raw((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  const bool gzipped = raw.size() >= 2
+	&& static_cast<unsigned char>(raw[0]) == 0x1f && static_cast<unsigned char>(raw[1]) == 0x8b;
+  const bool compressed = raw.size() >= 2
+	&& static_cast<unsigned char>(raw[0]) == 0x1f && static_cast<unsigned char>(raw[1]) == 0x9d;
+  if (gzipped || compressed) {
+	if (!(gzipped ? gunzip(raw, text) : uncompress(raw, text))) {
+	  std::cerr << "ERROR: Could not decompress benchmark file " << path << "." << std::endl;
+	  exit(1);
+	}
+  } else {
+	text.swap(raw);
+  }
+
+  // Skip the header, and stop before the trailer line.
+  const size_t header = (syntax == KFormula::INTOHYLO) ? 1 : 2;
+  pos = skipLines(text, 0, header);
+  line = header;
+  last = text.size();
+  if (last > 0 && text[last - 1] == '\n') --last;
+  while (last > 0 && text[last - 1] != '\n') --last;
+}
+
+KFormula* BenchmarkReader::next() {
+  while (pos < last) {
+	const char* begin = &text[pos];
+	const char* end = static_cast<const char*>(memchr(begin, '\n', last - pos));
+	if (!end) end = &text[0] + last;
+	pos = end - &text[0] + 1;
+	++line;
+	if (begin == end) {
+	  continue;
+	}
+
+	if (syntax == KFormula::LWB) {
+	  // 'label: fml'
+	  const char* colon = static_cast<const char*>(memchr(begin, ':', end - begin));
+	  if (colon) {
+		const char* l = begin;
+		while (l < colon && isspace(*l)) ++l;
+		const char* r = colon;
+		while (r > l && isspace(*(r-1))) --r;
+		currentLabel.assign(l, r);
+		begin = colon + 1;
+	  } else {
+		currentLabel = std::to_string(line);
+	  }
+	} else {
+	  currentLabel = std::to_string(line);
+	}
+
+	KFormula* f = KFormula::parseKFormula(begin, end, syntax);
+	if (!f) {
+	  std::cerr << "ERROR: In " << path << " on line " << line << "." << std::endl;
+	  exit(1);
+	}
+	return (syntax == KFormula::INTOHYLO) ? KFormula::makeNot(f) : f;
+  }
+  return NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef _BENCHMARKREADER_H_
+#define _BENCHMARKREADER_H_
+
+#include <string>
+#include <vector>
+
+#include "KFormula.h"
+
+/*
+ * Reads the LWB and intohylo (3CNFk, MQBF) benchmark files directly,
+ * replacing lwbToK.sh and intohyloToK.sh.
+ *
+ * Files compressed with compress (.Z) or gzip are decompressed in memory.
+ * The format is taken from the file name: anything containing ".intohylo"
+ * is intohylo, everything else (.txt, .txt.Z, .gz) is LWB. As in the
+ * scripts, the header (one line for intohylo, two for LWB) and the trailer
+ * line are skipped, and every other line is a separate formula:
+ *   intohylo  'fml', to be proven as ~(fml)
+ *   LWB       'label: fml', to be proven as fml
+ * Formulae are parsed straight into the formula DAG in the matching
+ * KFormula::Syntax.
+ */
+class BenchmarkReader {
+public:
+  // Reports the problem on std::cerr and exits if the file can't be read.
+  explicit BenchmarkReader(const char* path);
+
+  // The next formula to prove, or NULL at the end of the file.
+  // Exits if a formula can't be parsed.
+  KFormula* next();
+
+  // Label of the formula last returned by next(): the LWB label, or the
+  // line number for intohylo.
+  const std::string& label() const { return currentLabel; };
+
+private:
+  std::string path;
+  KFormula::Syntax syntax;
+  std::vector<char> text;
+  // Lines left to read, as offsets into text.
+  size_t pos, last;
+  size_t line;
+  std::string currentLabel;
+};
+
+#endif
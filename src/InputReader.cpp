@@ -0,0 +1,117 @@
+#include "InputReader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <stdlib.h>
+
+InputReader::InputReader(const char* path)
+  :mapped(NULL)
+  ,mappedSize(0)
+  ,buffer()
+  ,start(0)
+  ,filled(0)
+  ,eof(false)
+  ,next(NULL)
+  ,lines(0)
+{
+  if (!path || strcmp(path, "-") == 0) {
+	buffer.resize(1 << 16);
+	return;
+  }
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+	std::cerr << "ERROR: Could not open input file " << path << "." << std::endl;
+	exit(1);
+  }
+  mappedSize = st.st_size;
+  if (mappedSize > 0) {
+	void* m = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED) {
+	  std::cerr << "ERROR: Could not map input file " << path << "." << std::endl;
+	  exit(1);
+	}
+	madvise(m, mappedSize, MADV_SEQUENTIAL);
+	mapped = static_cast<const char*>(m);
+  } else {
+	// Nothing to map; behave as an exhausted mapping.
+	mapped = "";
+  }
+  next = mapped;
+  close(fd);
+}
+
+InputReader::~InputReader() {
+  if (mapped && mappedSize > 0) {
+	munmap(const_cast<char*>(mapped), mappedSize);
+  }
+}
+
+/*
+ * Moves the unread part of the buffer to the front and reads more after it,
+ * doubling the buffer if it is already full. Returns false if nothing more
+ * could be read.
+ */
+bool InputReader::fill() {
+  if (eof) return false;
+  if (start > 0) {
+	memmove(&buffer[0], &buffer[start], filled - start);
+	filled -= start;
+	start = 0;
+  }
+  if (filled == buffer.size()) {
+	buffer.resize(buffer.size() * 2);
+  }
+  ssize_t n;
+  do {
+	n = read(0, &buffer[filled], buffer.size() - filled);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+	eof = true;
+	return false;
+  }
+  filled += n;
+  return true;
+}
+
+bool InputReader::nextLine(const char*& begin, const char*& end) {
+  if (mapped) {
+	const char* const last = mapped + mappedSize;
+	if (next == last) return false;
+	begin = next;
+	end = static_cast<const char*>(memchr(next, '\n', last - next));
+	if (end) {
+	  next = end + 1;
+	} else {
+	  end = next = last;
+	}
+	++lines;
+	return true;
+  }
+
+  size_t scanned = start;
+  for (;;) {
+	const char* nl = static_cast<const char*>(
+	  memchr(&buffer[0] + scanned, '\n', filled - scanned));
+	if (nl) {
+	  begin = &buffer[0] + start;
+	  end = nl;
+	  start = nl - &buffer[0] + 1;
+	  ++lines;
+	  return true;
+	}
+	scanned = filled - start;
+	if (!fill()) break;
+  }
+  // Last line, without a trailing newline.
+  if (start == filled) return false;
+  begin = &buffer[0] + start;
+  end = &buffer[0] + filled;
+  start = filled;
+  ++lines;
+  return true;
+}
@@ -0,0 +1,51 @@
+#ifndef _INPUTREADER_H_
+#define _INPUTREADER_H_
+
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Line-by-line access to the input, without copying it into strings.
+ *
+ * A named file is memory-mapped and lines point straight into the mapping.
+ * Standard input is streamed through a fixed buffer that only ever holds
+ * the current line (the buffer grows only for lines longer than it), so
+ * arbitrarily large inputs can be read one axiom at a time.
+ */
+class InputReader {
+public:
+  // Reads the given file, or standard input if path is NULL or "-".
+  // Reports the problem on std::cerr and exits if the file can't be read.
+  explicit InputReader(const char* path);
+  ~InputReader();
+
+  // The next line as [begin, end), without its newline. The characters
+  // stay valid until the next call. Returns false at the end of the input.
+  bool nextLine(const char*& begin, const char*& end);
+
+  // Number of lines returned so far.
+  size_t lineNumber() const { return lines; };
+
+  // Whether the input is a mapped file, whose lines stay valid for as long
+  // as the reader, rather than until the next call.
+  bool isMapped() const { return mapped != NULL; };
+
+private:
+  InputReader(const InputReader&);
+  InputReader& operator=(const InputReader&);
+
+  bool fill();
+
+  // Memory-mapped file, or NULL when streaming.
+  const char* mapped;
+  size_t mappedSize;
+  // Streaming buffer, valid between start and filled.
+  std::vector<char> buffer;
+  size_t start, filled;
+  bool eof;
+
+  const char* next;
+  size_t lines;
+};
+
+#endif
@@ -6,131 +6,387 @@
 
 #include <iostream>
 
-KFormula::KFormula()
-  :op(TRUE)
-  ,left()
-  ,right()
-  ,prop("")
+KFormulaArena KFormula::theArena;
+thread_local KFormulaArena* KFormula::threadArena = NULL;
+
+KFormulaArena::KFormulaArena()
+  :blocks()
+  ,count(0)
+  ,operandPool()
+  ,table(1024, 0)
+  ,propSymbols()
+  ,roleSymbols()
 {
+}
 
+KFormulaArena::~KFormulaArena() {
+  clear();
 }
 
-KFormula::KFormula(const std::string& s)
-  :op(AP)
-  ,left()
-  ,right()
-  ,prop(s)
-{
+void KFormulaArena::clear() {
+  for (size_t i = 0; i < blocks.size(); ++i) {
+	::operator delete(blocks[i]);
+  }
+  std::vector<KFormula*>().swap(blocks);
+  count = 0;
+  std::vector<uint32_t>().swap(operandPool);
+  std::vector<uint32_t>(1024, 0).swap(table);
+  propSymbols.clear();
+  roleSymbols.clear();
 }
 
-KFormula::KFormula(bool b)
-  :op(b ? TRUE : FALSE)
-  ,left()
-  ,right()
-  ,prop("")
-{
+size_t KFormulaArena::footprint() const {
+  return blocks.size() * (sizeof(KFormula) << BLOCK_BITS)
+	+ operandPool.capacity() * sizeof(uint32_t)
+	+ table.capacity() * sizeof(uint32_t);
 }
 
-KFormula::KFormula(KFormulaType _op, KFormula * _left, KFormula * _right)
-  :op(_op)
-  ,left(_left)
-  ,right(_right)
-  ,prop("")
-{
+static inline uint32_t mix(uint32_t h, uint32_t x) {
+  h ^= x + 0x9e3779b9u + (h << 6) + (h >> 2);
+  return h;
 }
 
-KFormula::KFormula(KFormulaType _op, KFormula* _left, std::shared_ptr<KFormula> const & _right)
-  :op(_op)
-  ,left(_left)
-  ,right(_right)
-  ,prop("")
-{
+uint32_t KFormulaArena::find(const KFormula& probe) const {
+  const bool nary = (probe.op == KFormula::AND || probe.op == KFormula::OR);
+  const size_t mask = table.size() - 1;
+  for (size_t slot = probe.hash & mask; table[slot] != 0; slot = (slot + 1) & mask) {
+	const KFormula& f = node(table[slot] - 1);
+	if (f.hash != probe.hash || f.op != probe.op || f.right != probe.right) continue;
+	if (nary) {
+	  if (std::equal(operands(f.left), operands(f.left) + f.right, operands(probe.left))) {
+		return table[slot];
+	  }
+	} else if (f.left == probe.left) {
+	  return table[slot];
+	}
+  }
+  return 0;
 }
-KFormula::KFormula(KFormulaType _op, std::shared_ptr<KFormula> const & _left, KFormula* _right)
-  :op(_op)
-  ,left(_left)
-  ,right(_right)
-  ,prop("")
-{
+
+void KFormulaArena::grow() {
+  std::vector<uint32_t> bigger(table.size() * 2, 0);
+  const size_t mask = bigger.size() - 1;
+  for (uint32_t i = 0; i < count; ++i) {
+	size_t slot = node(i).hash & mask;
+	while (bigger[slot] != 0) slot = (slot + 1) & mask;
+	bigger[slot] = i + 1;
+  }
+  table.swap(bigger);
 }
-KFormula::KFormula(KFormulaType _op, std::shared_ptr<KFormula> const & _left, std::shared_ptr<KFormula> const & _right)
-  :op(_op)
-  ,left(_left)
-  ,right(_right)
-  ,prop("")
-{
+
+KFormula* KFormulaArena::allocate(const KFormula& probe) {
+  if ((count & BLOCK_MASK) == 0) {
+	blocks.push_back(static_cast<KFormula*>(::operator new(sizeof(KFormula) << BLOCK_BITS)));
+  }
+  KFormula* f = &blocks.back()[count & BLOCK_MASK];
+  *f = probe;
+  f->id = count++;
+  if (count * 2 > table.size()) {
+	grow();
+  } else {
+	size_t slot = f->hash & (table.size() - 1);
+	while (table[slot] != 0) slot = (slot + 1) & (table.size() - 1);
+	table[slot] = f->id + 1;
+  }
+  return f;
+}
+
+KFormula* KFormulaArena::intern(KFormula::KFormulaType op, uint32_t left, uint32_t right) {
+  KFormula probe;
+  probe.op = op;
+  probe.role = 0;
+  probe.var = -1;
+  probe.left = left;
+  probe.right = right;
+  probe.hash = mix(mix(op, left), right);
+  probe.id = 0;
+  uint32_t existing = find(probe);
+  return existing ? &node(existing - 1) : allocate(probe);
+}
+
+KFormula* KFormulaArena::internNary(KFormula::KFormulaType op, uint32_t offset) {
+  KFormula probe;
+  probe.op = op;
+  probe.role = 0;
+  probe.var = -1;
+  probe.left = offset;
+  probe.right = operandPool.size() - offset;
+  probe.hash = mix(op, probe.right);
+  for (uint32_t i = offset; i < operandPool.size(); ++i) {
+	probe.hash = mix(probe.hash, operandPool[i]);
+  }
+  probe.id = 0;
+  uint32_t existing = find(probe);
+  if (existing) {
+	operandPool.resize(offset);
+	return &node(existing - 1);
+  }
+  return allocate(probe);
 }
 
 
-KFormula::KFormula(const KFormula & other)
-  :op(other.op)
-  ,left(other.left)
-  ,right(other.right)
-  ,prop(other.prop)
-{  
+static bool writeWords(FILE* out, const uint32_t* words, size_t n) {
+  return fwrite(words, sizeof(uint32_t), n, out) == n;
 }
 
+static bool readWords(FILE* in, uint32_t* words, size_t n) {
+  return fread(words, sizeof(uint32_t), n, in) == n;
+}
 
-KFormula::~KFormula() {
+// Bytes left to read in the file. Counts read from an image are checked
+// against it before anything is allocated for them.
+static size_t remainingBytes(FILE* in) {
+  const long pos = ftell(in);
+  if (pos < 0 || fseek(in, 0, SEEK_END) != 0) return 0;
+  const long end = ftell(in);
+  if (fseek(in, pos, SEEK_SET) != 0 || end < pos) return 0;
+  return end - pos;
 }
 
-bool KFormula::operator==(const KFormula& other) const {
-  return 
-	op == other.op &&
-	(op <= FALSE ? true :                               //Constants
-	 op == AP    ? prop == other.prop :                 //Propositions
-	 op <= NOT   ? *left == *(other.left) :             //Unary operators
-	 *left == *(other.left) && *right == *(other.right) //Binary operators
-	 );
+static bool writeSymbols(FILE* out, const SymbolTable& symbols) {
+  const uint32_t n = symbols.size();
+  bool ok = writeWords(out, &n, 1);
+  for (uint32_t s = 0; ok && s < n; ++s) {
+	const uint32_t length = symbols.name(s).size();
+	ok = writeWords(out, &length, 1)
+	  && fwrite(symbols.name(s).data(), 1, length, out) == length;
+  }
+  return ok;
 }
 
+static bool readSymbols(FILE* in, SymbolTable& symbols) {
+  uint32_t n;
+  size_t left = remainingBytes(in);
+  if (!readWords(in, &n, 1) || n > left / sizeof(uint32_t)) return false;
+  left -= sizeof(uint32_t);
+  std::string name;
+  for (uint32_t s = 0; s < n; ++s) {
+	uint32_t length;
+	if (!readWords(in, &length, 1) || left < sizeof(uint32_t) + length) return false;
+	left -= sizeof(uint32_t) + length;
+	name.resize(length);
+	if (length && fread(&name[0], 1, length, in) != length) return false;
+	// Names are unique, so interning them in order gives back the same ids.
+	if (symbols.intern(name) != s) return false;
+  }
+  return true;
+}
 
+bool KFormulaArena::save(FILE* out) const {
+  const uint32_t header[2] = {count, (uint32_t) operandPool.size()};
+  bool ok = writeWords(out, header, 2);
+  for (uint32_t i = 0; ok && i < count; ++i) {
+	const KFormula& f = node(i);
+	const uint32_t fields[6] = {f.op, (uint32_t) f.role, (uint32_t) f.var, f.left, f.right, f.hash};
+	ok = writeWords(out, fields, 6);
+  }
+  return ok && writeWords(out, operandPool.data(), operandPool.size())
+	&& writeSymbols(out, propSymbols) && writeSymbols(out, roleSymbols);
+}
 
+bool KFormulaArena::load(FILE* in) {
+  assert(count == 0 && "Images are only loaded into empty arenas.");
+  uint32_t header[2];
+  if (!readWords(in, header, 2)
+	  || header[0] > remainingBytes(in) / (6 * sizeof(uint32_t))) return false;
+  for (uint32_t i = 0; i < header[0]; ++i) {
+	uint32_t fields[6];
+	if (!readWords(in, fields, 6) || fields[0] >= KFormula::TYPE_COUNT) return false;
+	// Nodes are saved in index order, so operands come before their users.
+	switch (fields[0]) {
+	  case KFormula::BOX: case KFormula::DIA: case KFormula::NOT:
+		if (fields[3] >= i) return false;
+		break;
+	  case KFormula::IMP: case KFormula::EQU:
+		if (fields[3] >= i || fields[4] >= i) return false;
+		break;
+	  case KFormula::AND: case KFormula::OR:
+		if (fields[3] > header[1] || fields[4] > header[1] - fields[3]) return false;
+		break;
+	  default:
+		break;
+	}
+	KFormula probe;
+	probe.op = fields[0];
+	probe.role = fields[1];
+	probe.var = fields[2];
+	probe.left = fields[3];
+	probe.right = fields[4];
+	probe.hash = fields[5];
+	allocate(probe);
+  }
+  if (header[1] > remainingBytes(in) / sizeof(uint32_t)) return false;
+  operandPool.resize(header[1]);
+  if (!readWords(in, operandPool.data(), operandPool.size())
+	  || !readSymbols(in, propSymbols) || !readSymbols(in, roleSymbols)) return false;
+  // Now that the operand lists and symbols are in, check what refers to them.
+  for (uint32_t i = 0; i < count; ++i) {
+	const KFormula& f = node(i);
+	switch (f.op) {
+	  case KFormula::AP:
+		if (f.left >= propSymbols.size()) return false;
+		break;
+	  case KFormula::BOX: case KFormula::DIA:
+		if (f.right >= roleSymbols.size()) return false;
+		break;
+	  case KFormula::AND: case KFormula::OR:
+		if (f.right < 2) return false;
+		for (uint32_t k = f.left; k < f.left + f.right; ++k) {
+		  if (operandPool[k] >= i) return false;
+		}
+		break;
+	  default:
+		break;
+	}
+  }
+  return true;
+}
 
+KFormula* KFormulaArena::import(const KFormulaArena& from, uint32_t root, std::vector<uint32_t>& map) {
+  if (map.size() < from.count) map.resize(from.count, 0);
+  // Post-order: a node is copied once all of its operands have been.
+  std::vector<uint32_t> pending(1, root);
+  while (!pending.empty()) {
+	const uint32_t i = pending.back();
+	if (map[i]) {
+	  pending.pop_back();
+	  continue;
+	}
+	const KFormula& f = from.node(i);
+	uint32_t pair[2] = {f.left, f.right};
+	const uint32_t* args = pair;
+	size_t n = 0;
+	switch (f.op) {
+	  case KFormula::AND: case KFormula::OR: args = from.operands(f.left); n = f.right; break;
+	  case KFormula::IMP: case KFormula::EQU: n = 2; break;
+	  case KFormula::BOX: case KFormula::DIA: case KFormula::NOT: n = 1; break;
+	  default: break;
+	}
+	bool ready = true;
+	for (size_t k = 0; k < n; ++k) {
+	  if (!map[args[k]]) {
+		pending.push_back(args[k]);
+		ready = false;
+	  }
+	}
+	if (!ready) continue;
+	pending.pop_back();
+
+	KFormula* copy;
+	switch (f.op) {
+	  case KFormula::AP:
+		copy = intern(KFormula::AP, propSymbols.intern(from.propSymbols.name(f.left)), f.right);
+		break;
+	  case KFormula::BOX: case KFormula::DIA:
+		copy = intern(static_cast<KFormula::KFormulaType>(f.op), map[f.left] - 1,
+					  roleSymbols.intern(from.roleSymbols.name(f.right)));
+		break;
+	  case KFormula::NOT:
+		copy = intern(KFormula::NOT, map[f.left] - 1, f.right);
+		break;
+	  case KFormula::IMP: case KFormula::EQU:
+		copy = intern(static_cast<KFormula::KFormulaType>(f.op), map[f.left] - 1, map[f.right] - 1);
+		break;
+	  case KFormula::AND: case KFormula::OR:
+		{const uint32_t offset = operandPool.size();
+		for (size_t k = 0; k < n; ++k) {
+		  operandPool.push_back(map[args[k]] - 1);
+		}
+		copy = internNary(static_cast<KFormula::KFormulaType>(f.op), offset);}
+		break;
+	  default:
+		copy = intern(static_cast<KFormula::KFormulaType>(f.op), f.left, f.right);
+		break;
+	}
+	map[i] = copy->id + 1;
+  }
+  return &node(map[root] - 1);
+}
 
-int KFormula::compare(const KFormula & other) const {
-  if (op != other.op) return static_cast<int>(op - other.op);
-  switch(op) {
-  case TRUE:
-  case FALSE:
-	return 0;
-  case AP:
-	return prop.compare(other.prop);
-  case DIA:
-  case BOX:
-  if (prop.compare(other.prop) != 0) return prop.compare(other.prop);
-  case NOT:
-	return left->compare(*other.left);
-  case OR:
-  case AND:
-  case EQU:
-  case IMP:
-	int c1 = left->compare(*other.left);
-	if (c1 != 0) return c1;
-	else return right->compare(*other.right);
+KFormula* KFormula::makeConst(bool b) {
+  return arena().intern(b ? TRUE : FALSE, 0, 0);
+}
+
+KFormula* KFormula::makeAtom(uint32_t prop) {
+  return arena().intern(AP, prop, 0);
+}
+
+KFormula* KFormula::makeAtom(const std::string& prop) {
+  return makeAtom(arena().props().intern(prop));
+}
+
+KFormula* KFormula::makeNot(KFormula* f) {
+  return arena().intern(NOT, f->id, 0);
+}
+
+KFormula* KFormula::makeModal(KFormulaType op, uint32_t role, KFormula* f) {
+  assert((op == BOX || op == DIA) && "Not a modal operator.");
+  return arena().intern(op, f->id, role);
+}
+
+KFormula* KFormula::makeModal(KFormulaType op, const std::string& role, KFormula* f) {
+  return makeModal(op, arena().roles().intern(role), f);
+}
+
+KFormula* KFormula::makeBinary(KFormulaType op, KFormula* left, KFormula* right) {
+  if (op == AND || op == OR) {
+	std::vector<KFormula*> args;
+	args.push_back(left);
+	args.push_back(right);
+	return makeNary(op, args);
   }
-  assert(false && "Fell out of complete switch!");
+  assert((op == IMP || op == EQU) && "Not a binary operator.");
+  return arena().intern(op, left->id, right->id);
+}
+
+KFormula* KFormula::makeNary(KFormulaType op, const std::vector<KFormula*>& operands) {
+  assert((op == AND || op == OR) && "Only conjunctions and disjunctions are n-ary.");
+  KFormulaArena& a = arena();
+  const uint32_t offset = a.operandCount();
+  for (size_t i = 0; i < operands.size(); ++i) {
+	if (operands[i]->op == op) {
+	  // Splice in the operands of a nested conjunction (disjunction).
+	  for (uint32_t j = 0; j < operands[i]->right; ++j) {
+		uint32_t operand = a.operands(operands[i]->left)[j];
+		a.pushOperand(operand);
+	  }
+	} else {
+	  a.pushOperand(operands[i]->id);
+	}
+  }
+  const uint32_t n = a.operandCount() - offset;
+  if (n <= 1) {
+	KFormula* f = n ? &a.node(a.operands(offset)[0]) : makeConst(op == AND);
+	a.discardOperands(offset);
+	return f;
+  }
+  return a.internNary(op, offset);
 }
 
 
 size_t KFormula::size() const {
-  switch(op) {
-  case TRUE:
-  case FALSE:
-  case AP: return 1;
-  case BOX:
-  case DIA:
-  case NOT:
-	return 1 + left->size();
-  case IMP:
-  case EQU: 
-  case AND:
-  case OR: return 1 + left->size() + right->size();
-  default:
-	// Error!
-	assert(false);
-	return 0;
+  size_t s = 1;
+  for (size_t i = 0; i < arity(); ++i) {
+	s += getarg(i).size();
+  }
+  return s;
+}
+
+size_t KFormula::dagSize() const {
+  std::vector<bool> seen(arena().size(), false);
+  std::vector<const KFormula*> todo(1, this);
+  size_t s = 0;
+  while (!todo.empty()) {
+	const KFormula* f = todo.back();
+	todo.pop_back();
+	if (seen[f->id]) continue;
+	seen[f->id] = true;
+	++s;
+	for (size_t i = 0; i < f->arity(); ++i) {
+	  todo.push_back(&f->getarg(i));
+	}
   }
+  return s;
 }
 
 
@@ -152,44 +408,46 @@ static int prionr(KFormula::KFormulaType op) {
 }
 
 void KFormula::toString(std::string& s, int precedence) const {
-  bool needsBrackets = prionr(op) < precedence;
+  bool needsBrackets = prionr(getop()) < precedence;
   if (needsBrackets)
 	s += '(';
-  switch(op){
+  switch(getop()){
   case TRUE: s+="True "; break;
   case FALSE: s+="False "; break;
-  case AP: s+= prop; break;
+  case AP: s+= getprop(); break;
   case BOX:
-	s += " [" + prop + "] ";
-	left->toString(s,5);
+	s += " [" + getprop() + "] ";
+	getarg(0).toString(s,5);
 	break;
   case DIA:
-	s += " <" + prop + "> ";
-	left->toString(s,5);
+	s += " <" + getprop() + "> ";
+	getarg(0).toString(s,5);
 	break;
   case NOT:
 	s += " ~ ";
-	left->toString(s,5);
+	getarg(0).toString(s,5);
 	break;
   case EQU:
-	left->toString(s,0);
+	getarg(0).toString(s,1);
 	s += " <=> ";
-	right->toString(s,0);
+	getarg(1).toString(s,0);
 	break;
   case IMP:
-	left->toString(s,3);
+	getarg(0).toString(s,3);
 	s += " => ";
-	right->toString(s,3);
+	getarg(1).toString(s,2);
 	break;
   case OR:
-	left->toString(s,4);
-	s += " | ";
-	right->toString(s,4);
+	for (size_t i = 0; i < arity(); ++i) {
+	  if (i) s += " | ";
+	  getarg(i).toString(s,4);
+	}
 	break;
   case AND:
-	left->toString(s,5);
-	s += " & ";
-	right->toString(s,5);
+	for (size_t i = 0; i < arity(); ++i) {
+	  if (i) s += " & ";
+	  getarg(i).toString(s,5);
+	}
 	break;
   default:
 	assert(false);
@@ -210,149 +468,200 @@ std::ostream& operator<<( std::ostream& stream, const KFormula& f ){
 }
 
 
-KFormula*  KFormula::parseEQU(const char*& str) {
-  KFormula* left = parseIMP(str);
-  
-  while(isspace(*str)) ++str;
-  
-  if(strncmp(str,"<=>",3) == 0) {
-	// This is an equivalence
-	str += 3;
-	KFormula* right = parseEQU(str);
-	return new KFormula(KFormula::EQU,left,right);
-  } else {
-	return left;
-	// This is not an equivalence
-  }
-}
 
-KFormula* KFormula::parseIMP(const char*& str) {
-  KFormula* left = parseOR(str);
-  
-  while(isspace(*str)) ++str;
-  
-  if(strncmp(str,"=>",2) == 0) {
-	// This is an implication
-	str += 2;
-	KFormula* right = parseIMP(str);
-	return new KFormula(KFormula::IMP,left,right);
-  } else {
-	return left;
-	// This is not an implication
+
+/*
+ * Operator precedence parser.
+ *
+ * Operands and pending operators are kept on explicit stacks rather than on
+ * the call stack, so arbitrarily long conjunctions (as produced for whole
+ * ontologies) parse in linear time and constant stack space. Consecutive
+ * '&' ('|') operators of the same parenthesis level are collected into a
+ * single n-ary node.
+ *
+ * Precedence, loosest first: '<=>', '=>', '|', '&', then the prefix
+ * operators '~', '[r]' and '<r>'. '<=>' and '=>' associate to the right.
+ */
+namespace {
+
+struct PendingOp {
+  enum Kind { PAREN, PREFIX, BINARY } kind;
+  KFormula::KFormulaType op;
+  int prec;
+  size_t arity;
+  uint32_t role;
+};
+
+int binaryPrec(KFormula::KFormulaType op) {
+  switch (op) {
+  case KFormula::EQU: return 0;
+  case KFormula::IMP: return 1;
+  case KFormula::OR: return 2;
+  case KFormula::AND: return 3;
+  default: return 4;
   }
 }
 
-KFormula* KFormula::parseOR(const char*& str) {
-  KFormula* left = parseAND(str);
-  
-  while(isspace(*str)) ++str;
-  
-  if(*str == '|'){
-	// This is a disjunction
-	++str;
-	KFormula* right = parseOR(str);
-	return new KFormula(KFormula::OR,left,right);
-  } else {
-	return left;
-	// This is not a disjunction
-  }
+// Character at p, or '\0' past the end of the input.
+inline char peek(const char* p, const char* end) {
+  return p < end ? *p : '\0';
 }
 
-KFormula* KFormula::parseAND(const char*& str) {
-  KFormula* left = parseRest(str);
-  
-  while(isspace(*str)) ++str;
-  
-  if(*str == '&'){
-	// This is a conjunction
-	++str;
-	KFormula* right = parseAND(str);
-	return new KFormula(KFormula::AND,left,right);
+// Pops the top pending operator and replaces its operands with the result.
+void reduce(std::vector<PendingOp>& ops, std::vector<KFormula*>& operands) {
+  PendingOp& top = ops.back();
+  if (top.kind == PendingOp::PREFIX) {
+	if (top.op == KFormula::NOT) {
+	  operands.back() = KFormula::makeNot(operands.back());
+	} else {
+	  operands.back() = KFormula::makeModal(top.op, top.role, operands.back());
+	}
+  } else if (top.op == KFormula::AND || top.op == KFormula::OR) {
+	std::vector<KFormula*> args(operands.end() - top.arity, operands.end());
+	operands.resize(operands.size() - top.arity);
+	operands.push_back(KFormula::makeNary(top.op, args));
   } else {
-	return left;
-	// This is not a conjunction
+	KFormula* right = operands.back();
+	operands.pop_back();
+	operands.back() = KFormula::makeBinary(top.op, operands.back(), right);
   }
+  ops.pop_back();
 }
 
-KFormula* KFormula::parseRest(const char*& str) {
-  while(isspace(*str)) ++str;
-
-
-  KFormula *left;
-
-  if(*str == '('){
-	++str;
-	left = parseEQU(str);
-	while(isspace(*str)) ++str;
-	assert(*str == ')');
-	++str;
-	return left;
-  } else if (strncmp(str,"<", 1) == 0 && (isalnum(*(str + 1)) || *(str+1) == '-')) {
-  size_t n = 1;// "<"
-  if (*(str+1) == '-') ++n;
-  while(isalnum(*(str+n))) ++n;
-  std::string roleString(str+1, n - 1);
-  ++n;// ">"
-	str += n;
-	left = parseRest(str);
-	left = new KFormula(KFormula::DIA,left,NULL);
-	left->setprop(roleString);
-	return left;
-  } else if (strncmp(str,"<>", 2) == 0) {
-	str += 2;
-	left = parseRest(str);
-	left = new KFormula(KFormula::DIA,left,NULL);
-	return left;
-  } else if (strncmp(str,"[", 1) == 0 && (isalnum(*(str + 1)) || *(str+1) == '-')) {
-  size_t n = 1;// "["
-  if (*(str+1) == '-') ++n;
-  while(isalnum(*(str+n))) ++n;
-  std::string roleString(str+1, n - 1);
-  ++n;// "]"
-	str += n;
-	left = parseRest(str);
-	left = new KFormula(KFormula::BOX,left,NULL);
-	left->setprop(roleString);
-	return left;
-  }else if (strncmp(str,"[]",2) == 0) {
-	str += 2;
-	left = parseRest(str);
-	left = new KFormula(KFormula::BOX,left,NULL);
-	return left;
-  } else if (*str=='~') {
-	++str;
-	left = parseRest(str);
-	left = new KFormula(KFormula::NOT,left,NULL);
-	return left;
-  } else if (strncmp(str,"True",4)==0) {
-	str += 4;
-	return new KFormula(true);
-  } else if (strncmp(str,"False",5)==0) {
-	str += 5;
-	return new KFormula(false);
-  } else if (isalpha(*str) || *str == '_') {
-	size_t n = 1;
-	while(isalnum(*(str+n)) || *(str+n) == '_') ++n;
-	left = new KFormula(std::string(str,n));
-	str += n;
-	return left;
-  }
-
-  assert(false && "Could not parse input");
-  // Must not reach here
-
 }
 
 KFormula* KFormula::parseKFormula(const char* str) {
-  if (!str || !*str) return NULL;
-
-  KFormula* ret = parseEQU(str);
+  if (!str) return NULL;
+  return parseKFormula(str, str + strlen(str));
+}
 
-  while(isspace(*str)) ++str;
+KFormula* KFormula::parseKFormula(const char* str, const char* end, Syntax syntax) {
+  if (str == end) return NULL;
+
+  const char* const begin = str;
+  const char* error = NULL;
+  std::vector<KFormula*> operands;
+  std::vector<PendingOp> ops;
+  bool expectOperand = true;
+
+  while (!error) {
+	while (str != end && isspace(*str)) ++str;
+
+	if (expectOperand) {
+	  if (peek(str, end) == '(') {
+		++str;
+		ops.push_back(PendingOp{PendingOp::PAREN, TRUE, -1, 0, 0});
+	  } else if (peek(str, end) == '~') {
+		++str;
+		ops.push_back(PendingOp{PendingOp::PREFIX, NOT, 4, 1, 0});
+	  } else if (peek(str, end) == '[' || peek(str, end) == '<') {
+		// '[]', '<>', '[role]', '<role>', and inverse roles '[-role]', '<-role>'.
+		const char close = (*str == '[') ? ']' : '>';
+		size_t n = 1;
+		if (peek(str+n, end) == '-') ++n;
+		while (isalnum(peek(str+n, end))) ++n;
+		if (peek(str+n, end) != close || (n == 2 && peek(str+1, end) == '-')) {
+		  error = "malformed modality";
+		  break;
+		}
+		uint32_t role = arena().roles().intern(str+1, n-1);
+		if (syntax == INTOHYLO && n == 3 && strncmp(str+1, "r1", 2) == 0) {
+		  role = arena().roles().intern("", 0);
+		}
+		ops.push_back(PendingOp{PendingOp::PREFIX, close == ']' ? BOX : DIA, 4, 1, role});
+		str += n + 1;
+	  } else if (isalpha(peek(str, end)) || peek(str, end) == '_') {
+		size_t n = 1;
+		while (isalnum(peek(str+n, end)) || peek(str+n, end) == '_') ++n;
+		if (syntax == LWB && n == 3
+			&& (strncmp(str, "box", 3) == 0 || strncmp(str, "dia", 3) == 0)) {
+		  ops.push_back(PendingOp{PendingOp::PREFIX, *str == 'b' ? BOX : DIA, 4, 1,
+								  arena().roles().intern("", 0)});
+		  str += n;
+		  continue;
+		}
+		if (n == 4 && (strncmp(str, "True", 4) == 0
+					   || (syntax != BDDTAB && strncmp(str, "true", 4) == 0))) {
+		  operands.push_back(makeConst(true));
+		} else if (n == 5 && (strncmp(str, "False", 5) == 0
+							  || (syntax != BDDTAB && strncmp(str, "false", 5) == 0))) {
+		  operands.push_back(makeConst(false));
+		} else {
+		  operands.push_back(makeAtom(arena().props().intern(str, n)));
+		}
+		str += n;
+		expectOperand = false;
+	  } else {
+		error = (str != end) ? "expected a formula" : "unexpected end of input";
+	  }
+	  continue;
+	}
+
+	// Expecting a binary connective, a closing parenthesis, or the end.
+	KFormulaType op;
+	size_t len = 1;
+	if (str == end || *str == ')') {
+	  while (!ops.empty() && ops.back().kind != PendingOp::PAREN) {
+		reduce(ops, operands);
+	  }
+	  if (str == end) {
+		if (!ops.empty()) error = "missing ')'";
+		break;
+	  }
+	  if (ops.empty()) {
+		error = "unmatched ')'";
+		break;
+	  }
+	  ops.pop_back();
+	  ++str;
+	  continue;
+	} else if (end - str >= 3 && strncmp(str, "<=>", 3) == 0) {
+	  op = EQU;
+	  len = 3;
+	} else if (end - str >= 2 && strncmp(str, "=>", 2) == 0) {
+	  op = IMP;
+	  len = 2;
+	} else if (syntax != BDDTAB && end - str >= 3 && strncmp(str, "<->", 3) == 0) {
+	  op = EQU;
+	  len = 3;
+	} else if (syntax != BDDTAB && end - str >= 2 && strncmp(str, "->", 2) == 0) {
+	  op = IMP;
+	  len = 2;
+	} else if (syntax == LWB && *str == 'v' && !isalnum(peek(str+1, end))
+			   && peek(str+1, end) != '_') {
+	  op = OR;
+	} else if (*str == '|') {
+	  op = OR;
+	} else if (*str == '&') {
+	  op = AND;
+	} else {
+	  error = "expected a connective";
+	  break;
+	}
+	str += len;
+
+	const int prec = binaryPrec(op);
+	// Left associative (n-ary) connectives also absorb pending operators of
+	// equal precedence; right associative ones leave them pending.
+	const bool nary = (op == AND || op == OR);
+	while (!ops.empty() && ops.back().kind != PendingOp::PAREN
+		   && ops.back().prec > prec) {
+	  reduce(ops, operands);
+	}
+	if (nary && !ops.empty() && ops.back().kind == PendingOp::BINARY && ops.back().op == op) {
+	  ++ops.back().arity;
+	} else {
+	  ops.push_back(PendingOp{PendingOp::BINARY, op, prec, 2, 0});
+	}
+	expectOperand = true;
+  }
 
-  if (*str) { std::cerr << "ERROR: \""<< *str << "\"" << std::endl;}
-  assert(! *str);
+  if (error) {
+	std::cerr << "ERROR: Could not parse input at character " << (str - begin + 1)
+			  << ": " << error << "." << std::endl;
+	return NULL;
+  }
 
-  return ret;
+  assert(operands.size() == 1);
+  return operands.back();
 }
-
@@ -5,14 +5,36 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <stdio.h>
 
 #include <ostream>
 
+#include "SymbolTable.h"
+
+class KFormulaArena;
+
+/*
+ * Formulae are hash-consed: every node is created through one of the
+ * make*() factories below, which return the unique node for that structure.
+ * Structurally identical subformulae are therefore the same object, and
+ * equality (or use as a map key) is a pointer comparison.
+ *
+ * Nodes are compact (op, role, var and two 32-bit operand fields) and are
+ * bump allocated in the front end's KFormulaArena, which owns all of them
+ * and frees them in one shot. Operands are referred to by node index:
+ *   AP        left = proposition symbol
+ *   BOX/DIA   left = operand, right = role symbol
+ *   NOT       left = operand
+ *   IMP/EQU   left, right = operands
+ *   AND/OR    left = offset into the arena's operand lists, right = count
+ */
 class KFormula {
 public:
 
   enum KFormulaType {
-	TRUE, FALSE, 
+	TRUE, FALSE,
 	AP,                // Atomic Proposition
 	DIA, BOX,          // Modal operators
 	NOT,               // Unary classical operator
@@ -20,68 +42,197 @@ public:
   };
   static const unsigned int TYPE_COUNT = OR+1;
 
-  KFormula(KFormulaType, KFormula* , KFormula*);
-  KFormula(KFormulaType, KFormula* , std::shared_ptr<KFormula> const &);
-  KFormula(KFormulaType, std::shared_ptr<KFormula> const &, KFormula*);
-  KFormula(KFormulaType, std::shared_ptr<KFormula> const &, std::shared_ptr<KFormula> const &);
-  KFormula(const std::string&);
-  explicit KFormula(bool);
-
-  KFormula(const KFormula & other);
-  
-  ~KFormula();
-
-  bool operator==(const KFormula&) const;
-
+  static KFormula* makeConst(bool);
+  static KFormula* makeAtom(uint32_t prop);
+  static KFormula* makeAtom(const std::string& prop);
+  static KFormula* makeNot(KFormula*);
+  // BOX or DIA over the given role ("" for the unnamed modality).
+  static KFormula* makeModal(KFormulaType, uint32_t role, KFormula*);
+  static KFormula* makeModal(KFormulaType, const std::string& role, KFormula*);
+  // IMP, EQU, or a two operand AND/OR.
+  static KFormula* makeBinary(KFormulaType, KFormula*, KFormula*);
+  // n-ary AND/OR. Operands of the same connective are spliced in, so chains stay flat.
+  static KFormula* makeNary(KFormulaType, const std::vector<KFormula*>&);
+
+  // The arena holding every formula node: the shared one, unless the calling
+  // thread has been given its own with setArena().
+  static inline KFormulaArena& arena();
+  // Makes the calling thread create (and look up) formulae in the given
+  // arena, or in the shared one again for NULL. Front end threads each work
+  // in a private arena, merged afterwards with KFormulaArena::import().
+  static void setArena(KFormulaArena* a) { threadArena = a; };
+
+  bool operator==(const KFormula& other) const { return this == &other; };
+
+  // Size of the formula as a tree, and as a DAG (distinct nodes).
   size_t size() const;
+  size_t dagSize() const;
 
 
   std::string* toString() const;
 
-  int compare(const KFormula&) const;
-
-  KFormulaType getop() const {return op;};
-  KFormula& getleft() const {return *left;};
-  const std::shared_ptr<KFormula> getleftptr() const {return left;};
-  KFormula& getright() const {return *right;};
-  const std::shared_ptr<KFormula> getrightptr() const {return right;};
+  KFormulaType getop() const {return static_cast<KFormulaType>(op);};
+  inline KFormula& getleft() const;
+  inline KFormula& getright() const;
+  // Operands of any connective. AND/OR have two or more, IMP/EQU exactly two,
+  // DIA/BOX/NOT one, and constants and atoms none.
+  inline size_t arity() const;
+  inline KFormula& getarg(size_t i) const;
+  // Index of this node in the arena. Dense, so usable to index memo tables.
+  uint32_t getid() const { return id; };
+  size_t gethash() const { return hash; };
+  // BDD variable of an atom or box, or -1 if none has been assigned.
   void setvar(int _var) { var = _var; };
   int getvar() const { return var; };
   void setrole(int _role) {role = _role;};
   int getrole() const {return role;};
-  void setprop(std::string _prop) { prop = _prop; };
-  std::string getprop() { return prop; };
-
+  // Proposition symbol of an atom, or role symbol of a modal operator
+  // (see KFormulaArena::props() and roles()).
+  uint32_t getsymbol() const { return op == AP ? left : right; };
+  // Name of that symbol.
+  inline const std::string& getprop() const;
+
+  // Input syntaxes. BDDTAB is the native one (see README). The benchmark
+  // dialects additionally accept '->', '<->', 'true' and 'false'; in
+  // INTOHYLO the role r1 is the unnamed modality, and LWB writes modalities
+  // as 'box' and 'dia' and disjunction as 'v'.
+  enum Syntax { BDDTAB, INTOHYLO, LWB };
+
+  // Returns NULL for empty input, and also (after reporting the problem on
+  // std::cerr) for malformed input.
   static KFormula* parseKFormula(const char*);
+  // As above, for the characters in [begin, end).
+  static KFormula* parseKFormula(const char* begin, const char* end, Syntax = BDDTAB);
 
   struct equal_to {bool operator()(const KFormula& a, const KFormula& b) const {return a == b;}};
-  struct less_than {bool operator()(const KFormula& a, const KFormula& b) const {return a.compare(b) > 0;}};
-  struct greater_than {bool operator()(const KFormula& a, const KFormula& b) const {return a.compare(b) < 0;}};
-  
+  struct hasher {size_t operator()(const KFormula* f) const {return f->hash;}};
+
 
 
   friend std::ostream& operator<<(std::ostream& ,const KFormula& );
 
 private:
-  KFormula();
+  friend class KFormulaArena;
+
+  static KFormulaArena theArena;
+  static thread_local KFormulaArena* threadArena;
 
   void toString(std::string& buf, int precedence) const;
 
-  static KFormula* parseEQU(const char*& str);
-  static KFormula* parseIMP(const char*& str);
-  static KFormula* parseAND(const char*& str);
-  static KFormula* parseOR(const char*& str);
-  static KFormula* parseRest(const char*& str);
+  uint8_t op;
+  int32_t role;
+  int32_t var;
+  uint32_t left, right;
+  uint32_t hash;
+  uint32_t id;
+
+};
+
 
-  KFormulaType op;
-  std::shared_ptr<KFormula> left, right;
-  std::string prop;
-  int var;
-  int role;
+/*
+ * Bump allocator and unique table for formula nodes.
+ *
+ * Nodes live in fixed size blocks, so their addresses never change while
+ * the arena grows, and are numbered densely in allocation order (operands
+ * always before the formulae using them). The operand lists of n-ary nodes
+ * and the proposition/role symbols are kept alongside. Nothing is freed
+ * individually; clear() releases the whole front end at once.
+ */
+class KFormulaArena {
+public:
+  KFormulaArena();
+  ~KFormulaArena();
+
+  KFormula& node(uint32_t i) const { return blocks[i >> BLOCK_BITS][i & BLOCK_MASK]; };
+  const uint32_t* operands(uint32_t offset) const { return &operandPool[offset]; };
+
+  // Proposition and role names.
+  SymbolTable& props() { return propSymbols; };
+  SymbolTable& roles() { return roleSymbols; };
+
+  // Unique node with the given fields, allocated if not seen before.
+  KFormula* intern(KFormula::KFormulaType op, uint32_t left, uint32_t right);
+  // As above for AND/OR, whose operands have been appended to the operand
+  // pool from 'offset' on. The appended operands are discarded again if an
+  // identical node already exists.
+  KFormula* internNary(KFormula::KFormulaType op, uint32_t offset);
+  // Append an operand for internNary().
+  void pushOperand(uint32_t i) { operandPool.push_back(i); };
+  uint32_t operandCount() const { return operandPool.size(); };
+  void discardOperands(uint32_t offset) { operandPool.resize(offset); };
+
+  // Copies node 'root' of another arena, and everything below it, into this
+  // one, returning the equivalent node here. map[i] is the index here + 1 of
+  // node i of 'from' (0 while not copied); it is grown and filled in as nodes
+  // are copied, so passing the same map again skips shared subformulae.
+  KFormula* import(const KFormulaArena& from, uint32_t root, std::vector<uint32_t>& map);
+
+  // Writes every node (with its BDD variable and role), operand list and
+  // symbol to a binary image, and reads them back into an empty arena, with
+  // the same indices. load() returns false on a malformed image.
+  bool save(FILE* out) const;
+  bool load(FILE* in);
+
+  // Number of nodes, and bytes held by the arena.
+  size_t size() const { return count; };
+  size_t footprint() const;
+
+  // Frees every node at once. All KFormula pointers become invalid.
+  void clear();
 
+private:
+  static const unsigned int BLOCK_BITS = 14;
+  static const uint32_t BLOCK_MASK = (1u << BLOCK_BITS) - 1;
+
+  KFormulaArena(const KFormulaArena&);
+  KFormulaArena& operator=(const KFormulaArena&);
+
+  uint32_t find(const KFormula& probe) const;
+  KFormula* allocate(const KFormula& probe);
+  void grow();
+
+  std::vector<KFormula*> blocks;
+  uint32_t count;
+  std::vector<uint32_t> operandPool;
+  // Open addressing, linear probing. Holds node index + 1, 0 when empty.
+  std::vector<uint32_t> table;
+  SymbolTable propSymbols;
+  SymbolTable roleSymbols;
 };
 
 
+inline KFormula& KFormula::getleft() const {
+  return arena().node(op == AND || op == OR ? arena().operands(left)[0] : left);
+}
+
+inline KFormula& KFormula::getright() const {
+  return arena().node(op == AND || op == OR ? arena().operands(left)[1] : right);
+}
+
+inline size_t KFormula::arity() const {
+  switch (op) {
+  case TRUE: case FALSE: case AP: return 0;
+  case DIA: case BOX: case NOT: return 1;
+  case IMP: case EQU: return 2;
+  default: return right;
+  }
+}
+
+inline KFormula& KFormula::getarg(size_t i) const {
+  if (op == AND || op == OR) return arena().node(arena().operands(left)[i]);
+  return arena().node(i == 0 ? left : right);
+}
+
+inline const std::string& KFormula::getprop() const {
+  static const std::string none;
+  if (op == AP) return arena().props().name(left);
+  if (op == BOX || op == DIA) return arena().roles().name(right);
+  return none;
+}
+
+inline KFormulaArena& KFormula::arena() {
+  return threadArena ? *threadArena : theArena;
+}
 
 
 #endif
@@ -0,0 +1,376 @@
+#include "OwlReader.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+namespace {
+
+const char* const OWL_THING = "http://www.w3.org/2002/07/owl#Thing";
+const char* const OWL_NOTHING = "http://www.w3.org/2002/07/owl#Nothing";
+
+// Axioms that say nothing about the models of the ontology.
+const char* const IGNORED[] = {
+  "Declaration", "AnnotationAssertion", "SubAnnotationPropertyOf",
+  "AnnotationPropertyDomain", "AnnotationPropertyRange", "DatatypeDefinition",
+  NULL
+};
+
+// The IRI with everything but letters and digits removed, as owlToMMK.jar does.
+std::string strip(const std::string& iri) {
+  std::string name;
+  for (std::string::const_iterator it = iri.begin(); it != iri.end(); ++it) {
+	if (isalnum(static_cast<unsigned char>(*it))) name += *it;
+  }
+  return name;
+}
+
+bool isIgnored(const std::string& keyword) {
+  for (const char* const* k = IGNORED; *k; ++k) {
+	if (keyword == *k) return true;
+  }
+  return false;
+}
+
+}
+
+OwlReader::OwlReader(const char* _path)
+  :path(_path)
+  ,text()
+  ,pos(0)
+  ,line(1)
+  ,token(END)
+  ,value()
+  ,prefixes()
+  ,roleAliases()
+  ,translated()
+{
+  std::ifstream file(_path, std::ios::in | std::ios::binary);
+  if (!file) {
+	std::cerr << "ERROR: Could not open ontology file " << path << "." << std::endl;
+	exit(1);
+  }
+  text.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  prefixes["owl"] = "http://www.w3.org/2002/07/owl#";
+  prefixes["rdf"] = "http://www.w3.org/1999/02/22-rdf-syntax-ns#";
+  prefixes["rdfs"] = "http://www.w3.org/2000/01/rdf-schema#";
+  prefixes["xsd"] = "http://www.w3.org/2001/XMLSchema#";
+  prefixes["xml"] = "http://www.w3.org/XML/1998/namespace";
+
+  // InverseObjectProperties renames roles everywhere, including in earlier
+  // axioms, so those are all collected before anything is translated.
+  readOntology(true);
+  readOntology(false);
+}
+
+void OwlReader::fail(const std::string& message) {
+  std::cerr << "ERROR: In " << path << " on line " << line << ": " << message << "." << std::endl;
+  exit(1);
+}
+
+OwlReader::Token OwlReader::next() {
+  const size_t size = text.size();
+  for (;;) {
+	while (pos < size && isspace(static_cast<unsigned char>(text[pos]))) {
+	  if (text[pos] == '\n') ++line;
+	  ++pos;
+	}
+	if (pos < size && text[pos] == '#') {
+	  while (pos < size && text[pos] != '\n') ++pos;
+	  continue;
+	}
+	break;
+  }
+  value.clear();
+  if (pos == size) return token = END;
+
+  const char c = text[pos];
+  if (c == '(' || c == ')' || c == '=') {
+	++pos;
+	return token = (c == '(') ? OPEN : (c == ')') ? CLOSE : EQUALS;
+  }
+  if (c == '<') {
+	const void* close = memchr(&text[pos], '>', size - pos);
+	if (!close) fail("Unterminated IRI");
+	const size_t end = static_cast<const char*>(close) - &text[0];
+	value.assign(&text[pos + 1], &text[end]);
+	pos = end + 1;
+	return token = IRI;
+  }
+  if (c == '"') {
+	for (++pos; pos < size && text[pos] != '"'; ++pos) {
+	  if (text[pos] == '\\') ++pos;
+	  else if (text[pos] == '\n') ++line;
+	}
+	if (pos >= size) fail("Unterminated literal");
+	++pos;
+	if (pos + 1 < size && text[pos] == '^' && text[pos+1] == '^') {
+	  // Typed literal; the datatype is part of it.
+	  pos += 2;
+	  next();
+	} else if (pos < size && text[pos] == '@') {
+	  for (++pos; pos < size && (isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '-'); ++pos);
+	}
+	value.clear();
+	return token = LITERAL;
+  }
+  const size_t begin = pos;
+  while (pos < size && !isspace(static_cast<unsigned char>(text[pos]))
+		 && !strchr("()=<\"#", text[pos])) {
+	++pos;
+  }
+  value.assign(&text[begin], &text[pos]);
+  return token = NAME;
+}
+
+OwlReader::Token OwlReader::peek() {
+  const size_t savedPos = pos;
+  const size_t savedLine = line;
+  const Token savedToken = token;
+  const std::string savedValue = value;
+  const Token t = next();
+  pos = savedPos;
+  line = savedLine;
+  token = savedToken;
+  value = savedValue;
+  return t;
+}
+
+void OwlReader::expect(Token t) {
+  if (next() != t) {
+	fail(t == OPEN ? "Expected '('" : t == CLOSE ? "Expected ')'" : t == EQUALS ? "Expected '='"
+		 : t == END ? "Unexpected text after the ontology" : "Expected an IRI");
+  }
+}
+
+// Skips to just after the ')' closing a group whose '(' has been read.
+void OwlReader::skipGroup() {
+  for (size_t open = 1; open > 0;) {
+	switch (next()) {
+	  case OPEN: ++open; break;
+	  case CLOSE: --open; break;
+	  case END: fail("Missing ')'"); break;
+	  default: break;
+	}
+  }
+}
+
+// Skips any Annotation(...) at the start of an axiom.
+void OwlReader::skipAnnotations() {
+  for (;;) {
+	const size_t savedPos = pos;
+	const size_t savedLine = line;
+	if (next() != NAME || value != "Annotation" || peek() != OPEN) {
+	  pos = savedPos;
+	  line = savedLine;
+	  return;
+	}
+	next();
+	skipGroup();
+  }
+}
+
+// The full IRI of the IRI or abbreviated IRI just read.
+std::string OwlReader::expandIRI() {
+  if (token == IRI) return value;
+  const size_t colon = value.find(':');
+  if (token != NAME || colon == std::string::npos) fail("Expected an IRI");
+  std::unordered_map<std::string, std::string>::const_iterator it = prefixes.find(value.substr(0, colon));
+  if (it == prefixes.end()) fail("Undeclared prefix in " + value);
+  return it->second + value.substr(colon + 1);
+}
+
+// Name of the next class or property.
+std::string OwlReader::entityName() {
+  next();
+  const std::string name = strip(expandIRI());
+  if (name.empty()) fail("IRI has no letters or digits");
+  return name;
+}
+
+/*
+ * Reads an object property expression, returning the name of the property
+ * and setting inverse if it is wrapped in ObjectInverseOf.
+ */
+std::string OwlReader::propertyName(bool& inverse) {
+  inverse = false;
+  const size_t savedPos = pos;
+  const size_t savedLine = line;
+  if (next() == NAME && value == "ObjectInverseOf") {
+	expect(OPEN);
+	const std::string name = entityName();
+	expect(CLOSE);
+	inverse = true;
+	return name;
+  }
+  pos = savedPos;
+  line = savedLine;
+  return entityName();
+}
+
+// Follows InverseObjectProperties renamings, flipping inverse for each.
+std::string OwlReader::resolveRole(const std::string& name, bool& inverse) const {
+  std::string role = name;
+  std::unordered_map<std::string, std::pair<std::string, bool>>::const_iterator it;
+  while ((it = roleAliases.find(role)) != roleAliases.end()) {
+	role = it->second.first;
+	inverse = inverse != it->second.second;
+  }
+  return role;
+}
+
+/*
+ * Reads the prefix declarations and the ontology. The first pass only
+ * collects InverseObjectProperties axioms; the second translates the rest.
+ */
+void OwlReader::readOntology(bool collectInverses) {
+  pos = 0;
+  line = 1;
+  for (;;) {
+	if (next() != NAME) fail("Expected Prefix or Ontology");
+	if (value == "Ontology") break;
+	if (value != "Prefix") fail("Expected Prefix or Ontology");
+	expect(OPEN);
+	if (next() != NAME || value.empty() || value[value.size() - 1] != ':') {
+	  fail("Expected a prefix name");
+	}
+	const std::string prefix = value.substr(0, value.size() - 1);
+	expect(EQUALS);
+	expect(IRI);
+	prefixes[prefix] = value;
+	expect(CLOSE);
+  }
+
+  expect(OPEN);
+  for (;;) {
+	const Token t = next();
+	if (t == CLOSE) break;
+	if (t == NAME && peek() == OPEN) {
+	  const std::string keyword = value;
+	  next();
+	  if (keyword == "Import" || keyword == "Annotation" || isIgnored(keyword)) {
+		skipGroup();
+	  } else {
+		readAxiom(keyword, collectInverses);
+	  }
+	} else if (t != IRI && t != NAME) {
+	  // Anything but the ontology and version IRIs.
+	  fail("Expected an axiom");
+	}
+  }
+  expect(END);
+}
+
+// Reads the rest of an axiom whose keyword and '(' have been read.
+void OwlReader::readAxiom(const std::string& keyword, bool collectInverses) {
+  const bool supported = keyword == "SubClassOf" || keyword == "EquivalentClasses"
+	|| keyword == "DisjointClasses" || keyword == "DisjointUnion"
+	|| keyword == "InverseObjectProperties";
+  if (!supported) {
+	fail("Axiom type " + keyword + " not supported");
+  }
+  if (collectInverses != (keyword == "InverseObjectProperties")) {
+	skipGroup();
+	return;
+  }
+  skipAnnotations();
+
+  if (keyword == "InverseObjectProperties") {
+	// Q = P^-, and so Q is renamed to -P (or P itself, if P is already inverted).
+	bool invP, invQ;
+	std::string p = propertyName(invP);
+	std::string q = propertyName(invQ);
+	p = resolveRole(p, invP);
+	q = resolveRole(q, invQ);
+	if (p == q) {
+	  if (invP == invQ) fail("Properties that are their own inverse are not supported");
+	} else {
+	  roleAliases[q] = std::make_pair(p, invP == invQ);
+	}
+	expect(CLOSE);
+	return;
+  }
+
+  std::vector<KFormula*> parts;
+  if (keyword == "SubClassOf") {
+	KFormula* sub = classExpression();
+	KFormula* super = classExpression();
+	parts.push_back(KFormula::makeBinary(KFormula::OR, KFormula::makeNot(sub), super));
+  } else if (keyword == "EquivalentClasses") {
+	std::vector<KFormula*> classes;
+	classExpressions(classes, 2);
+	for (size_t i = 0; i < classes.size(); ++i) {
+	  for (size_t j = i + 1; j < classes.size(); ++j) {
+		parts.push_back(KFormula::makeBinary(KFormula::EQU, classes[i], classes[j]));
+	  }
+	}
+  } else {
+	KFormula* united = NULL;
+	if (keyword == "DisjointUnion") {
+	  united = KFormula::makeAtom(entityName());
+	}
+	std::vector<KFormula*> classes;
+	classExpressions(classes, 2);
+	for (size_t i = 0; i + 1 < classes.size(); ++i) {
+	  std::vector<KFormula*> rest;
+	  for (size_t j = i + 1; j < classes.size(); ++j) {
+		rest.push_back(KFormula::makeNot(classes[j]));
+	  }
+	  parts.push_back(KFormula::makeBinary(KFormula::OR, KFormula::makeNot(classes[i]),
+										   KFormula::makeNary(KFormula::AND, rest)));
+	}
+	if (united) {
+	  parts.push_back(KFormula::makeBinary(KFormula::EQU, united, KFormula::makeNary(KFormula::OR, classes)));
+	}
+  }
+  expect(CLOSE);
+  translated.push_back(KFormula::makeNary(KFormula::AND, parts));
+}
+
+KFormula* OwlReader::classExpression() {
+  const Token t = next();
+  if (t == IRI || (t == NAME && peek() != OPEN)) {
+	const std::string iri = expandIRI();
+	if (iri == OWL_THING) return KFormula::makeConst(true);
+	if (iri == OWL_NOTHING) return KFormula::makeConst(false);
+	const std::string name = strip(iri);
+	if (name.empty()) fail("IRI has no letters or digits");
+	return KFormula::makeAtom(name);
+  }
+  if (t != NAME) fail("Expected a class expression");
+
+  const std::string keyword = value;
+  expect(OPEN);
+  KFormula* result = NULL;
+  if (keyword == "ObjectIntersectionOf" || keyword == "ObjectUnionOf") {
+	std::vector<KFormula*> operands;
+	classExpressions(operands, 2);
+	result = KFormula::makeNary(keyword == "ObjectUnionOf" ? KFormula::OR : KFormula::AND, operands);
+  } else if (keyword == "ObjectComplementOf") {
+	result = KFormula::makeNot(classExpression());
+  } else if (keyword == "ObjectSomeValuesFrom" || keyword == "ObjectAllValuesFrom") {
+	bool inverse;
+	std::string role = propertyName(inverse);
+	role = resolveRole(role, inverse);
+	if (inverse) role = "-" + role;
+	result = KFormula::makeModal(keyword == "ObjectSomeValuesFrom" ? KFormula::DIA : KFormula::BOX,
+								 role, classExpression());
+  } else {
+	fail("Class expression type " + keyword + " not supported");
+  }
+  expect(CLOSE);
+  return result;
+}
+
+// Reads class expressions up to the next ')', which is left unread.
+void OwlReader::classExpressions(std::vector<KFormula*>& out, size_t atLeast) {
+  while (peek() != CLOSE) {
+	out.push_back(classExpression());
+  }
+  if (out.size() < atLeast) {
+	fail("Expected at least " + std::to_string(atLeast) + " class expressions");
+  }
+}
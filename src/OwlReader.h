@@ -0,0 +1,72 @@
+#ifndef _OWLREADER_H_
+#define _OWLREADER_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "KFormula.h"
+
+/*
+ * Reads an ontology in OWL 2 functional syntax directly into the formula
+ * DAG, replacing the owlToMMK.jar translation to a .k file.
+ *
+ * The ALC fragment is translated to multi-modal K as the jar does, with
+ * every object property a separate modality:
+ *   SubClassOf(C D)              ~C | D
+ *   EquivalentClasses(C1 .. Cn)  Ci <=> Cj for every i < j
+ *   DisjointClasses(C1 .. Cn)    ~Ci | (~Ci+1 & .. & ~Cn) for every i < n
+ *   DisjointUnion(C D1 .. Dn)    DisjointClasses(D1 .. Dn) and C <=> (D1 | .. | Dn)
+ *   ObjectIntersectionOf, ObjectUnionOf, ObjectComplementOf  &, |, ~
+ *   ObjectSomeValuesFrom(R C)    <R>C
+ *   ObjectAllValuesFrom(R C)     [R]C
+ * Names are the IRIs with everything but letters and digits removed, and
+ * owl:Thing and owl:Nothing are True and False. ObjectInverseOf(R) is the
+ * role -R, and InverseObjectProperties(P Q) makes Q the role -P throughout.
+ *
+ * Declarations and annotations are skipped. Any other logical axiom or class
+ * expression is reported on std::cerr, and the program exits.
+ */
+class OwlReader {
+public:
+  // Reads and translates the whole file. Exits if it can't be read or parsed.
+  explicit OwlReader(const char* path);
+
+  // One formula per logical axiom, in the order of the file.
+  const std::vector<KFormula*>& axioms() const { return translated; };
+
+private:
+  enum Token { END, OPEN, CLOSE, EQUALS, IRI, NAME, LITERAL };
+
+  Token next();
+  Token peek();
+  void expect(Token t);
+  void skipGroup();
+  void skipAnnotations();
+  void fail(const std::string& message);
+
+  std::string expandIRI();
+  std::string entityName();
+  std::string propertyName(bool& inverse);
+  std::string resolveRole(const std::string& name, bool& inverse) const;
+
+  void readOntology(bool collectInverses);
+  void readAxiom(const std::string& keyword, bool collectInverses);
+  KFormula* classExpression();
+  void classExpressions(std::vector<KFormula*>& out, size_t atLeast);
+
+  std::string path;
+  std::vector<char> text;
+  size_t pos;
+  size_t line;
+  // The token last returned by next(), and its text for IRI/NAME/LITERAL.
+  Token token;
+  std::string value;
+
+  std::unordered_map<std::string, std::string> prefixes;
+  // Roles declared the inverse of another: name -> (role, inverted).
+  std::unordered_map<std::string, std::pair<std::string, bool>> roleAliases;
+  std::vector<KFormula*> translated;
+};
+
+#endif
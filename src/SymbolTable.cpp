@@ -0,0 +1,87 @@
+#include "SymbolTable.h"
+#include <string.h>
+
+static inline uint32_t hashName(const char* name, size_t length) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+	h = (h ^ static_cast<unsigned char>(name[i])) * 16777619u;
+  }
+  return h;
+}
+
+const uint32_t SymbolTable::NONE;
+
+SymbolTable::SymbolTable()
+  :names()
+  ,hashes()
+  ,inverses()
+  ,table(256, 0)
+{
+}
+
+void SymbolTable::clear() {
+  std::vector<std::string>().swap(names);
+  std::vector<uint32_t>().swap(hashes);
+  std::vector<uint32_t>().swap(inverses);
+  std::vector<uint32_t>(256, 0).swap(table);
+}
+
+uint32_t SymbolTable::find(const char* name, size_t length, uint32_t hash) const {
+  const size_t mask = table.size() - 1;
+  for (size_t slot = hash & mask; table[slot] != 0; slot = (slot + 1) & mask) {
+	const uint32_t s = table[slot] - 1;
+	if (hashes[s] == hash && names[s].size() == length
+		&& memcmp(names[s].data(), name, length) == 0) {
+	  return s;
+	}
+  }
+  return NONE;
+}
+
+void SymbolTable::grow() {
+  std::vector<uint32_t> bigger(table.size() * 2, 0);
+  const size_t mask = bigger.size() - 1;
+  for (uint32_t s = 0; s < names.size(); ++s) {
+	size_t slot = hashes[s] & mask;
+	while (bigger[slot] != 0) slot = (slot + 1) & mask;
+	bigger[slot] = s + 1;
+  }
+  table.swap(bigger);
+}
+
+uint32_t SymbolTable::lookup(const std::string& name) const {
+  return find(name.data(), name.size(), hashName(name.data(), name.size()));
+}
+
+uint32_t SymbolTable::intern(const char* name, size_t length) {
+  const uint32_t hash = hashName(name, length);
+  uint32_t s = find(name, length, hash);
+  if (s != NONE) return s;
+
+  s = names.size();
+  names.push_back(std::string(name, length));
+  hashes.push_back(hash);
+  inverses.push_back(NONE);
+  if (names.size() * 2 > table.size()) {
+	grow();
+  } else {
+	size_t slot = hash & (table.size() - 1);
+	while (table[slot] != 0) slot = (slot + 1) & (table.size() - 1);
+	table[slot] = s + 1;
+  }
+
+  // Pair "-r" with "r", if the other one is already known.
+  uint32_t other;
+  if (length > 1 && name[0] == '-') {
+	other = find(name + 1, length - 1, hashName(name + 1, length - 1));
+  } else {
+	std::string negated = "-" + names[s];
+	other = find(negated.data(), negated.size(), hashName(negated.data(), negated.size()));
+  }
+  if (other != NONE) {
+	inverses[s] = other;
+	inverses[other] = s;
+  }
+  return s;
+}
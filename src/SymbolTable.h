@@ -0,0 +1,46 @@
+#ifndef _SYMBOLTABLE_H_
+#define _SYMBOLTABLE_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Interns identifiers (proposition or role names) as dense integer ids.
+ * Each distinct name is hashed and stored once, when it is first read, so
+ * everything after parsing compares and indexes ids instead of strings.
+ *
+ * Names of the form "-r" are paired with "r" as they are interned, so the
+ * inverse of a role is an id lookup.
+ */
+class SymbolTable {
+public:
+  static const uint32_t NONE = 0xffffffffu;
+
+  SymbolTable();
+
+  uint32_t intern(const char* name, size_t length);
+  uint32_t intern(const std::string& name) { return intern(name.data(), name.size()); };
+  // The symbol of an already interned name, or NONE.
+  uint32_t lookup(const std::string& name) const;
+
+  const std::string& name(uint32_t symbol) const { return names[symbol]; };
+  // The symbol of "-name" for "name" and vice versa, or NONE if not interned.
+  uint32_t inverse(uint32_t symbol) const { return inverses[symbol]; };
+  bool isInverse(uint32_t symbol) const { return !names[symbol].empty() && names[symbol][0] == '-'; };
+  size_t size() const { return names.size(); };
+
+  void clear();
+
+private:
+  uint32_t find(const char* name, size_t length, uint32_t hash) const;
+  void grow();
+
+  std::vector<std::string> names;
+  std::vector<uint32_t> hashes;
+  std::vector<uint32_t> inverses;
+  // Open addressing, linear probing. Holds symbol + 1, 0 when empty.
+  std::vector<uint32_t> table;
+};
+
+#endif
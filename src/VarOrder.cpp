@@ -0,0 +1,383 @@
+#include "VarOrder.h"
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+
+const char* const NAMES[] = { "bfs", "dfs", "depth", "force", "children" };
+
+bool isAtom(const KFormula* f) {
+  return f->getop() == KFormula::AP || f->getop() == KFormula::BOX;
+}
+
+/*
+ * Variables of the atoms (propositions and boxes) below f, without looking
+ * inside boxes. With throughConnectives false only the immediate operands
+ * of f (past negations) count. Sorted and without duplicates. seen/stamp
+ * mark the nodes visited, so shared subformulae are explored once.
+ */
+void leafVars(const KFormula* f, bool throughConnectives, std::vector<uint32_t>& seen,
+			  uint32_t stamp, std::vector<int>& out) {
+  out.clear();
+  std::vector<const KFormula*> pending;
+  if (throughConnectives || isAtom(f)) {
+	pending.push_back(f);
+  } else {
+	for (size_t i = 0; i < f->arity(); ++i) pending.push_back(&f->getarg(i));
+  }
+  while (!pending.empty()) {
+	const KFormula* g = pending.back();
+	pending.pop_back();
+	if (seen[g->getid()] == stamp) continue;
+	seen[g->getid()] = stamp;
+	if (isAtom(g)) {
+	  out.push_back(g->getvar());
+	} else if (g->getop() == KFormula::NOT || throughConnectives) {
+	  for (size_t i = 0; i < g->arity(); ++i) pending.push_back(&g->getarg(i));
+	}
+  }
+  std::sort(out.begin(), out.end());
+  out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+// Every distinct node below the roots, in depth-first pre-order.
+void allNodes(const std::vector<KFormula*>& roots, std::vector<const KFormula*>& nodes) {
+  std::vector<bool> visited(KFormula::arena().size());
+  std::vector<const KFormula*> pending(roots.rbegin(), roots.rend());
+  while (!pending.empty()) {
+	const KFormula* f = pending.back();
+	pending.pop_back();
+	if (visited[f->getid()]) continue;
+	visited[f->getid()] = true;
+	nodes.push_back(f);
+	for (size_t i = f->arity(); i-- > 0;) pending.push_back(&f->getarg(i));
+  }
+}
+
+void dfsOrder(const std::vector<KFormula*>& roots, std::vector<int>& order) {
+  std::vector<const KFormula*> nodes;
+  allNodes(roots, nodes);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+	if (isAtom(nodes[i])) order.push_back(nodes[i]->getvar());
+  }
+}
+
+void depthOrder(const std::vector<KFormula*>& roots, std::vector<int>& order) {
+  std::vector<std::vector<int>> layers;
+  std::vector<bool> visited(KFormula::arena().size());
+  std::vector<const KFormula*> layer(roots.begin(), roots.end());
+  std::vector<const KFormula*> next;
+  // Layer by layer, so every atom is first met at its least modal depth.
+  while (!layer.empty()) {
+	layers.push_back(std::vector<int>());
+	while (!layer.empty()) {
+	  const KFormula* f = layer.back();
+	  layer.pop_back();
+	  if (visited[f->getid()]) continue;
+	  visited[f->getid()] = true;
+	  if (isAtom(f)) {
+		layers.back().push_back(f->getvar());
+		if (f->getop() == KFormula::BOX) next.push_back(&f->getleft());
+	  } else {
+		for (size_t i = 0; i < f->arity(); ++i) layer.push_back(&f->getarg(i));
+	  }
+	}
+	layer.swap(next);
+  }
+  for (size_t d = 0; d < layers.size(); ++d) {
+	std::sort(layers[d].begin(), layers[d].end());
+	order.insert(order.end(), layers[d].begin(), layers[d].end());
+  }
+}
+
+long long totalSpan(const std::vector<std::vector<int>>& edges, const std::vector<int>& pos) {
+  long long span = 0;
+  for (size_t e = 0; e < edges.size(); ++e) {
+	int lo = pos[edges[e][0]], hi = lo;
+	for (size_t i = 1; i < edges[e].size(); ++i) {
+	  lo = std::min(lo, pos[edges[e][i]]);
+	  hi = std::max(hi, pos[edges[e][i]]);
+	}
+	span += hi - lo;
+  }
+  return span;
+}
+
+struct ByPosition {
+  const std::vector<double>* target;
+  const std::vector<int>* pos;
+  bool operator()(int a, int b) const {
+	if ((*target)[a] != (*target)[b]) return (*target)[a] < (*target)[b];
+	return (*pos)[a] < (*pos)[b];
+  }
+};
+
+void forceOrder(const std::vector<KFormula*>& roots, int numVars, std::vector<int>& order) {
+  static const int MAX_ITERATIONS = 50;
+  std::vector<const KFormula*> nodes;
+  allNodes(roots, nodes);
+  std::vector<uint32_t> seen(KFormula::arena().size(), 0);
+  uint32_t stamp = 0;
+  std::vector<std::vector<int>> edges;
+  std::vector<int> leaves;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+	const KFormula* f = nodes[i];
+	if (f->getop() == KFormula::BOX) {
+	  leafVars(&f->getleft(), true, seen, ++stamp, leaves);
+	  leaves.push_back(f->getvar());
+	} else if (!isAtom(f) && f->getop() != KFormula::NOT && f->arity() > 0) {
+	  leafVars(f, false, seen, ++stamp, leaves);
+	} else {
+	  continue;
+	}
+	if (leaves.size() > 1) edges.push_back(leaves);
+  }
+
+  // Start from breadth-first order.
+  std::vector<int> current;
+  std::vector<int> pos(numVars, 0);
+  for (int v = 1; v < numVars; ++v) {
+	current.push_back(v);
+	pos[v] = v;
+  }
+  std::vector<int> best(current);
+  long long bestSpan = totalSpan(edges, pos);
+  std::vector<double> sum(numVars), target(numVars);
+  std::vector<int> count(numVars);
+  for (int iteration = 0; iteration < MAX_ITERATIONS && !edges.empty(); ++iteration) {
+	std::fill(sum.begin(), sum.end(), 0.0);
+	std::fill(count.begin(), count.end(), 0);
+	for (size_t e = 0; e < edges.size(); ++e) {
+	  double centre = 0;
+	  for (size_t i = 0; i < edges[e].size(); ++i) centre += pos[edges[e][i]];
+	  centre /= edges[e].size();
+	  for (size_t i = 0; i < edges[e].size(); ++i) {
+		sum[edges[e][i]] += centre;
+		++count[edges[e][i]];
+	  }
+	}
+	for (int v = 1; v < numVars; ++v) {
+	  target[v] = count[v] ? sum[v] / count[v] : pos[v];
+	}
+	ByPosition byPosition = {&target, &pos};
+	std::sort(current.begin(), current.end(), byPosition);
+	for (size_t i = 0; i < current.size(); ++i) pos[current[i]] = i + 1;
+	const long long span = totalSpan(edges, pos);
+	if (span >= bestSpan) break;
+	bestSpan = span;
+	best = current;
+  }
+  order.insert(order.end(), best.begin(), best.end());
+}
+
+void placeChildren(const std::vector<int>& children, const std::vector<std::vector<int>>& childrenOf,
+				   std::vector<bool>& placed, std::vector<int>& order) {
+  std::vector<int> fresh;
+  for (size_t i = 0; i < children.size(); ++i) {
+	if (!placed[children[i]]) {
+	  placed[children[i]] = true;
+	  order.push_back(children[i]);
+	  fresh.push_back(children[i]);
+	}
+  }
+  for (size_t i = 0; i < fresh.size(); ++i) {
+	placeChildren(childrenOf[fresh[i]], childrenOf, placed, order);
+  }
+}
+
+void childrenOrder(const std::vector<KFormula*>& roots, int numVars, std::vector<int>& order) {
+  std::vector<const KFormula*> nodes;
+  allNodes(roots, nodes);
+  std::vector<uint32_t> seen(KFormula::arena().size(), 0);
+  uint32_t stamp = 0;
+  std::vector<std::vector<int>> childrenOf(numVars);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+	if (nodes[i]->getop() == KFormula::BOX) {
+	  leafVars(&nodes[i]->getleft(), true, seen, ++stamp, childrenOf[nodes[i]->getvar()]);
+	}
+  }
+  std::vector<bool> placed(numVars, false);
+  std::vector<int> top;
+  for (size_t r = 0; r < roots.size(); ++r) {
+	leafVars(roots[r], true, seen, ++stamp, top);
+	placeChildren(top, childrenOf, placed, order);
+  }
+}
+
+uint64_t mix64(uint64_t h, uint64_t value) {
+  // FNV-1a over the 8 bytes of value.
+  for (int i = 0; i < 8; ++i) {
+	h = (h ^ ((value >> (8 * i)) & 0xff)) * 1099511628211ull;
+  }
+  return h;
+}
+
+uint64_t nameHash(const KFormula* f, std::vector<uint64_t>& memo) {
+  uint64_t& h = memo[f->getid()];
+  if (h != 0) return h;
+  uint64_t result = mix64(14695981039346656037ull, f->getop());
+  if (f->getop() == KFormula::AP) {
+	const std::string& name = f->getprop();
+	for (size_t i = 0; i < name.size(); ++i) result = mix64(result, (unsigned char) name[i]);
+  } else {
+	if (f->getop() == KFormula::BOX || f->getop() == KFormula::DIA) {
+	  result = mix64(result, f->getrole());
+	}
+	for (size_t i = 0; i < f->arity(); ++i) result = mix64(result, nameHash(&f->getarg(i), memo));
+  }
+  // Zero marks hashes not computed yet.
+  h = result ? result : 1;
+  return h;
+}
+
+}
+
+bool parseVarOrdering(const char* name, VarOrdering& ordering) {
+  for (int i = 0; i <= CHILDREN_ORDER; ++i) {
+	if (strcmp(name, NAMES[i]) == 0) {
+	  ordering = static_cast<VarOrdering>(i);
+	  return true;
+	}
+  }
+  return false;
+}
+
+const char* varOrderingName(VarOrdering ordering) {
+  return NAMES[ordering];
+}
+
+void groupModalVars(const std::vector<KFormula*>& roots, int numVars,
+					std::vector<int>& order, std::vector<std::pair<int, int>>& blocks) {
+  std::vector<const KFormula*> nodes;
+  allNodes(roots, nodes);
+  std::vector<uint32_t> seen(KFormula::arena().size(), 0);
+  uint32_t stamp = 0;
+  std::vector<const KFormula*> boxes(numVars, NULL);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+	if (nodes[i]->getop() == KFormula::BOX) boxes[nodes[i]->getvar()] = nodes[i];
+  }
+
+  // Boxes claim their propositions in level order, so that the earliest
+  // box mentioning a proposition keeps it.
+  std::vector<int> owner(numVars, -1);
+  std::vector<int> children;
+  for (size_t l = 0; l < order.size(); ++l) {
+	const KFormula* box = boxes[order[l]];
+	if (!box) continue;
+	owner[order[l]] = order[l];
+	leafVars(&box->getleft(), true, seen, ++stamp, children);
+	for (size_t i = 0; i < children.size(); ++i) {
+	  if (owner[children[i]] == -1 && !boxes[children[i]]) owner[children[i]] = order[l];
+	}
+  }
+  std::vector<std::vector<int>> members(numVars);
+  for (size_t l = 0; l < order.size(); ++l) {
+	const int v = order[l];
+	members[owner[v] == -1 ? v : owner[v]].push_back(v);
+  }
+
+  // Each group takes the place of its earliest member.
+  std::vector<int> grouped;
+  for (size_t l = 0; l < order.size(); ++l) {
+	const int v = order[l];
+	if (owner[v] != -1 && owner[v] != v) continue;
+	blocks.push_back(std::make_pair((int) grouped.size(),
+									(int) (grouped.size() + members[v].size() - 1)));
+	grouped.insert(grouped.end(), members[v].begin(), members[v].end());
+  }
+  order.swap(grouped);
+}
+
+void computeVarOrder(VarOrdering ordering, const std::vector<KFormula*>& roots,
+					 int numVars, std::vector<int>& order) {
+  order.assign(1, 0);
+  switch (ordering) {
+	case DFS_ORDER: dfsOrder(roots, order); break;
+	case DEPTH_ORDER: depthOrder(roots, order); break;
+	case FORCE_ORDER: forceOrder(roots, numVars, order); break;
+	case CHILDREN_ORDER: childrenOrder(roots, numVars, order); break;
+	default: break;
+  }
+  // Anything not reached keeps its breadth-first place at the end.
+  std::vector<bool> placed(numVars, false);
+  for (size_t i = 0; i < order.size(); ++i) placed[order[i]] = true;
+  for (int v = 1; v < numVars; ++v) {
+	if (!placed[v]) order.push_back(v);
+  }
+}
+
+uint64_t atomSetHash(const std::vector<const KFormula*>& varsToAtoms) {
+  std::vector<uint64_t> memo(KFormula::arena().size(), 0);
+  uint64_t h = mix64(14695981039346656037ull, varsToAtoms.size());
+  for (size_t v = 0; v < varsToAtoms.size(); ++v) {
+	h = mix64(h, varsToAtoms[v] ? nameHash(varsToAtoms[v], memo) : 0);
+  }
+  return h;
+}
+
+bool loadVarOrder(const char* path, uint64_t key, int numVars, std::vector<int>& order) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+	std::istringstream fields(line);
+	uint64_t lineKey;
+	int count;
+	if (!(fields >> std::hex >> lineKey >> std::dec >> count) || lineKey != key) continue;
+	if (count != numVars) return false;
+	order.assign(numVars, 0);
+	std::vector<bool> seen(numVars, false);
+	for (int level = 0; level < numVars; ++level) {
+	  int v;
+	  if (!(fields >> v) || v < 0 || v >= numVars || seen[v]) return false;
+	  seen[v] = true;
+	  order[level] = v;
+	}
+	return true;
+  }
+  return false;
+}
+
+bool saveVarOrder(const char* path, uint64_t key, const std::vector<int>& order) {
+  // Keep the orders of other keys, writing to a temporary file of our own
+  // first, so that concurrent runs never see a partial file. Of two runs
+  // saving at once, the order of one is lost.
+  std::vector<std::string> kept;
+  {
+	std::ifstream in(path);
+	std::string line;
+	while (std::getline(in, line)) {
+	  std::istringstream fields(line);
+	  uint64_t lineKey;
+	  if ((fields >> std::hex >> lineKey) && lineKey != key) kept.push_back(line);
+	}
+  }
+  std::string temp = std::string(path) + ".XXXXXX";
+  const int fd = mkstemp(&temp[0]);
+  if (fd < 0) return false;
+  FILE* out = fdopen(fd, "w");
+  if (!out) {
+	close(fd);
+	unlink(temp.c_str());
+	return false;
+  }
+  fchmod(fd, 0644);// mkstemp() makes it private.
+  bool ok = true;
+  for (size_t i = 0; i < kept.size(); ++i) ok = fprintf(out, "%s\n", kept[i].c_str()) >= 0 && ok;
+  std::ostringstream line;
+  line << std::hex << key << std::dec << ' ' << order.size();
+  for (size_t level = 0; level < order.size(); ++level) line << ' ' << order[level];
+  ok = fprintf(out, "%s\n", line.str().c_str()) >= 0 && ok;
+  ok = fclose(out) == 0 && ok;
+  if (!ok || rename(temp.c_str(), path) != 0) {
+	unlink(temp.c_str());
+	return false;
+  }
+  return true;
+}
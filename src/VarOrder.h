@@ -0,0 +1,66 @@
+#ifndef _VARORDER_H_
+#define _VARORDER_H_
+
+#include <vector>
+#include <stdint.h>
+
+#include "KFormula.h"
+
+/*
+ * Static BDD variable orders, selected with -order.
+ *
+ * Atoms are found breadth-first (see relateAtomsAndBDDVars), and their
+ * variables are then renumbered so that the initial level of each variable
+ * in the BDDs is its number. The order affects both the size of the BDDs and which valuations bdd_satone
+ * finds first, so the search itself changes with it, not just its speed.
+ *
+ *   bfs       Breadth-first, as the atoms are found in the formulae.
+ *   dfs       Depth-first (pre-order), entering each box as it is found.
+ *   depth     Layered by modal depth, shallowest first; breadth-first
+ *             within a layer.
+ *   force     FORCE hypergraph placement: every connective ties together
+ *             its immediate atoms, and every box its children. Variables are
+ *             moved to the mean centre of gravity of their hyperedges until
+ *             the total span of the hyperedges stops shrinking.
+ *   children  Each box is followed by the block of its children (the atoms
+ *             and boxes its unboxing is built from), depth-first.
+ */
+enum VarOrdering { BFS_ORDER, DFS_ORDER, DEPTH_ORDER, FORCE_ORDER, CHILDREN_ORDER };
+
+// The ordering with the given name, returning false if there is none.
+bool parseVarOrdering(const char* name, VarOrdering& ordering);
+const char* varOrderingName(VarOrdering ordering);
+
+/*
+ * Computes order[level] = variable for every variable 0 .. numVars-1, for
+ * the given formulae whose atoms have had their variables assigned.
+ * Variable 0 (existsDia) always stays at level 0.
+ */
+void computeVarOrder(VarOrdering ordering, const std::vector<KFormula*>& roots,
+					 int numVars, std::vector<int>& order);
+
+/*
+ * Rearranges order (as computed above) so that every box is directly
+ * followed by the propositions of its unboxing that no earlier box has
+ * claimed, and appends the level ranges [first, last] of these groups (and
+ * of the variables no box claims, on their own) to blocks. The blocks
+ * cover every level, as BuDDy only reorders variables inside some block.
+ */
+void groupModalVars(const std::vector<KFormula*>& roots, int numVars,
+					std::vector<int>& order, std::vector<std::pair<int, int>>& blocks);
+
+/*
+ * Learned orders, saved with -orderfile after reordering and reused by later
+ * runs on the same atoms. The file holds one order per line, keyed by
+ * atomSetHash(): the key in hex, the number of variables and then
+ * order[level] = variable for every level.
+ */
+// Hash of the atoms by variable, built from the names of their propositions
+// (not from node ids), so it is the same in every run on the same input.
+uint64_t atomSetHash(const std::vector<const KFormula*>& varsToAtoms);
+// Returns false if the file has no valid order of numVars variables for key.
+bool loadVarOrder(const char* path, uint64_t key, int numVars, std::vector<int>& order);
+// Replaces any order saved for key. Returns false if the file can't be written.
+bool saveVarOrder(const char* path, uint64_t key, const std::vector<int>& order);
+
+#endif
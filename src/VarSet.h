@@ -0,0 +1,133 @@
+#ifndef _VARSET_H_
+#define _VARSET_H_
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Set of BDD variables, as a bitset over the (dense) variable numbers.
+ *
+ * Membership is a bit test, and union and intersection tests go a
+ * 64 bit word at a time, in branch free loops the compiler can vectorise.
+ * The set grows to fit the largest variable inserted; clear() keeps the
+ * words, so a set reused by a tableau frame allocates at most once.
+ * Iteration is in increasing variable order.
+ */
+class VarSet {
+public:
+  class const_iterator {
+  public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef int value_type;
+	typedef ptrdiff_t difference_type;
+	typedef const int* pointer;
+	typedef int reference;
+
+	const_iterator(const uint64_t* _word, const uint64_t* _end)
+	  : word(_word), end(_end), bits(_word != _end ? *_word : 0), base(0) { skip(); };
+
+	int operator*() const { return base + __builtin_ctzll(bits); };
+	const_iterator& operator++() { bits &= bits - 1; skip(); return *this; };
+	bool operator==(const const_iterator& other) const { return word == other.word && bits == other.bits; };
+	bool operator!=(const const_iterator& other) const { return !(*this == other); };
+
+  private:
+	// Moves on to the next word with a bit set, if this one has none left.
+	void skip() {
+	  while (bits == 0 && word != end && ++word != end) {
+		bits = *word;
+		base += 64;
+	  }
+	};
+
+	const uint64_t* word;
+	const uint64_t* end;
+	uint64_t bits;
+	int base;
+  };
+
+  VarSet() {};
+
+  const_iterator begin() const { return const_iterator(words.data(), words.data() + words.size()); };
+  const_iterator end() const { return const_iterator(words.data() + words.size(), words.data() + words.size()); };
+
+  bool contains(int var) const {
+	const size_t w = var >> 6;
+	return w < words.size() && ((words[w] >> (var & 63)) & 1) != 0;
+  };
+
+  void insert(int var) {
+	const size_t w = var >> 6;
+	if (w >= words.size()) {
+	  words.resize(w + 1, 0);
+	}
+	words[w] |= uint64_t(1) << (var & 63);
+  };
+
+  template <class Iterator>
+  void insert(Iterator first, Iterator last) {
+	for (; first != last; ++first) {
+	  insert(*first);
+	}
+  };
+
+  // Union with another set.
+  void insert(const VarSet& other) {
+	if (other.words.size() > words.size()) {
+	  words.resize(other.words.size(), 0);
+	}
+	const uint64_t* from = other.words.data();
+	uint64_t* to = words.data();
+	for (size_t i = 0; i < other.words.size(); ++i) {
+	  to[i] |= from[i];
+	}
+  };
+
+  // Whether the sets share a variable.
+  bool intersects(const VarSet& other) const {
+	const size_t n = std::min(words.size(), other.words.size());
+	const uint64_t* a = words.data();
+	const uint64_t* b = other.words.data();
+	uint64_t common = 0;
+	for (size_t i = 0; i < n; ++i) {
+	  common |= a[i] & b[i];
+	}
+	return common != 0;
+  };
+
+  // Whether any of the variables in [first, last) is in the set.
+  bool intersects(const int* first, const int* last) const {
+	for (; first != last; ++first) {
+	  if (contains(*first)) {
+		return true;
+	  }
+	}
+	return false;
+  };
+
+  size_t size() const {
+	size_t count = 0;
+	for (size_t i = 0; i < words.size(); ++i) {
+	  count += __builtin_popcountll(words[i]);
+	}
+	return count;
+  };
+
+  bool empty() const {
+	uint64_t any = 0;
+	for (size_t i = 0; i < words.size(); ++i) {
+	  any |= words[i];
+	}
+	return any == 0;
+  };
+
+  void clear() { std::fill(words.begin(), words.end(), 0); };
+
+private:
+  std::vector<uint64_t> words;
+};
+
+#endif
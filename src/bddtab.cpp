@@ -8,19 +8,40 @@
 
 
 // ----------------------- Global variable declarations --------------------- //
-// Correspondence between KFormulae and BDD variables:
-bool(*compareptr)(const KFormula*, const KFormula*) = kformulaComp;
-std::map<const KFormula*, int, bool(*)(const KFormula*,const KFormula*)> atomsToVars (compareptr);
+// Correspondence between BDD variables and KFormulae.
+// (The reverse mapping is written on the hash-consed formula nodes themselves.)
 std::vector<const KFormula*> varsToAtoms(1);
 
-// Correspondence between modal BDD variables (/formulae) and their 'children' variables (/formulae).
-std::vector<std::unordered_set<int>> varsToChildren(1);
+// Kind, role and children of each BDD variable (see buildVarTable()): the
+// children of the box variables in compressed (CSR) arrays, and the box
+// variables of each role r in roleBoxVars[roleBoxVarsBegin[r], roleBoxVarsBegin[r + 1]).
+std::vector<VarInfo> varInfo;
+std::vector<int> varChildren;
+std::vector<int> varChildrenS4;
+std::vector<int> roleBoxVars;
+std::vector<uint32_t> roleBoxVarsBegin;
+
+// Memoized BoxNNF conversions, indexed by formula id: [0] of ~f, [1] of f.
+// (Per thread, as front end threads normalise in their own arenas.)
+thread_local std::vector<KFormula*> boxNNFs[2];
+// Memoized BoxNF conversions, indexed by formula id.
+thread_local std::vector<KFormula*> boxNFs;
 
 // Cache of unboxings and undiamondings:
 std::vector<bdd> unboxings(1);
 std::vector<bool> unboxed(1);
 std::vector<bdd> undiamondings(1);
 std::vector<bool> undiamonded(1);
+// When each was last used, in calls to the tableau (see cacheTick).
+std::vector<unsigned long> unboxingUses(1);
+std::vector<unsigned long> undiamondingUses(1);
+// Memoized BDDs of compound subformulae, indexed by formula id and by
+// translation: [NOT_BDD] of toNotBDD, [PLAIN_BDD] of toBDD and
+// [S4_UNBOX_BDD] of toBDDS4Unbox.
+std::vector<bdd> formulaBDDs[3];
+std::vector<bool> formulaBDDBuilt[3];
+// When each was last used, in calls to the tableau (see cacheTick).
+std::vector<unsigned long> formulaBDDUses[3];
 // Note: as bdd variables are integers in a fixed range, vectors are the most
 // efficient standard containers for mapping from variables to other things.
 // (In terms of time, that is)
@@ -41,23 +62,42 @@ std::unordered_set<bdd, BddHasher> satCache;
 std::deque<bdd> satCacheDeque;
 std::map<std::vector<int>, bdd> unsatCache;
 std::deque<std::vector<int>> unsatCacheDeque;
-std::unordered_map<bdd, std::unordered_set<int>, BddHasher> saturationUnsatCache;
+std::unordered_map<bdd, VarSet, BddHasher> saturationUnsatCache;
 std::deque<bdd> saturationUnsatCacheDeque;
 size_t maxCacheSize = 8000;
+// When each cached result was last found or added, in calls to the tableau
+// (see cacheTick). Only kept for the memory governor (see nodeBudget).
+std::unordered_map<bdd, unsigned long, BddHasher> satCacheUses;
+std::map<std::vector<int>, unsigned long> unsatCacheUses;
+std::unordered_map<bdd, unsigned long, BddHasher> saturationUnsatCacheUses;
+std::unordered_map<bdd, unsigned long, BddHasher> tempSatCacheUses;
 
 // Loop checking / cyclic dependencies:
-// All previous worlds on the current branch of the tableau.
-std::unordered_set<bdd, BddHasher> dependentBDDs;
+// All previous worlds on the current branch of the tableau. Each is the
+// formulaBDD of a frame on the stack, which keeps it referenced.
+std::unordered_set<BddHandle> dependentBDDs;
 // All worlds that are currently undecided, but have been assumed true at some point.
 std::unordered_set<bdd, BddHasher> everAssumedSatBDDs;
 // Temporary cache of sat results made while under certain assumptions.
 std::list<std::pair<std::unordered_set<bdd, BddHasher>, bdd>> tempSatCaches;
 
+// Frames of the K and S4 searches, kept for reuse (see FrameStack).
+FrameStack<KFrame> kFrames;
+FrameStack<S4Frame> s4Frames;
+
 
 // Global assumptions:
 bool globalAssumptions = false;
 bdd gammaBDD;
-std::unordered_set<int> gammaChildren;
+VarSet gammaChildren;
+// With -partition, gammaBDD only holds the core of gamma: the clusters of
+// axioms that can't be satisfied without modal formulae. The others are
+// kept here, with their variables, and only conjoined into worlds whose
+// support they share (see withGamma()).
+int partitionLimit = 0;
+std::vector<bdd> gammaClusters;
+std::vector<std::vector<int>> gammaClusterVars;
+std::vector<std::vector<int>> varsToGammaClusters;
 
 // S4 flag
 bool S4 = false;
@@ -78,15 +118,93 @@ bool rightToLeft = false;
 // Enable dynamic BDD variable reordering
 bool reorder = false;
 
-// If reordering is enabled, only do so while constructing Gamma.
-bool onlyGamma = false;
+// Phases of the run in which reordering is allowed (a mask of ReorderPhase),
+// and the phase the run is in. By default reordering is allowed throughout,
+// except that a classification only reorders while building gamma.
+int reorderPhases = -1;
+ReorderPhase reorderPhase = NO_PHASE;
+
+// Group the variables into reordering blocks by modal subformula, instead
+// of reordering every variable on its own.
+bool modalBlocks = false;
+std::vector<std::pair<int, int>> varBlocks;
+
+// Sift whenever the number of BDD nodes in use exceeds nextSift (if set).
+// After each sift the threshold moves to twice the remaining nodes.
+int siftThreshold = 0;
+int nextSift = 0;
+
+// How the operands of gamma (and of notpsi) are conjoined, and the size in
+// nodes at which to give up building them (0 for no limit).
+ConjunctionSchedule conjunctionSchedule = IN_ORDER;
+int conjunctionLimit = 0;
+
+// File of learned variable orders (see VarOrder.h). If it has an order for
+// the atoms of this run, that order is used and no reordering is done;
+// otherwise the order found by reordering is saved there at the end.
+const char* orderFile = NULL;
+uint64_t atomSetKey = 0;
+bool orderLoaded = false;
 
 // Use BDDs to completely normalise all formulae as a preprocessing step.
 bool bddNormalise = false;
 
+// Only normalise the modal operators (BoxNF instead of BoxNNF), and build
+// BDDs for the propositional connectives directly.
+bool nativeConnectives = false;
+
+// Definitional abstraction (see defineSubformulae()): compound subformulae
+// under boxes at least this large, or with at least this many parents, are
+// replaced by fresh propositions (0 to disable either). definitionSymbols
+// marks their symbols, by symbol id.
+size_t defineSize = 0;
+size_t defineShared = 0;
+bool showDefinitions = false;
+std::vector<bool> definitionSymbols;
+
+// Sizes of BuDDy's node table and operation cache. Unless given (non-zero)
+// on the command line, the initial sizes are estimated from the formulae
+// (see initBDDFramework()), and the growth per resize adapts to how often
+// garbage collections happen (see onGarbageCollection()).
+int bddNodes = 0;
+int bddCache = 0;
+int bddMaxIncrease = 0;
+
+// Memory governor: when more than nodeBudget BDD nodes (0 for no limit) are
+// in use after a garbage collection, or the node table grows past it, the
+// caches are trimmed, least recently used entries first, at the next tableau
+// call (see evictCaches()). cacheTick counts tableau calls, to tell cold
+// entries.
+int nodeBudget = 0;
+bool memoryPressure = false;
+unsigned long cacheTick = 0;
+
+// Precompiled gamma: -compile writes an image of gamma (its formulae,
+// variables, order, BDD and unboxings) that -image loads instead of reading
+// and building gamma. Roles of the image, by symbol, for the input formula.
+const char* compileFile = NULL;
+const char* imageFile = NULL;
+bool imageLoaded = false;
+std::vector<int> imageRoleMap;
+
+// Static BDD variable ordering (see VarOrder.h).
+VarOrdering varOrdering = BFS_ORDER;
+
 // Do an ontology classification instead of a single provability task.
 bool classify = false;
 
+// Read input from this file (memory-mapped) instead of standard in.
+const char* inputFile = NULL;
+// Read global assumptions one axiom per line, rather than from a single line.
+bool axiomPerLine = false;
+// Threads parsing and normalising the axioms read with -lines.
+unsigned int frontEndThreads = 1;
+// Ontology in OWL functional syntax to use as global assumptions, instead of
+// reading them from the input.
+const char* owlFile = NULL;
+// LWB or intohylo benchmark files to prove, instead of reading the input.
+std::vector<const char*> benchmarkFiles;
+
 
 // Algorithm statistics:
 bool verbose = false;
@@ -102,6 +220,8 @@ int cachedUnboxings = 0;
 int unboxCacheHits = 0;
 int cachedUndiamondings = 0;
 int undiamondCacheHits = 0;
+int cachedFormulaBDDs = 0;
+int formulaBDDCacheHits = 0;
 
 int satCacheAdds = 0;//   Number of sat results that were cached.
 int unsatCacheAdds = 0;// Number of unsat results that were cached.
@@ -122,6 +242,17 @@ int tempSatCachesConfirmed = 0;// Results whose assumptions were confirmed.
 int tempSatCachesRejected = 0;// Results whose assumptions were rejected.
 
 int numVarsReduced = 0;// BoxVars determined semantically equivalent through bdd normalisation.
+int gammaBDDNodes = 0;// Size of gammaBDD under the chosen variable ordering.
+int numSifts = 0;// Sifts triggered by -sift.
+int peakConjunctionNodes = 0;// Largest partial BDD built by -schedule.
+int gammaClustersConjoined = 0;// Clusters of a partitioned gamma added to worlds.
+int numDefinitions = 0;// Subformulae replaced by definitional propositions.
+int numGarbageCollections = 0;// Garbage collections by BuDDy.
+int numTableGrowths = 0;// Times the node table growth was raised after them.
+int numEvictions = 0;// Cache entries evicted by the memory governor.
+
+size_t inputFormulaSize = 0;// Distinct subformulae of the input, before and after
+size_t nnfFormulaSize = 0;//   conversion to BoxNNF.
 
 
 // --------------------- Function implementations --------------------------- //
@@ -137,7 +268,9 @@ int main(int argc, char * argv[]) {
 	processArgs(argc, argv);
 	
 	// TODO: I really doubt this is portable.
-	// Messing with stack size limits. 'Cause 64 bit system is ruining my recursive depth.
+	// Messing with stack size limits. The tableau search keeps its own stack
+	// (see isSatisfiableK()), but parsing, normalisation and building BDDs
+	// still recurse over the nesting of the input formulae.
 	const rlim_t desiredStackSize = 32 * 1024 * 1024;   // min stack size = 32 MB
     struct rlimit rl;
     if (getrlimit(RLIMIT_STACK, &rl) == 0) {
@@ -149,93 +282,175 @@ int main(int argc, char * argv[]) {
 		}
 	}
 	
+	if (!benchmarkFiles.empty()) {
+		// Benchmark files given on the command line, instead of standard in.
+		proveBenchmarks();
+		return 0;
+	}
+	
+	// Input is read from standard in, or the file given with -f.
+	InputReader input(inputFile);
+	
+	if (compileFile) {
+		// Build gamma from the input, and save it for later runs with -image.
+		KFormula* gammaNNF = readNormalisedGamma(input);
+		if (!gammaNNF) {
+			std::cout << "Nothing to do for empty ontology." << std::endl;
+			exit(1);
+		}
+		compileGammaImage(compileFile, setUpGamma(gammaNNF));
+		return 0;
+	}
+	
 	if (classify) {
 		// Instead of performing a single provability/satisfiablity task,
 		// treat the input as an ontology definition, and perform a classification
 		// of all atomic propositions.
-		performClassification();
+		performClassification(input);
 		return 0;
 	}
 	
+	// Load gamma first, so that psi is built among (and shares) its formulae.
+	KFormula* imageGammaNNF = imageFile ? loadGammaImage(imageFile) : NULL;
+	
 	// Parse the formula psi, negate it, and translate to BoxNNF.
 	// Further normalise by canonically ordering subformulae. NOTE: replaced by BDD normalising.
-	// (see toBoxNNF() for details on BoxNNF)
+	// (see toBoxNNF() for details on BoxNNF, and toBoxNF() for -native)
 	KFormula* notpsiNNF;
-	// Read in the formula from standard in.
-	std::string s;
-	std::getline(std::cin, s);
-	if (s.length() == 0 && !globalAssumptions) {
+	// Read in the formula from the first line of input.
+	const char* begin = NULL;
+	const char* end = NULL;
+	input.nextLine(begin, end);
+	if (begin == end && !globalAssumptions && !imageFile) {
 		std::cout << "Empty formula is provable." << std::endl;
 		exit(1);
-	} else if (s.length() == 0) {
-		notpsiNNF = new KFormula(true);
+	} else if (begin == end) {
+		notpsiNNF = KFormula::makeConst(true);
 	} else {
-		notpsiNNF = toBoxNNF(new KFormula(KFormula::NOT,
-												KFormula::parseKFormula(s.c_str()),
-												NULL));
+		KFormula* psi = KFormula::parseKFormula(begin, end);
+		if (!psi) {
+			exit(1);
+		}
+		notpsiNNF = normalise(KFormula::makeNot(psi));
+		if (verbose) {
+			inputFormulaSize += psi->dagSize();
+			nnfFormulaSize += notpsiNNF->dagSize();
+		}
 	}
 	 
 	
 	KFormula* gammaNNF;
-	if (globalAssumptions) {
+	if (imageGammaNNF) {
+		gammaNNF = imageGammaNNF;
+	} else if (globalAssumptions) {
 		// Parse global assumptions from input.
-		std::getline(std::cin, s);
-		if (s.length() != 0) {
-			gammaNNF = toBoxNNF(KFormula::parseKFormula(s.c_str()));
-		} else {
+		gammaNNF = readNormalisedGamma(input);
+		if (!gammaNNF) {
 			// Have vacuous global assumptions.
-			gammaNNF = toBoxNNF(new KFormula(true));
+			gammaNNF = normalise(KFormula::makeConst(true));
 		}
 	} else {
 		// Have vacuous global assumptions.
-		gammaNNF = toBoxNNF(new KFormula(true));
+		gammaNNF = normalise(KFormula::makeConst(true));
 	}
 	
-	// Set an integer for each role.
-	std::unordered_set<std::string> roles;
-	findAllRoles(notpsiNNF, roles);
-	findAllRoles(gammaNNF, roles);
-	std::unordered_map<std::string, int> roleMap;
-	assignRoleInts(roles, roleMap);
-	applyRoleInts(notpsiNNF, roleMap);
-	applyRoleInts(gammaNNF, roleMap);
+	prove(notpsiNNF, gammaNNF);
+	resetState();
 	
-	// Initialise the bdd framework.
-	bdd_init(10000, 1000);
-	bdd_setcacheratio(8);
-	bdd_setmaxincrease(2500000);// 50 Mb
+	return 0;
+}
+
+/*
+ *	Runs every formula of the given benchmark files, as if each had been
+ *	given on its own to a fresh bddtab, printing "file:label: " before
+ *	each result.
+ */
+void proveBenchmarks() {
+	for (std::vector<const char*>::iterator it = benchmarkFiles.begin();
+			it != benchmarkFiles.end(); ++it) {
+		BenchmarkReader reader(*it);
+		while (KFormula* psi = reader.next()) {
+			KFormula* notpsiNNF = normalise(KFormula::makeNot(psi));
+			KFormula* gammaNNF = normalise(KFormula::makeConst(true));
+			if (verbose) {
+				inputFormulaSize += psi->dagSize();
+				nnfFormulaSize += notpsiNNF->dagSize();
+			}
+			std::cout << *it << ":" << reader.label() << ": ";
+			prove(notpsiNNF, gammaNNF);
+			resetState();
+		}
+	}
+}
+
+/*
+ *	Decides whether psi is provable from gamma, given notpsi and gamma in
+ *	normal form, and prints the result. Returns whether notpsi and gamma
+ *	are satisfiable.
+ *
+ *	Initialises the BDD framework; resetState() has to be called afterwards.
+ */
+bool prove(KFormula* notpsiNNF, KFormula* gammaNNF) {
+	if (imageLoaded) {
+		// Gamma, its variables and the bdd framework all come from the image.
+		std::vector<bool> roles(KFormula::arena().roles().size(), false);
+		findAllRoles(notpsiNNF, roles);
+		for (uint32_t role = 0; role < roles.size(); ++role) {
+			if (roles[role] && (role >= imageRoleMap.size() || imageRoleMap[role] == 0)) {
+				std::cerr << "ERROR: Role " << KFormula::arena().roles().name(role)
+					<< " does not occur in the gamma image." << std::endl;
+				exit(1);
+			}
+		}
+		applyRoleInts(notpsiNNF, imageRoleMap);
+	} else {
+		if (defineSize || defineShared) {
+			std::vector<KFormula*> formulae(1, notpsiNNF);
+			gammaNNF = defineSubformulae(formulae, gammaNNF);
+			notpsiNNF = formulae[0];
+		}
+		
+		// Set an integer for each role.
+		std::vector<bool> roles(KFormula::arena().roles().size(), false);
+		findAllRoles(notpsiNNF, roles);
+		findAllRoles(gammaNNF, roles);
+		std::vector<int> roleMap;
+		assignRoleInts(roles, roleMap);
+		applyRoleInts(notpsiNNF, roleMap);
+		applyRoleInts(gammaNNF, roleMap);
+		
+		// Initialise the bdd framework.
+		std::vector<KFormula*> roots;
+		roots.push_back(notpsiNNF);
+		roots.push_back(gammaNNF);
+		initBDDFramework(roots);
+	}
 	
 	unsatCacheBDD = bddtrue;
 	
 	// Extract the set of 'atomic' formulae, and relate each atom to a BDD variable.
 	// In this case all []phi are atomic, as well as all atomic propositions.
+	// (Those of an image's gamma already have their variables.)
 	std::vector<KFormula*> atoms;
 	std::deque<KFormula*> formulae;
-	formulae.push_back(gammaNNF);
+	if (!imageLoaded) {
+		formulae.push_back(gammaNNF);
+	}
 	formulae.push_back(notpsiNNF);
 	relateAtomsAndBDDVars(atoms, formulae);
 	
-	// Dynamic variable reordering. Super naive, but often effective.
-	if (reorder) {
-		bdd_varblockall();
-		bdd_autoreorder(BDD_REORDER_WIN2ITE);
-	}
-	
-	
-	// Build and store the BDD of gamma
-	gammaBDD = toBDD(gammaNNF);
-	computeChildren(gammaNNF, gammaChildren);
+	startReordering();
 	
-	if (onlyGamma) {
-		bdd_clrvarblocks();
-		bdd_disable_reorder();
+	if (!imageLoaded) {
+		buildGammaBDD(gammaNNF);
 	}
 	
 	// Build a BDD of notpsi and gamma
-	bdd notpsiAndGammaBDD = toBDD(notpsiNNF) & gammaBDD;
-	
+	bdd notpsiAndGammaBDD = conjunctionBDD(notpsiNNF) & gammaBDD;
 	
+	enterReorderPhase(REORDER_SEARCH);
 	bool isSat = isSatisfiable(notpsiAndGammaBDD);
+	saveLearnedOrder();
 	if (S4) {
 		std::cout << "S4:";
 	} else if (inverseRoles) {
@@ -257,74 +472,134 @@ int main(int argc, char * argv[]) {
 		std::cout << std::endl;
 	}
 	
-	bdd_done();
+	return isSat;
+}
+
+
+/*
+ *	Releases the BDD framework, the formulae and every cache and statistic,
+ *	so that another formula can be proven from scratch.
+ */
+void resetState() {
+	varsToAtoms.assign(1, NULL);
+	varInfo.clear();
+	varChildren.clear();
+	varChildrenS4.clear();
+	roleBoxVars.clear();
+	roleBoxVarsBegin.clear();
+	unboxings.assign(1, bdd());
+	unboxed.assign(1, false);
+	undiamondings.assign(1, bdd());
+	undiamonded.assign(1, false);
+	unboxingUses.assign(1, 0);
+	undiamondingUses.assign(1, 0);
+	for (int kind = 0; kind < 3; ++kind) {
+		formulaBDDs[kind].clear();
+		formulaBDDBuilt[kind].clear();
+		formulaBDDUses[kind].clear();
+	}
+	numVars = 1;
+	numRoles = 0;
+	inverseRoles = false;
 	
-	return 0;
+	satCache.clear();
+	satCacheDeque.clear();
+	unsatCache.clear();
+	unsatCacheDeque.clear();
+	saturationUnsatCache.clear();
+	saturationUnsatCacheDeque.clear();
+	satCacheUses.clear();
+	unsatCacheUses.clear();
+	saturationUnsatCacheUses.clear();
+	tempSatCacheUses.clear();
+	dependentBDDs.clear();
+	everAssumedSatBDDs.clear();
+	tempSatCaches.clear();
+	kFrames.clear();
+	s4Frames.clear();
+	gammaBDD = bdd();
+	gammaChildren.clear();
+	gammaClusters.clear();
+	gammaClusterVars.clear();
+	varsToGammaClusters.clear();
+	unsatCacheBDD = bdd();
+	
+	depth = 0;
+	maxDepth = 0;
+	totalModalJumpsExplored = 0;
+	totalBDDRefinements = 0;
+	totalSatisfiableModalJumps = 0;
+	cachedUnboxings = 0;
+	unboxCacheHits = 0;
+	cachedUndiamondings = 0;
+	undiamondCacheHits = 0;
+	cachedFormulaBDDs = 0;
+	formulaBDDCacheHits = 0;
+	satCacheAdds = 0;
+	unsatCacheAdds = 0;
+	satCacheHits = 0;
+	unsatCacheHits = 0;
+	numFalseFromBox = 0;
+	numFalseFromDia = 0;
+	numFalseFromRef = 0;
+	numResVarsIgnoredFromBox = 0;
+	numResVarsIgnoredFromDia = 0;
+	numResVarsIgnoredFromGeneral = 0;
+	loopsDetected = 0;
+	numTempSatCaches = 0;
+	tempSatCachesConfirmed = 0;
+	tempSatCachesRejected = 0;
+	numVarsReduced = 0;
+	gammaBDDNodes = 0;
+	numSifts = 0;
+	peakConjunctionNodes = 0;
+	gammaClustersConjoined = 0;
+	numDefinitions = 0;
+	numGarbageCollections = 0;
+	numTableGrowths = 0;
+	numEvictions = 0;
+	memoryPressure = false;
+	cacheTick = 0;
+	definitionSymbols.clear();
+	inputFormulaSize = 0;
+	nnfFormulaSize = 0;
+	
+	reorderPhase = NO_PHASE;
+	varBlocks.clear();
+	atomSetKey = 0;
+	orderLoaded = false;
+	imageLoaded = false;
+	imageRoleMap.clear();
+	
+	bdd_done();
+	// Release the whole front end at once.
+	boxNNFs[0].clear();
+	boxNNFs[1].clear();
+	boxNFs.clear();
+	KFormula::arena().clear();
 }
 
 /*
  * 
  * 
  */
-void performClassification() {
+void performClassification(InputReader& input) {
 
-	// Read in the ontology as a modal formula from standard in.
-	std::string s;
-	std::getline(std::cin, s);
-	if (s.length() == 0) {
+	// Read in the ontology as a modal formula (or load it, ready, from an image).
+	KFormula* gammaNNF = imageFile ? loadGammaImage(imageFile) : readNormalisedGamma(input);
+	if (!gammaNNF) {
 		std::cout << "Nothing to do for empty ontology." << std::endl;
 		exit(1);
 	}
-	
-	KFormula* gammaNNF = toBoxNNF(KFormula::parseKFormula(s.c_str()));
-	
-	// Set an integer for each role.
-	std::unordered_set<std::string> roles;
-	findAllRoles(gammaNNF, roles);
-	std::unordered_map<std::string, int> roleMap;
-	assignRoleInts(roles, roleMap);
-	applyRoleInts(gammaNNF, roleMap);
-	
-	// Initialise the bdd framework.
-	bdd_init(10000, 1000);
-	bdd_setcacheratio(8);
-	bdd_setmaxincrease(2500000);// 50 Mb
-	
-	unsatCacheBDD = bddtrue;
-	
-	// Extract the set of 'atomic' formulae, and relate each atom to a BDD variable.
-	// In this case all []phi are atomic, as well as all atomic propositions.
-	std::vector<KFormula*> atoms;
-	std::deque<KFormula*> formulae;
-	formulae.push_back(gammaNNF);
-	relateAtomsAndBDDVars(atoms, formulae);
-	
-	// Dynamic variable reordering. Super naive, but often effective.
-	if (reorder) {
-		bdd_varblockall();
-		bdd_autoreorder(BDD_REORDER_WIN2ITE);
-	}
-
-	// Build and store the BDD of gamma
-	gammaBDD = toBDD(gammaNNF);
-	computeChildren(gammaNNF, gammaChildren);
-	
-	if (onlyGamma) {
-		bdd_clrvarblocks();
-		bdd_disable_reorder();
+	if (!imageLoaded) {
+		gammaNNF = setUpGamma(gammaNNF);
 	}
 	
-	// Testing out removing reordering after constructing gamma.
-	// Really, as a tableau method, there's often not much point in dynamic reordering
-	// throughout the process. but since we're starting with gamma many many times,
-	// Reordering for it makes sense.
-	bdd_clrvarblocks();
-	bdd_disable_reorder();
-	
 	// Find all the atomic proposition variables.
 	std::vector<int> classes;
 	for (int var = 1; var < numVars; ++var) {
-		if (varsToAtoms.at(var)->getop() == KFormula::AP) {
+		if (varsToAtoms.at(var)->getop() == KFormula::AP
+				&& !isDefinitionSymbol(varsToAtoms.at(var)->getsymbol())) {
 			classes.push_back(var);
 		}
 	}
@@ -354,20 +629,346 @@ void performClassification() {
 			}
 		}
 	}
+	saveLearnedOrder();
 	
 	if (verbose) {
 		printSummaryStatistics();
 	}
 }
 
-void processArgs(int argc, char * argv[]) {
-	if (argc > 9) {
-		printUsage();
+/*
+ *	Sets up the bdd framework for gamma alone, with its variables and BDD,
+ *	as for a classification or -compile. Returns gamma, with any definitions
+ *	(see defineSubformulae()).
+ */
+KFormula* setUpGamma(KFormula* gammaNNF) {
+	if (defineSize || defineShared) {
+		std::vector<KFormula*> formulae;
+		gammaNNF = defineSubformulae(formulae, gammaNNF);
+	}
+	
+	// Set an integer for each role.
+	std::vector<bool> roles(KFormula::arena().roles().size(), false);
+	findAllRoles(gammaNNF, roles);
+	std::vector<int> roleMap;
+	assignRoleInts(roles, roleMap);
+	applyRoleInts(gammaNNF, roleMap);
+	imageRoleMap.swap(roleMap);
+	
+	// Initialise the bdd framework.
+	initBDDFramework(std::vector<KFormula*>(1, gammaNNF));
+	
+	unsatCacheBDD = bddtrue;
+	
+	// Extract the set of 'atomic' formulae, and relate each atom to a BDD variable.
+	// In this case all []phi are atomic, as well as all atomic propositions.
+	std::vector<KFormula*> atoms;
+	std::deque<KFormula*> formulae;
+	formulae.push_back(gammaNNF);
+	relateAtomsAndBDDVars(atoms, formulae);
+	
+	startReordering();
+	buildGammaBDD(gammaNNF);
+	
+	// Really, as a tableau method, there's often not much point in dynamic reordering
+	// throughout the process. but since we're starting with gamma many many times,
+	// Reordering for it makes sense. (So only the gamma phase reorders by default.)
+	enterReorderPhase(REORDER_SEARCH);
+	return gammaNNF;
+}
+
+/*
+ *	Builds and stores the BDD of gamma, whose atoms have their variables.
+ */
+void buildGammaBDD(KFormula* gammaNNF) {
+	if (partitionLimit && !S4) {
+		partitionGamma(gammaNNF);
+	} else {
+		gammaBDD = conjunctionBDD(gammaNNF);
+	}
+	if (verbose) {
+		gammaBDDNodes = bdd_nodecount(gammaBDD);
+		for (size_t c = 0; c < gammaClusters.size(); ++c) {
+			gammaBDDNodes += bdd_nodecount(gammaClusters[c]);
+		}
+	}
+	computeChildren(gammaNNF, gammaChildren);
+}
+
+// Start of a gamma image, and its version.
+static const char IMAGE_MAGIC[8] = {'B', 'D', 'D', 'T', 'A', 'B', 'G', '2'};
+
+// Kinds of cached BDDs in a gamma image.
+enum ImageBDDKind { IMAGE_UNBOXING, IMAGE_UNDIAMONDING };
+
+static bool writeImageWords(FILE* out, const std::vector<uint32_t>& words) {
+	return fwrite(words.data(), sizeof(uint32_t), words.size(), out) == words.size();
+}
+
+/*
+ *	The counts come from the image, so a count larger than what is left of
+ *	the file is malformed, rather than allocated.
+ */
+static bool readImageWords(FILE* in, std::vector<uint32_t>& words, size_t n) {
+	const long pos = ftell(in);
+	if (pos < 0 || fseek(in, 0, SEEK_END) != 0) {
+		return false;
+	}
+	const long end = ftell(in);
+	if (fseek(in, pos, SEEK_SET) != 0 || end < pos || n > (size_t) (end - pos) / sizeof(uint32_t)) {
+		return false;
+	}
+	words.resize(n);
+	return fread(words.data(), sizeof(uint32_t), n, in) == n;
+}
+
+/*
+ *	bdd_load() reads BuDDy's text format and leaves the newline ending it.
+ */
+static bool loadImageBDD(FILE* in, bdd& b) {
+	if (bdd_load(in, b) != 0) {
+		return false;
+	}
+	const int c = fgetc(in);
+	if (c != '\n' && c != EOF) {
+		ungetc(c, in);
+	}
+	return true;
+}
+
+/*
+ *	Writes the image of gamma, as set up by setUpGamma(), for -image: the
+ *	formula arena (with the variables and roles written on its nodes), the
+ *	variables' atoms and order, gammaBDD and the unboxings and undiamondings
+ *	of every box variable, which are built now so that later runs don't have
+ *	to. Partitioned gamma isn't kept in images.
+ */
+void compileGammaImage(const char* path, KFormula* gammaNNF) {
+	std::vector<std::pair<int, ImageBDDKind>> cached;
+	for (int var = 1; var < numVars; ++var) {
+		if (varInfo[var].kind != BOX_VAR || varsToAtoms.at(var)->getvar() != var) {
+			continue;// Not a box, or merged into another one by -norm.
+		}
+		if (S4) {
+			unboxS4(var);
+			cached.push_back(std::make_pair(var, IMAGE_UNBOXING));
+		} else {
+			unbox(var);
+			undiamond(var);
+			cached.push_back(std::make_pair(var, IMAGE_UNBOXING));
+			cached.push_back(std::make_pair(var, IMAGE_UNDIAMONDING));
+		}
+	}
+	if (!gammaClusters.empty()) {
+		// Conjoin the clusters back together.
+		for (size_t c = 0; c < gammaClusters.size(); ++c) {
+			gammaBDD = gammaBDD & gammaClusters[c];
+		}
+	}
+	
+	FILE* out = fopen(path, "wb");
+	if (!out) {
+		std::cerr << "ERROR: Could not write gamma image " << path << "." << std::endl;
+		exit(1);
+	}
+	std::vector<uint32_t> header;
+	header.push_back(S4);
+	header.push_back(numRoles);
+	header.push_back(inverseRoles);
+	header.push_back(numVars);
+	header.push_back(gammaNNF->getid());
+	std::vector<uint32_t> definitions;
+	for (uint32_t symbol = 0; symbol < definitionSymbols.size(); ++symbol) {
+		if (definitionSymbols[symbol]) {
+			definitions.push_back(symbol);
+		}
+	}
+	header.push_back(definitions.size());
+	header.push_back(imageRoleMap.size());
+	for (size_t role = 0; role < imageRoleMap.size(); ++role) {
+		header.push_back(imageRoleMap[role]);
+	}
+	header.insert(header.end(), definitions.begin(), definitions.end());
+	bool ok = fwrite(IMAGE_MAGIC, 1, sizeof(IMAGE_MAGIC), out) == sizeof(IMAGE_MAGIC)
+		&& writeImageWords(out, header) && KFormula::arena().save(out);
+	std::vector<uint32_t> vars;
+	for (int var = 0; var < numVars; ++var) {
+		vars.push_back(varsToAtoms.at(var) ? varsToAtoms.at(var)->getid() : SymbolTable::NONE);
+	}
+	for (int level = 0; level < numVars; ++level) {
+		vars.push_back(bdd_level2var(level));
+	}
+	vars.push_back(cached.size());
+	for (size_t i = 0; i < cached.size(); ++i) {
+		vars.push_back(cached[i].first);
+		vars.push_back(cached[i].second);
+	}
+	ok = ok && writeImageWords(out, vars) && bdd_save(out, gammaBDD) == 0;
+	for (size_t i = 0; ok && i < cached.size(); ++i) {
+		const int var = cached[i].first;
+		ok = bdd_save(out, cached[i].second == IMAGE_UNBOXING ? unboxings.at(var) : undiamondings.at(var)) == 0;
+	}
+	if (fclose(out) != 0 || !ok) {
+		std::cerr << "ERROR: Could not write gamma image " << path << "." << std::endl;
+		exit(1);
+	}
+}
+
+/*
+ *	Loads the image written by compileGammaImage(), setting up the formulae,
+ *	the bdd framework, gamma and the caches exactly as they were, and returns
+ *	gamma. The image is read straight into the arena and BuDDy's tables,
+ *	without parsing or normalising anything.
+ */
+KFormula* loadGammaImage(const char* path) {
+	FILE* in = fopen(path, "rb");
+	if (!in) {
+		std::cerr << "ERROR: Could not open gamma image " << path << "." << std::endl;
+		exit(1);
+	}
+	char magic[sizeof(IMAGE_MAGIC)];
+	std::vector<uint32_t> header;
+	bool ok = fread(magic, 1, sizeof(magic), in) == sizeof(magic)
+		&& memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0
+		&& readImageWords(in, header, 7);
+	if (ok && header[0] != (uint32_t) S4) {
+		std::cerr << "ERROR: Gamma image " << path << " was compiled "
+			<< (header[0] ? "with" : "without") << " -s4." << std::endl;
+		exit(1);
+	}
+	std::vector<uint32_t> roleMap;
+	std::vector<uint32_t> definitions;
+	ok = ok && readImageWords(in, roleMap, header[6]) && readImageWords(in, definitions, header[5])
+		&& KFormula::arena().load(in);
+	for (size_t i = 0; ok && i < definitions.size(); ++i) {
+		ok = definitions[i] < KFormula::arena().props().size();
+	}
+	std::vector<uint32_t> vars;
+	const uint32_t imageVars = ok ? header[3] : 0;
+	ok = ok && imageVars > 0 && readImageWords(in, vars, 2 * (size_t) imageVars + 1)
+		&& header[4] < KFormula::arena().size();
+	std::vector<uint32_t> cached;
+	ok = ok && readImageWords(in, cached, 2 * (size_t) vars.back());
+	// The formulae agree with the variables and roles: every node with a
+	// variable is an atom or box listed for it (or a box merged by -norm
+	// into the one listed), every listed atom or box has that variable (or
+	// was merged into another), and the order is a permutation of the
+	// variables.
+	KFormulaArena& arena = KFormula::arena();
+	ok = ok && header[1] <= arena.roles().size() && roleMap.size() <= arena.roles().size();
+	for (size_t role = 0; ok && role < roleMap.size(); ++role) {
+		ok = std::abs((int) roleMap[role]) <= (int) header[1];
+	}
+	for (uint32_t i = 0; ok && i < arena.size(); ++i) {
+		const KFormula& f = arena.node(i);
+		if (f.getop() == KFormula::BOX || f.getop() == KFormula::DIA) {
+			ok = std::abs(f.getrole()) <= (int) header[1];
+		}
+		const int var = f.getvar();
+		if (!ok || var == -1) {
+			continue;
+		}
+		ok = (f.getop() == KFormula::AP || (f.getop() == KFormula::BOX && f.getrole() != 0))
+			&& var > 0 && var < (int) imageVars && vars[var] < arena.size();
+		if (ok && vars[var] != i) {
+			const KFormula& kept = arena.node(vars[var]);
+			ok = f.getop() == KFormula::BOX && kept.getop() == KFormula::BOX && kept.getvar() == var;
+		}
+	}
+	for (uint32_t var = 1; ok && var < imageVars; ++var) {
+		const KFormula* atom = vars[var] < arena.size() ? &arena.node(vars[var]) : NULL;
+		ok = atom && atom->getvar() != -1
+			&& (atom->getvar() == (int) var || vars[atom->getvar()] != vars[var]);
+	}
+	// Gamma is normalised (no diamonds), with a variable on every atom and box.
+	std::vector<bool> visited(ok ? arena.size() : 0, false);
+	std::vector<const KFormula*> pending;
+	if (ok) {
+		pending.push_back(&arena.node(header[4]));
+	}
+	while (ok && !pending.empty()) {
+		const KFormula* f = pending.back();
+		pending.pop_back();
+		if (visited[f->getid()]) {
+			continue;
+		}
+		visited[f->getid()] = true;
+		ok = f->getop() != KFormula::DIA
+			&& (f->getvar() != -1 || (f->getop() != KFormula::AP && f->getop() != KFormula::BOX));
+		for (size_t i = 0; ok && i < f->arity(); ++i) {
+			pending.push_back(&(f->getarg(i)));
+		}
+	}
+	std::vector<bool> seen(imageVars, false);
+	for (uint32_t level = 0; ok && level < imageVars; ++level) {
+		const uint32_t var = vars[imageVars + level];
+		ok = var < imageVars && !seen[var];
+		if (ok) {
+			seen[var] = true;
+		}
+	}
+	if (!ok) {
+		std::cerr << "ERROR: Malformed gamma image " << path << "." << std::endl;
+		exit(1);
+	}
+	numRoles = header[1];
+	inverseRoles = header[2];
+	definitionSymbols.assign(KFormula::arena().props().size(), false);
+	for (size_t i = 0; i < definitions.size(); ++i) {
+		definitionSymbols[definitions[i]] = true;
+	}
+	imageRoleMap.assign(roleMap.begin(), roleMap.end());
+	
+	// Initialise the bdd framework, sized for the whole image.
+	initBDDFramework(KFormula::arena().size(), imageVars);
+	unsatCacheBDD = bddtrue;
+	numVars = imageVars;
+	bdd_setvarnum(numVars);
+	std::vector<int> order(vars.begin() + numVars, vars.begin() + 2 * numVars);
+	bdd_setvarorder(&order[0]);
+	varsToAtoms.assign(1, NULL);
+	for (int var = 1; var < numVars; ++var) {
+		varsToAtoms.push_back(&KFormula::arena().node(vars[var]));
+	}
+	unboxings.resize(numVars + 1);
+	unboxed.resize(numVars + 1);
+	undiamondings.resize(numVars + 1);
+	undiamonded.resize(numVars + 1);
+	unboxingUses.resize(numVars + 1);
+	undiamondingUses.resize(numVars + 1);
+	buildVarTable();
+	
+	ok = loadImageBDD(in, gammaBDD);
+	for (size_t i = 0; ok && i < cached.size(); i += 2) {
+		const int var = cached[i];
+		if (var <= 0 || var >= numVars) {
+			ok = false;
+		} else if (cached[i + 1] == IMAGE_UNBOXING) {
+			ok = loadImageBDD(in, unboxings.at(var));
+			unboxed.at(var) = true;
+		} else {
+			ok = loadImageBDD(in, undiamondings.at(var));
+			undiamonded.at(var) = true;
+		}
+	}
+	fclose(in);
+	if (!ok) {
+		std::cerr << "ERROR: Malformed gamma image " << path << "." << std::endl;
 		exit(1);
 	}
 	
+	KFormula* gammaNNF = &KFormula::arena().node(header[4]);
+	if (verbose) {
+		gammaBDDNodes = bdd_nodecount(gammaBDD);
+	}
+	computeChildren(gammaNNF, gammaChildren);
+	imageLoaded = true;
+	return gammaNNF;
+}
+
+void processArgs(int argc, char * argv[]) {
 	for (int i = 1; i < argc; ++i) {
-		if (strncmp(argv[i], "-g", 2) == 0) {
+		if (strcmp(argv[i], "-g") == 0) {
 			globalAssumptions = true;
 		} else if (strncmp(argv[i], "-s4", 3) == 0) {
 			S4 = true;
@@ -384,20 +985,110 @@ void processArgs(int argc, char * argv[]) {
 		} else if (strncmp(argv[i], "-reorder", 8) == 0) {
 			reorder = true;
 		} else if (strncmp(argv[i], "-onlygamma", 10) == 0) {
-			onlyGamma = true;
+			reorderPhases = REORDER_GAMMA;
+		} else if (strcmp(argv[i], "-phases") == 0 && i + 1 < argc) {
+			reorderPhases = parseReorderPhases(argv[++i]);
+			if (reorderPhases < 0) {
+				printUsage();
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "-bddnodes") == 0 && i + 1 < argc) {
+			bddNodes = std::max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-bddcache") == 0 && i + 1 < argc) {
+			bddCache = std::max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-maxincrease") == 0 && i + 1 < argc) {
+			bddMaxIncrease = std::max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-nodebudget") == 0 && i + 1 < argc) {
+			nodeBudget = std::max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-sift") == 0 && i + 1 < argc) {
+			siftThreshold = std::max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-schedule") == 0 && i + 1 < argc) {
+			++i;
+			if (strcmp(argv[i], "size") == 0) {
+				conjunctionSchedule = SMALLEST_FIRST;
+			} else if (strcmp(argv[i], "support") == 0) {
+				conjunctionSchedule = SHARED_SUPPORT;
+			} else {
+				printUsage();
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "-gammalimit") == 0 && i + 1 < argc) {
+			conjunctionLimit = std::max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-partition") == 0 && i + 1 < argc) {
+			partitionLimit = std::max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-define") == 0 && i + 1 < argc) {
+			defineSize = std::max(2, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-defineshared") == 0 && i + 1 < argc) {
+			defineShared = std::max(2, atoi(argv[++i]));
+		} else if (strncmp(argv[i], "-showdefs", 9) == 0) {
+			showDefinitions = true;
+		} else if (strcmp(argv[i], "-compile") == 0 && i + 1 < argc) {
+			compileFile = argv[++i];
+		} else if (strcmp(argv[i], "-image") == 0 && i + 1 < argc) {
+			imageFile = argv[++i];
+		} else if (strcmp(argv[i], "-orderfile") == 0 && i + 1 < argc) {
+			orderFile = argv[++i];
+		} else if (strncmp(argv[i], "-modalblocks", 12) == 0) {
+			modalBlocks = true;
 		} else if (strncmp(argv[i], "-norm", 5) == 0) {
 			bddNormalise = true;
+		} else if (strncmp(argv[i], "-native", 7) == 0) {
+			nativeConnectives = true;
 		} else if (strncmp(argv[i], "-classify", 9) == 0) {
 			classify = true;
+		} else if (strncmp(argv[i], "-lines", 6) == 0) {
+			axiomPerLine = true;
+			globalAssumptions = true;
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			inputFile = argv[++i];
+		} else if (strcmp(argv[i], "-order") == 0 && i + 1 < argc) {
+			if (!parseVarOrdering(argv[++i], varOrdering)) {
+				printUsage();
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			frontEndThreads = std::max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-owl") == 0 && i + 1 < argc) {
+			owlFile = argv[++i];
+			globalAssumptions = true;
+		} else if (argv[i][0] != '-') {
+			benchmarkFiles.push_back(argv[i]);
 		} else {
 			printUsage();
 			exit(1);
 		}
 	}
+	if (reorderPhases < 0) {
+		reorderPhases = classify ? REORDER_GAMMA : REORDER_ALL_PHASES;
+	}
+}
+
+/*
+ *	Parses a comma separated list of the phases gamma, cache and search
+ *	into a mask of ReorderPhase, or returns -1 if there is anything else.
+ */
+int parseReorderPhases(const char* list) {
+	static const char* const names[] = { "gamma", "cache", "search" };
+	static const int phases[] = { REORDER_GAMMA, REORDER_CACHE, REORDER_SEARCH };
+	int mask = 0;
+	while (*list) {
+		const char* end = strchr(list, ',');
+		const size_t length = end ? end - list : strlen(list);
+		int i = 0;
+		while (i < 3 && (strlen(names[i]) != length || strncmp(list, names[i], length) != 0)) {
+			++i;
+		}
+		if (i == 3) {
+			return -1;
+		}
+		mask |= phases[i];
+		list += end ? length + 1 : length;
+	}
+	return mask;
 }
 
 void printUsage() {
-	std::cout << "Usage: bddReasoner [options]" << std::endl;
+	std::cout << "Usage: bddReasoner [options] [benchmark files]" << std::endl;
 	std::cout <<
 	"  -g		Read a second line of input as global assumptions."
 	<< std::endl;
@@ -423,21 +1114,113 @@ void printUsage() {
 	"  -reorder		Use dynamic BDD variable reordering."
 	<< std::endl;
 	std::cout <<
-	"  -norm		Use BDDs to completely normalise formulae as a preprocessing step."
+	"  -modalblocks		Reorder each box together with the propositions of its unboxing."
 	<< std::endl;
 	std::cout <<
-	"  -classify		Perform a classification of all atomic formulae."
+	"  -bddnodes <n>		Start BuDDy with n BDD nodes, instead of an estimate from the input."
 	<< std::endl;
-}
-
-void printSummaryStatistics() {
-	// Algorithm Statistics:
-	std::cout << " (" << satCacheAdds << ":" << satCacheHits;
-	std::cout << " / " << unsatCacheAdds << ":" << unsatCacheHits << ")";
-	std::cout << " [V: " << numVars << " - " << numVarsReduced << ",";
-	std::cout << " D: " << depth << "/" << maxDepth << ",";
-	std::cout << " MJ: " << totalModalJumpsExplored << ",";
-	std::cout << " SatMJ: " << totalSatisfiableModalJumps << ",";
+	std::cout <<
+	"  -bddcache <n>		Start BuDDy with an operation cache of n entries."
+	<< std::endl;
+	std::cout <<
+	"  -maxincrease <n>	Grow the node table by at most n nodes at a time (default 2500000, raised as needed)."
+	<< std::endl;
+	std::cout <<
+	"  -nodebudget <n>	Evict cached results and unboxings when more than n BDD nodes are in use."
+	<< std::endl;
+	std::cout <<
+	"  -sift <n>		Sift the BDD variables whenever more than n nodes are in use."
+	<< std::endl;
+	std::cout <<
+	"  -phases <list>		Only reorder in the given phases: gamma, cache and/or search, comma separated."
+	<< std::endl;
+	std::cout <<
+	"  -onlygamma		Same as -phases gamma."
+	<< std::endl;
+	std::cout <<
+	"  -schedule <how>		Conjoin the axioms of gamma smallest first (size), or by shared support (support)."
+	<< std::endl;
+	std::cout <<
+	"  -gammalimit <n>		With -schedule, give up when a partial BDD of gamma exceeds n nodes."
+	<< std::endl;
+	std::cout <<
+	"  -partition <n>		Keep gamma as clusters of up to n nodes, conjoined into worlds as needed (K only)."
+	<< std::endl;
+	std::cout <<
+	"  -define <n>		Replace subformulae under boxes of size n or more by defined propositions."
+	<< std::endl;
+	std::cout <<
+	"  -defineshared <n>		Replace subformulae under boxes with n or more parents by defined propositions."
+	<< std::endl;
+	std::cout <<
+	"  -showdefs		Print the subformulae replaced by -define or -defineshared."
+	<< std::endl;
+	std::cout <<
+	"  -compile <file>		Read gamma (as for -classify) and save it, ready to use, as an image."
+	<< std::endl;
+	std::cout <<
+	"  -image <file>		Use the gamma of an image saved with -compile, instead of reading one."
+	<< std::endl;
+	std::cout <<
+	"  -orderfile <file>		Reuse the variable order learned for these atoms, or save it after reordering."
+	<< std::endl;
+	std::cout <<
+	"  -order <name>		Static BDD variable ordering: bfs (default), dfs, depth, force or children."
+	<< std::endl;
+	std::cout <<
+	"  -norm		Use BDDs to completely normalise formulae as a preprocessing step."
+	<< std::endl;
+	std::cout <<
+	"  -native		Keep =>, <=> and ~ as they are, only normalising modal operators."
+	<< std::endl;
+	std::cout <<
+	"  -classify		Perform a classification of all atomic formulae."
+	<< std::endl;
+	std::cout <<
+	"  -lines		Read global assumptions one axiom per line, up to the end of input."
+	<< std::endl;
+	std::cout <<
+	"  -f <file>		Read input from the given file instead of standard in."
+	<< std::endl;
+	std::cout <<
+	"  -threads <n>		Parse and normalise the axioms read with -lines on n threads."
+	<< std::endl;
+	std::cout <<
+	"  -owl <file>		Read global assumptions (or the ontology) from an OWL functional syntax file."
+	<< std::endl;
+	std::cout <<
+	"  Benchmark files (LWB .txt/.txt.Z/.gz, or .intohylo) are read instead of standard in,"
+	<< std::endl;
+	std::cout <<
+	"  and every formula in them is checked separately."
+	<< std::endl;
+}
+
+void printSummaryStatistics() {
+	// Algorithm Statistics:
+	std::cout << " (" << satCacheAdds << ":" << satCacheHits;
+	std::cout << " / " << unsatCacheAdds << ":" << unsatCacheHits << ")";
+	std::cout << " [N: " << inputFormulaSize << " -> " << nnfFormulaSize << ",";
+	std::cout << " V: " << numVars << " - " << numVarsReduced << ",";
+	std::cout << " O: " << varOrderingName(varOrdering) << ",";
+	std::cout << " G: " << gammaBDDNodes << ",";
+	std::cout << " Sifts: " << numSifts << ",";
+	std::cout << " GC: " << numGarbageCollections << ":" << numTableGrowths << ",";
+	if (conjunctionSchedule != IN_ORDER) {
+		std::cout << " GPeak: " << peakConjunctionNodes << ",";
+	}
+	if (numDefinitions) {
+		std::cout << " Defs: " << numDefinitions << ",";
+	}
+	if (nodeBudget) {
+		std::cout << " Evict: " << numEvictions << ",";
+	}
+	if (partitionLimit) {
+		std::cout << " GParts: " << gammaClusters.size() << ":" << gammaClustersConjoined << ",";
+	}
+	std::cout << " D: " << depth << "/" << maxDepth << ",";
+	std::cout << " MJ: " << totalModalJumpsExplored << ",";
+	std::cout << " SatMJ: " << totalSatisfiableModalJumps << ",";
 	std::cout << " UnsatMJ: " << totalModalJumpsExplored - totalSatisfiableModalJumps - loopsDetected << ",";
 	std::cout << " Ref: " << totalBDDRefinements << ",";
 	std::cout << " FF[]: " << numFalseFromBox << ",";
@@ -455,10 +1238,229 @@ void printSummaryStatistics() {
 	std::cout << " Ub+: " << cachedUnboxings << ",";
 	std::cout << " UbHits: " << unboxCacheHits << ",";
 	std::cout << " Ud+: " << cachedUndiamondings << ",";
-	std::cout << " UdHits: " << undiamondCacheHits << "]";
+	std::cout << " UdHits: " << undiamondCacheHits << ",";
+	std::cout << " Fb+: " << cachedFormulaBDDs << ",";
+	std::cout << " FbHits: " << formulaBDDCacheHits << "]";
 	std::cout << std::endl;
 }
 
+/*
+ *	Reads the global assumptions (or ontology) from the input: the next line,
+ *	or with -lines every remaining line as a separate axiom, conjoining them.
+ *	With -owl they are the axioms of the OWL file instead.
+ *	Returns NULL if there are none, and exits on a parse error.
+ */
+KFormula* readGlobalAssumptions(InputReader& input) {
+	const char* begin;
+	const char* end;
+	if (owlFile) {
+		OwlReader ontology(owlFile);
+		if (ontology.axioms().empty()) {
+			return NULL;
+		}
+		return KFormula::makeNary(KFormula::AND, ontology.axioms());
+	}
+	if (!axiomPerLine) {
+		if (!input.nextLine(begin, end) || begin == end) {
+			return NULL;
+		}
+		KFormula* gamma = KFormula::parseKFormula(begin, end);
+		if (!gamma) {
+			exit(1);
+		}
+		return gamma;
+	}
+	
+	std::vector<KFormula*> axioms;
+	while (input.nextLine(begin, end)) {
+		if (begin == end) {
+			continue;
+		}
+		KFormula* axiom = KFormula::parseKFormula(begin, end);
+		if (!axiom) {
+			std::cerr << "ERROR: In axiom on line " << input.lineNumber() << "." << std::endl;
+			exit(1);
+		}
+		axioms.push_back(axiom);
+	}
+	if (axioms.empty()) {
+		return NULL;
+	}
+	return KFormula::makeNary(KFormula::AND, axioms);
+}
+
+/*
+ *	Reads the global assumptions (or ontology) and normalises them, adding to
+ *	the verbose size statistics. Returns NULL if there are none.
+ */
+KFormula* readNormalisedGamma(InputReader& input) {
+	if (axiomPerLine && !owlFile && frontEndThreads > 1) {
+		return parallelFrontEnd(input);
+	}
+	KFormula* gamma = readGlobalAssumptions(input);
+	if (!gamma) {
+		return NULL;
+	}
+	KFormula* gammaNNF = normalise(gamma);
+	if (verbose) {
+		inputFormulaSize += gamma->dagSize();
+		nnfFormulaSize += gammaNNF->dagSize();
+	}
+	return gammaNNF;
+}
+
+namespace {
+
+// A contiguous run of axiom lines, parsed and normalised by one thread in
+// its own arena.
+struct FrontEndRun {
+	size_t begin, end;// Indices into the lines.
+	KFormulaArena arena;
+	std::vector<KFormula*> axioms;
+	std::vector<KFormula*> normalised;
+	size_t errorLine;// Input line that failed to parse, or 0.
+};
+
+struct AxiomLine {
+	const char* begin;
+	const char* end;
+	size_t number;
+};
+
+// Standard input is copied out and normalised in batches of about this many
+// bytes of axioms.
+const size_t FRONT_END_BATCH = 1 << 24;
+
+void normaliseRun(FrontEndRun* run, const std::vector<AxiomLine>* lines) {
+	KFormula::setArena(&run->arena);
+	for (size_t i = run->begin; i < run->end; ++i) {
+		const AxiomLine& line = (*lines)[i];
+		KFormula* axiom = KFormula::parseKFormula(line.begin, line.end);
+		if (!axiom) {
+			run->errorLine = line.number;
+			break;
+		}
+		run->axioms.push_back(axiom);
+		run->normalised.push_back(normalise(axiom));
+	}
+	KFormula::setArena(NULL);
+}
+
+/*
+ *	Parses and normalises the lines on the front end threads, and appends
+ *	them (and, with -v, the axioms as read) to the given formulae, copied
+ *	into the shared arena in input order.
+ */
+void normaliseLines(const std::vector<AxiomLine>& lines, std::vector<KFormula*>& axioms,
+					std::vector<KFormula*>& normalised) {
+	const size_t numRuns = std::min<size_t>(frontEndThreads, lines.size());
+	std::vector<FrontEndRun> runs(numRuns);
+	std::vector<std::thread> threads;
+	for (size_t r = 0; r < numRuns; ++r) {
+		runs[r].begin = lines.size() * r / numRuns;
+		runs[r].end = lines.size() * (r + 1) / numRuns;
+		runs[r].errorLine = 0;
+		threads.push_back(std::thread(normaliseRun, &runs[r], &lines));
+	}
+	for (size_t r = 0; r < numRuns; ++r) {
+		threads[r].join();
+	}
+	for (size_t r = 0; r < numRuns; ++r) {
+		if (runs[r].errorLine) {
+			std::cerr << "ERROR: In axiom on line " << runs[r].errorLine << "." << std::endl;
+			exit(1);
+		}
+	}
+	
+	// Merge, deduplicating against everything copied before.
+	KFormulaArena& arena = KFormula::arena();
+	for (size_t r = 0; r < numRuns; ++r) {
+		// Symbols first, so they are numbered in order of first appearance,
+		// as when reading on a single thread.
+		for (uint32_t i = 0; i < runs[r].arena.props().size(); ++i) {
+			arena.props().intern(runs[r].arena.props().name(i));
+		}
+		for (uint32_t i = 0; i < runs[r].arena.roles().size(); ++i) {
+			arena.roles().intern(runs[r].arena.roles().name(i));
+		}
+		std::vector<uint32_t> map;
+		for (size_t i = 0; i < runs[r].normalised.size(); ++i) {
+			normalised.push_back(arena.import(runs[r].arena, runs[r].normalised[i]->getid(), map));
+			if (verbose) {
+				axioms.push_back(arena.import(runs[r].arena, runs[r].axioms[i]->getid(), map));
+			}
+		}
+		runs[r].arena.clear();
+	}
+}
+
+}
+
+/*
+ *	-lines with -threads: the axioms are split into contiguous runs of lines,
+ *	one per thread, and every thread parses and normalises its run in a
+ *	private arena, with its own symbols and memo tables. The runs are then
+ *	copied into the shared arena one after the other, in input order, so
+ *	the merged formula, and with it the numbering of formula nodes, symbols
+ *	and BDD variables, doesn't depend on the number of threads.
+ *	Normalising the axioms separately gives the same result as normalising
+ *	their conjunction.
+ *
+ *	The lines of a mapped file (-f) are parsed where they are. Standard
+ *	input only holds the current line, so it is copied out and normalised a
+ *	batch of lines at a time (see FRONT_END_BATCH), which splits it into
+ *	runs the same way.
+ */
+KFormula* parallelFrontEnd(InputReader& input) {
+	std::vector<KFormula*> axioms;
+	std::vector<KFormula*> normalised;
+	std::vector<AxiomLine> lines;
+	const char* begin;
+	const char* end;
+	if (input.isMapped()) {
+		while (input.nextLine(begin, end)) {
+			if (begin != end) {
+				AxiomLine line = {begin, end, input.lineNumber()};
+				lines.push_back(line);
+			}
+		}
+		normaliseLines(lines, axioms, normalised);
+	} else {
+		std::vector<char> text;
+		std::vector<size_t> starts;// Offsets of the lines in the text.
+		bool more = true;
+		while (more) {
+			text.clear();
+			starts.clear();
+			lines.clear();
+			while (text.size() < FRONT_END_BATCH && (more = input.nextLine(begin, end))) {
+				if (begin != end) {
+					AxiomLine line = {NULL, NULL, input.lineNumber()};
+					starts.push_back(text.size());
+					text.insert(text.end(), begin, end);
+					lines.push_back(line);
+				}
+			}
+			// The text has stopped moving: point the lines into it.
+			for (size_t i = 0; i < lines.size(); ++i) {
+				lines[i].begin = &text[0] + starts[i];
+				lines[i].end = &text[0] + (i + 1 < lines.size() ? starts[i + 1] : text.size());
+			}
+			normaliseLines(lines, axioms, normalised);
+		}
+	}
+	if (normalised.empty()) {
+		return NULL;
+	}
+	
+	KFormula* gammaNNF = KFormula::makeNary(KFormula::AND, normalised);
+	if (verbose) {
+		inputFormulaSize += KFormula::makeNary(KFormula::AND, axioms)->dagSize();
+		nnfFormulaSize += gammaNNF->dagSize();
+	}
+	return gammaNNF;
+}
+
 /*
  *  BoxNNF: NNF with the following exceptions:
  *  BoxNNF(~[]phi) = ~BoxNNF([]phi)
@@ -468,225 +1470,484 @@ void printSummaryStatistics() {
  *	as ~<>~phi = []phi.
  */
 KFormula* toBoxNNF(KFormula* f) {
+	return toBoxNNF(f, true);
+}
+
+/*
+ *	BoxNNF of f if positive, or of ~f otherwise.
+ *
+ *	Results are memoized per (subformula, polarity), so on the shared formula
+ *	DAG every subformula is converted at most twice. In particular <=> reuses
+ *	the conversions of its operands instead of copying them, which would
+ *	otherwise blow up exponentially on nested equivalences.
+ */
+KFormula* toBoxNNF(KFormula* f, bool positive) {
+	std::vector<KFormula*>& memo = boxNNFs[positive];
+	if (f->getid() < memo.size() && memo[f->getid()]) {
+		return memo[f->getid()];
+	}
+	KFormula* result = NULL;
 	switch (f->getop()) {
 		case KFormula::AP:
-			return f;
-		case KFormula::AND:
-			return new KFormula(KFormula::AND, toBoxNNF(&(f->getleft())), toBoxNNF(&(f->getright())));
+			result = positive ? f : KFormula::makeNot(f);
+			break;
+		case KFormula::AND:// Fall through
 		case KFormula::OR:
-			return new KFormula(KFormula::OR, toBoxNNF(&(f->getleft())), toBoxNNF(&(f->getright())));
-		case KFormula::BOX:
-			{KFormula* tmpf = new KFormula(KFormula::BOX, toBoxNNF(&(f->getleft())), NULL);
-			tmpf->setprop(f->getprop());
-			return tmpf;}
+			// De Morgan over every operand when negative.
+			{std::vector<KFormula*> args;
+			args.reserve(f->arity());
+			for (size_t i = 0; i < f->arity(); ++i) {
+				args.push_back(toBoxNNF(&(f->getarg(i)), positive));
+			}
+			KFormula::KFormulaType op = f->getop();
+			if (!positive) {
+				op = (op == KFormula::AND) ? KFormula::OR : KFormula::AND;
+			}
+			result = KFormula::makeNary(op, args);}
+			break;
+		case KFormula::BOX:// BoxNNF(~[]phi) = ~[]BoxNNF(phi)
+			result = KFormula::makeModal(KFormula::BOX, f->getsymbol(),
+								toBoxNNF(&(f->getleft()), true));
+			if (!positive) {
+				result = KFormula::makeNot(result);
+			}
+			break;
 		case KFormula::DIA:// BoxNNF(<>phi) = ~[]BoxNNF(~phi)
-			{KFormula* tmpf = new KFormula(KFormula::BOX,
-													toBoxNNF(new KFormula(KFormula::NOT,
-														&(f->getleft()),
-														NULL)),
-													NULL);
-			tmpf->setprop(f->getprop());// TODO this multimodal hack is really ugly...
-			return new KFormula(KFormula::NOT,
-								tmpf,
-								NULL);}
-		case KFormula::TRUE:
-			return f;
+			result = KFormula::makeModal(KFormula::BOX, f->getsymbol(),
+								toBoxNNF(&(f->getleft()), false));
+			if (positive) {
+				result = KFormula::makeNot(result);
+			}
+			break;
+		case KFormula::TRUE:// Fall through
 		case KFormula::FALSE:
-			return f;
+			result = KFormula::makeConst((f->getop() == KFormula::TRUE) == positive);
+			break;
 		case KFormula::IMP:
-			return toBoxNNF(new KFormula(KFormula::OR, new KFormula(KFormula::NOT, &(f->getleft()), NULL), &(f->getright())));
-		case KFormula::NOT:
-			switch (f->getleft().getop()) {
-				case KFormula::AP:
-					return f;
-				case KFormula::AND:
-					return new KFormula(KFormula::OR,
-								toBoxNNF(new KFormula(KFormula::NOT, &(f->getleft().getleft()), NULL)),
-								toBoxNNF(new KFormula(KFormula::NOT, &(f->getleft().getright()), NULL)));
-				case KFormula::OR:
-					return new KFormula(KFormula::AND,
-								toBoxNNF(new KFormula(KFormula::NOT, &(f->getleft().getleft()), NULL)),
-								toBoxNNF(new KFormula(KFormula::NOT, &(f->getleft().getright()), NULL)));
-				case KFormula::BOX:// BoxNNF(~[]phi) = ~[]BoxNNF(phi)
-					{KFormula* tmpf = new KFormula(KFormula::BOX,
-											toBoxNNF(&(f->getleft().getleft())), NULL);
-					tmpf->setprop(f->getleft().getprop());
-					return new KFormula(KFormula::NOT,
-										tmpf,
-										NULL);}
-				case KFormula::DIA:
-					{KFormula* tmpf = new KFormula(KFormula::BOX,
-								toBoxNNF(new KFormula(KFormula::NOT, &(f->getleft().getleft()), NULL)),
-								NULL);
-					tmpf->setprop(f->getleft().getprop());
-					return tmpf;}
-				case KFormula::TRUE:
-					return new KFormula(false);
-				case KFormula::FALSE:
-					return new KFormula(true);
-				case KFormula::IMP:
-					return toBoxNNF(new KFormula(KFormula::AND, &(f->getleft().getleft()), new KFormula(KFormula::NOT, &(f->getleft().getright()), NULL)));
-				case KFormula::NOT:
-					return toBoxNNF(&(f->getleft().getleft()));
-				case KFormula::EQU:
-					return new KFormula(KFormula::AND,
-								new KFormula(KFormula::OR,
-									toBoxNNF(new KFormula(KFormula::NOT, &(f->getleft().getleft()), NULL)),
-									toBoxNNF(new KFormula(KFormula::NOT, &(f->getleft().getright()), NULL))),
-								new KFormula(KFormula::OR,
-									toBoxNNF(&(f->getleft().getleft())),
-									toBoxNNF(&(f->getleft().getright()))));
-				default:
-					assert(false && "Defaulted out of complete switch.");
+			if (positive) {
+				result = KFormula::makeBinary(KFormula::OR,
+								toBoxNNF(&(f->getleft()), false),
+								toBoxNNF(&(f->getright()), true));
+			} else {
+				result = KFormula::makeBinary(KFormula::AND,
+								toBoxNNF(&(f->getleft()), true),
+								toBoxNNF(&(f->getright()), false));
 			}
+			break;
+		case KFormula::NOT:
+			result = toBoxNNF(&(f->getleft()), !positive);
+			break;
 		case KFormula::EQU:
-			return new KFormula(KFormula::OR,
-							new KFormula(KFormula::AND,
-								toBoxNNF(&(f->getleft())),
-								toBoxNNF(&(f->getright()))),
-							new KFormula(KFormula::AND,
-								toBoxNNF(new KFormula(KFormula::NOT, &(f->getleft()), NULL)),
-								toBoxNNF(new KFormula(KFormula::NOT, &(f->getright()), NULL))));
+			{KFormula* leftPos = toBoxNNF(&(f->getleft()), true);
+			KFormula* leftNeg = toBoxNNF(&(f->getleft()), false);
+			KFormula* rightPos = toBoxNNF(&(f->getright()), true);
+			KFormula* rightNeg = toBoxNNF(&(f->getright()), false);
+			if (positive) {
+				result = KFormula::makeBinary(KFormula::OR,
+								KFormula::makeBinary(KFormula::AND, leftPos, rightPos),
+								KFormula::makeBinary(KFormula::AND, leftNeg, rightNeg));
+			} else {
+				result = KFormula::makeBinary(KFormula::AND,
+								KFormula::makeBinary(KFormula::OR, leftNeg, rightNeg),
+								KFormula::makeBinary(KFormula::OR, leftPos, rightPos));
+			}}
+			break;
 		default:
 			assert(false && "Defaulted out of complete switch.");
 	}
+	if (memo.size() <= f->getid()) {
+		memo.resize(KFormula::arena().size(), NULL);
+	}
+	memo[f->getid()] = result;
+	return result;
 }
 
 /*
- * Assumes BoxNNF
+ *	BoxNF: only the modal operators are normalised, as in BoxNNF:
+ *	BoxNF(<>phi) = ~[]BoxNF(~phi)
+ *	Propositional connectives (including => and <=>) are kept as they are,
+ *	and BDDs are built for them directly; negation is only pushed far enough
+ *	to cancel double negations. Memoized per subformula.
  */
-void findAllRoles(KFormula* f, std::unordered_set<std::string>& roles) {
+KFormula* toBoxNF(KFormula* f) {
+	if (f->getid() < boxNFs.size() && boxNFs[f->getid()]) {
+		return boxNFs[f->getid()];
+	}
+	KFormula* result = NULL;
 	switch (f->getop()) {
-		case KFormula::AP:
-			return;
-		case KFormula::AND:
-			findAllRoles(&(f->getleft()), roles);
-			findAllRoles(&(f->getright()), roles);
-			return;
-		case KFormula::OR:
-			findAllRoles(&(f->getleft()), roles);
-			findAllRoles(&(f->getright()), roles);
-			return;
-		case KFormula::BOX:
-			roles.insert(f->getprop());
-			findAllRoles(&(f->getleft()), roles);
-			return;
-		case KFormula::NOT:
-			findAllRoles(&(f->getleft()), roles);
-			return;
+		case KFormula::AP:// Fall through
 		case KFormula::TRUE:
-			return;
 		case KFormula::FALSE:
-			return;
-		case KFormula::DIA:
-			assert(false && "Role finding not defined for <>.");
-		case KFormula::IMP:
-			assert(false && "Role finding not defined for =>.");
+			result = f;
+			break;
+		case KFormula::AND:// Fall through
+		case KFormula::OR:
+			{std::vector<KFormula*> args;
+			args.reserve(f->arity());
+			for (size_t i = 0; i < f->arity(); ++i) {
+				args.push_back(toBoxNF(&(f->getarg(i))));
+			}
+			result = KFormula::makeNary(f->getop(), args);}
+			break;
+		case KFormula::IMP:// Fall through
 		case KFormula::EQU:
-			assert(false && "Role finding not defined for <=>.");
+			result = KFormula::makeBinary(f->getop(),
+								toBoxNF(&(f->getleft())), toBoxNF(&(f->getright())));
+			break;
+		case KFormula::BOX:
+			result = KFormula::makeModal(KFormula::BOX, f->getsymbol(),
+								toBoxNF(&(f->getleft())));
+			break;
+		case KFormula::DIA:// BoxNF(<>phi) = ~[]BoxNF(~phi)
+			result = KFormula::makeNot(KFormula::makeModal(KFormula::BOX, f->getsymbol(),
+								toBoxNF(KFormula::makeNot(&(f->getleft())))));
+			break;
+		case KFormula::NOT:
+			result = toBoxNF(&(f->getleft()));
+			if (result->getop() == KFormula::NOT) {
+				result = &(result->getleft());
+			} else {
+				result = KFormula::makeNot(result);
+			}
+			break;
 		default:
-			assert(false && "Defaulted out of complete switch");
+			assert(false && "Defaulted out of complete switch.");
+	}
+	if (boxNFs.size() <= f->getid()) {
+		boxNFs.resize(KFormula::arena().size(), NULL);
+	}
+	boxNFs[f->getid()] = result;
+	return result;
+}
+
+/*
+ *	The normal form used for the input: BoxNF with -native, BoxNNF otherwise.
+ */
+KFormula* normalise(KFormula* f) {
+	return nativeConnectives ? toBoxNF(f) : toBoxNNF(f);
+}
+
+/*
+ *	State of one definitional abstraction, see defineSubformulae().
+ */
+struct SubformulaDefiner {
+	std::vector<uint32_t> parents;// Number of distinct parents, by formula id.
+	std::vector<KFormula*> defined[2];// Rewritten formulae, by id: [1] under a box.
+	std::vector<size_t> sizes;// Tree sizes after rewriting, by id.
+	std::vector<KFormula*> definitions;
+	size_t lastName;// N of the last _dN made.
+	
+	SubformulaDefiner() : lastName(0) {}
+	
+	void countParents(KFormula* root) {
+		std::vector<bool> visited(KFormula::arena().size(), false);
+		std::vector<KFormula*> pending(1, root);
+		visited[root->getid()] = true;
+		while (!pending.empty()) {
+			KFormula* f = pending.back();
+			pending.pop_back();
+			for (size_t i = 0; i < f->arity(); ++i) {
+				KFormula* arg = &(f->getarg(i));
+				++parents[arg->getid()];
+				if (!visited[arg->getid()]) {
+					visited[arg->getid()] = true;
+					pending.push_back(arg);
+				}
+			}
+		}
+	}
+	
+	KFormula* rewrite(KFormula* f, bool underBox) {
+		const uint32_t id = f->getid();
+		if (defined[underBox][id]) {
+			return defined[underBox][id];
+		}
+		KFormula* result = f;
+		size_t size = 1;
+		switch (f->getop()) {
+			case KFormula::AND:// Fall through
+			case KFormula::OR:
+				{std::vector<KFormula*> args;
+				args.reserve(f->arity());
+				for (size_t i = 0; i < f->arity(); ++i) {
+					args.push_back(rewrite(&(f->getarg(i)), underBox));
+					size += sizes[args.back()->getid()];
+				}
+				result = KFormula::makeNary(f->getop(), args);}
+				break;
+			case KFormula::IMP:// Fall through
+			case KFormula::EQU:
+				{KFormula* left = rewrite(&(f->getleft()), underBox);
+				KFormula* right = rewrite(&(f->getright()), underBox);
+				size += sizes[left->getid()] + sizes[right->getid()];
+				result = KFormula::makeBinary(f->getop(), left, right);}
+				break;
+			case KFormula::NOT:
+				{KFormula* arg = rewrite(&(f->getleft()), underBox);
+				size += sizes[arg->getid()];
+				result = arg == &(f->getleft()) ? f : KFormula::makeNot(arg);}
+				break;
+			case KFormula::BOX:
+				{KFormula* arg = rewrite(&(f->getleft()), true);
+				size += sizes[arg->getid()];
+				result = arg == &(f->getleft()) ? f : KFormula::makeModal(KFormula::BOX, f->getsymbol(), arg);}
+				break;
+			default:
+				break;
+		}
+		grow();
+		if (underBox && result->arity() > 1
+				&& ((defineSize && size >= defineSize)
+					|| (defineShared && parents[id] >= defineShared))) {
+			// The input may have propositions named _dN too: skip those.
+			std::string name;
+			do {
+				std::ostringstream next;
+				next << "_d" << ++lastName;
+				name = next.str();
+			} while (KFormula::arena().props().lookup(name) != SymbolTable::NONE);
+			KFormula* atom = KFormula::makeAtom(name);
+			if (definitionSymbols.size() <= atom->getsymbol()) {
+				definitionSymbols.resize(atom->getsymbol() + 1, false);
+			}
+			definitionSymbols[atom->getsymbol()] = true;
+			definitions.push_back(KFormula::makeBinary(KFormula::EQU, atom, result));
+			if (showDefinitions) {
+				std::cout << *atom << " <=> " << *result << std::endl;
+			}
+			result = atom;
+			size = 1;
+			grow();
+		}
+		sizes[result->getid()] = size;
+		defined[underBox][id] = result;
+		return result;
+	}
+	
+	// Rewriting adds formulae to the arena, so the tables follow its size.
+	void grow() {
+		const size_t n = KFormula::arena().size();
+		if (sizes.size() < n) {
+			parents.resize(n, 0);
+			defined[0].resize(n, NULL);
+			defined[1].resize(n, NULL);
+			sizes.resize(n, 0);
+		}
+	}
+};
+
+/*
+ *	Definitional abstraction, after normalisation (-define, -defineshared).
+ *	Every compound subformula under a box that is at least defineSize large
+ *	(as a tree, counting subformulae already replaced as one), or has at
+ *	least defineShared parents, is replaced by a fresh proposition _dN (with
+ *	N skipping the names of input propositions), bottom up. Keeps unboxings small, at the cost of the definitions
+ *	_dN <=> phi, which are conjoined to the returned gamma: as gamma holds in
+ *	every world, the result is satisfiable exactly when the input is.
+ *
+ *	The given formulae are rewritten in place.
+ */
+KFormula* defineSubformulae(std::vector<KFormula*>& formulae, KFormula* gamma) {
+	SubformulaDefiner definer;
+	definer.grow();
+	definer.countParents(gamma);
+	for (size_t i = 0; i < formulae.size(); ++i) {
+		definer.countParents(formulae[i]);
+	}
+	for (size_t i = 0; i < formulae.size(); ++i) {
+		formulae[i] = definer.rewrite(formulae[i], false);
+	}
+	gamma = definer.rewrite(gamma, false);
+	numDefinitions = definer.definitions.size();
+	if (definer.definitions.empty()) {
+		return gamma;
+	}
+	definer.definitions.insert(definer.definitions.begin(), gamma);
+	return KFormula::makeNary(KFormula::AND, definer.definitions);
+}
+
+/*
+ *	Whether the proposition symbol was made by defineSubformulae().
+ */
+bool isDefinitionSymbol(uint32_t symbol) {
+	return symbol < definitionSymbols.size() && definitionSymbols[symbol];
+}
+
+/*
+ * Assumes BoxNNF (or BoxNF)
+ */
+void findAllRoles(KFormula* f, std::vector<bool>& roles) {
+	// Shared subformulae only need to be explored on their first visit.
+	std::vector<bool> visited(KFormula::arena().size());
+	std::vector<KFormula*> formulae(1, f);
+	while (!formulae.empty()) {
+		f = formulae.back();
+		formulae.pop_back();
+		if (visited[f->getid()]) {
+			continue;
+		}
+		visited[f->getid()] = true;
+		switch (f->getop()) {
+			case KFormula::AP:
+				break;
+			case KFormula::AND:// Fall through
+			case KFormula::OR:
+			case KFormula::IMP:
+			case KFormula::EQU:
+				for (size_t i = 0; i < f->arity(); ++i) {
+					formulae.push_back(&(f->getarg(i)));
+				}
+				break;
+			case KFormula::BOX:
+				roles[f->getsymbol()] = true;
+				formulae.push_back(&(f->getleft()));
+				break;
+			case KFormula::NOT:
+				formulae.push_back(&(f->getleft()));
+				break;
+			case KFormula::TRUE:
+				break;
+			case KFormula::FALSE:
+				break;
+			case KFormula::DIA:
+				assert(false && "Role finding not defined for <>.");
+			default:
+				assert(false && "Defaulted out of complete switch");
+		}
 	}
 }
 
 /*
- * Create a mapping from string roles to integer roles.
+ * Create a mapping from role symbols to integer roles. roles marks the
+ * symbols present, and roleMap is indexed by symbol (0 for absent roles).
  */
-void assignRoleInts(std::unordered_set<std::string>& roles,
-		std::unordered_map<std::string, int>& roleMap) {
+void assignRoleInts(std::vector<bool>& roles, std::vector<int>& roleMap) {
 	// numRoles needs to be a global thing.
 	// inverseRolesExist should be a global thing too.
+	SymbolTable& symbols = KFormula::arena().roles();
+	roleMap.assign(roles.size(), 0);
 	// Go through the roles
-	for (std::unordered_set<std::string>::iterator roleIt = roles.begin();
-			roleIt != roles.end(); ++roleIt) {
-		if (roleIt->compare("") == 0) {
-			// Empty string has no inverse role, give it a new positive role.
-			numRoles++;
-			roleMap.insert(std::pair<std::string, int>(*roleIt, numRoles));
+	for (uint32_t role = 0; role < roles.size(); ++role) {
+		if (!roles[role]) {
 			continue;
 		}
-		if (roleIt->at(0) != '-') {
-			// Look for "-'thisRole'" in the roles we've already done
-			if (roleMap.count("-" + *roleIt) != 0) {
-				// Then this role gets minus the other role.
-				roleMap.insert(std::pair<std::string, int>(*roleIt, - roleMap.at("-" + *roleIt)));
-				inverseRoles = true;
-				continue;
-			}
-		} else {
-			// Look for 'thisRole' without the preceeding '-' in the ones we've already done.
-			if (roleMap.count(roleIt->substr(1, std::string::npos)) != 0) {
-				// Then this role gets minus the other role.
-				roleMap.insert(std::pair<std::string, int>(
-						*roleIt, - roleMap.at(roleIt->substr(1, std::string::npos))));
-				inverseRoles = true;
-				continue;
-			}
+		// The empty role has no inverse; otherwise look for the inverse
+		// ("-r" for "r" and vice versa) in the roles we've already done.
+		uint32_t inverse = symbols.inverse(role);
+		if (inverse != SymbolTable::NONE && inverse < roles.size() && roleMap[inverse] != 0) {
+			// Then this role gets minus the other role.
+			roleMap[role] = - roleMap[inverse];
+			inverseRoles = true;
+			continue;
 		}
 		// Otherwise, make a new positive role
 		numRoles++;
-		roleMap.insert(std::pair<std::string, int>(*roleIt, numRoles));
+		roleMap[role] = numRoles;
 	}
 }
 
 /*
- * Traverse the formula, replacing string roles with integer roles.
+ * Traverse the formula, replacing role symbols with integer roles.
  */
-void applyRoleInts(KFormula* f, std::unordered_map<std::string, int>& roleMap) {
-	switch (f->getop()) {
-		case KFormula::AP:
-			return;
-		case KFormula::AND:
-			applyRoleInts(&(f->getleft()), roleMap);
-			applyRoleInts(&(f->getright()), roleMap);
-			return;
-		case KFormula::OR:
-			applyRoleInts(&(f->getleft()), roleMap);
-			applyRoleInts(&(f->getright()), roleMap);
-			return;
-		case KFormula::BOX:
-			f->setrole(roleMap.at(f->getprop()));
-			applyRoleInts(&(f->getleft()), roleMap);
-			return;
-		case KFormula::NOT:
-			applyRoleInts(&(f->getleft()), roleMap);
-			return;
-		case KFormula::TRUE:
-			return;
-		case KFormula::FALSE:
-			return;
-		case KFormula::DIA:
-			assert(false && "Role replacing not defined for <>.");
-		case KFormula::IMP:
-			assert(false && "Role replacing not defined for =>.");
-		case KFormula::EQU:
-			assert(false && "Role replacing not defined for <=>.");
-		default:
-			assert(false && "Defaulted out of complete switch");
+void applyRoleInts(KFormula* f, std::vector<int>& roleMap) {
+	// Shared subformulae only need to be explored on their first visit.
+	std::vector<bool> visited(KFormula::arena().size());
+	std::vector<KFormula*> formulae(1, f);
+	while (!formulae.empty()) {
+		f = formulae.back();
+		formulae.pop_back();
+		if (visited[f->getid()]) {
+			continue;
+		}
+		visited[f->getid()] = true;
+		switch (f->getop()) {
+			case KFormula::AP:
+				break;
+			case KFormula::AND:// Fall through
+			case KFormula::OR:
+			case KFormula::IMP:
+			case KFormula::EQU:
+				for (size_t i = 0; i < f->arity(); ++i) {
+					formulae.push_back(&(f->getarg(i)));
+				}
+				break;
+			case KFormula::BOX:
+				f->setrole(roleMap[f->getsymbol()]);
+				formulae.push_back(&(f->getleft()));
+				break;
+			case KFormula::NOT:
+				formulae.push_back(&(f->getleft()));
+				break;
+			case KFormula::TRUE:
+				break;
+			case KFormula::FALSE:
+				break;
+			case KFormula::DIA:
+				assert(false && "Role replacing not defined for <>.");
+			default:
+				assert(false && "Defaulted out of complete switch");
+		}
 	}
 }
 
-/* 
- * Comparator function to use c++ sets of KFormula*
+/*
+ *	Declares the variables of the newly related atoms, and renumbers them in
+ *	the chosen order (or applies one saved with -orderfile).
  */
-bool kformulaComp(const KFormula* f1, const KFormula* f2) {
-	return ((*f1).compare((*f2)) < 0);
+void orderVars(std::vector<KFormula*>& atoms, const std::vector<KFormula*>& roots) {
+	bdd_setvarnum(numVars);
+	std::vector<int> order;
+	computeVarOrder(varOrdering, roots, numVars, order);
+	if (modalBlocks) {
+		groupModalVars(roots, numVars, order, varBlocks);
+	}
+	// Renumber the variables in the chosen order, so that numbers are levels
+	// and the blocks are ranges of both.
+	std::vector<int> newVar(numVars);
+	for (int level = 0; level < numVars; ++level) {
+		newVar[order[level]] = level;
+	}
+	for (std::vector<KFormula*>::iterator it = atoms.begin(); it < atoms.end(); ++it) {
+		(**it).setvar(newVar[(**it).getvar()]);
+		varsToAtoms.at((**it).getvar()) = *it;
+	}
+	if (orderFile) {
+		atomSetKey = atomSetHash(varsToAtoms);
+		orderLoaded = loadVarOrder(orderFile, atomSetKey, numVars, order);
+		if (orderLoaded) {
+			bdd_setvarorder(&order[0]);
+		}
+	}
 }
 
 /*
  *	Creates a mapping from BDD variables to formulae.
  *	The reverse mapping from formulae to BDD variables is written on the given
- *	formula tree directly.
+ *	formula nodes directly. As formulae are hash-consed, each distinct atom is
+ *	a single node, so it is visited (and given a variable) exactly once.
  *
  *	Assumes given formulae are in BoxNNF.
  *
- *	The initial ordering of the BDD variables is breadth-first order,
- *	as the corresponding formulae are found in the original formula.
+ *	The atoms are found in breadth-first order in the original formula, and
+ *	their variables are numbered in the order chosen with -order (breadth-first
+ *	by default), with -modalblocks grouping each box with its propositions.
+ *	Numbers are also the initial levels of the variables in the BDDs.
  */
 void relateAtomsAndBDDVars(std::vector<KFormula*>& atoms, std::deque<KFormula*>& formulae) {
+	const std::vector<KFormula*> roots(formulae.begin(), formulae.end());
+	// Shared subformulae only need to be explored on their first visit.
+	std::vector<bool> visited(KFormula::arena().size());
 	while (!formulae.empty()) {
 		KFormula* formula = formulae.front();
 		formulae.pop_front();
+		if (visited[formula->getid()]) {
+			continue;
+		}
+		visited[formula->getid()] = true;
+		if (formula->getvar() >= 0) {
+			// An atom of an image's gamma, that already has a variable.
+			continue;
+		}
 		switch (formula->getop()) {
 			case KFormula::AP:
 				atoms.push_back(formula);
@@ -701,9 +1962,12 @@ void relateAtomsAndBDDVars(std::vector<KFormula*>& atoms, std::deque<KFormula*>&
 				break;
 			case KFormula::AND:// Fall through
 			case KFormula::OR:
-				// Breadth-first add from both sides.
-				formulae.push_back(&(formula->getleft()));
-				formulae.push_back(&(formula->getright()));
+			case KFormula::IMP:
+			case KFormula::EQU:
+				// Breadth-first add from every operand.
+				for (size_t i = 0; i < formula->arity(); ++i) {
+					formulae.push_back(&(formula->getarg(i)));
+				}
 				break;
 			case KFormula::TRUE:
 				break;
@@ -711,38 +1975,33 @@ void relateAtomsAndBDDVars(std::vector<KFormula*>& atoms, std::deque<KFormula*>&
 				break;
 			case KFormula::DIA:
 				assert(false && "Atom adding not defined for <>.");
-			case KFormula::IMP:
-				assert(false && "Atom adding not defined for =>.");
-			case KFormula::EQU:
-				assert(false && "Atom adding not defined for <=>.");
 			default:
 				assert(false && "Defaulted out of complete switch");
 		}
 	}
 	// Relate all the extracted atoms with bdd variables.
+	// Write the variable number onto the formula directly.
+	const int firstNewVar = numVars;
 	for (std::vector<KFormula*>::iterator it = atoms.begin(); it < atoms.end(); ++it) {
-		if (atomsToVars.count(*it) == 0) {
-			// Write the variable number onto the formula directly.
-			(**it).setvar(numVars);
-			atomsToVars.insert(std::pair<const KFormula*, int>(*it, numVars));
-			varsToAtoms.push_back(*it);
-			++numVars;
-		} else {
-			// Still write the variable number onto the formula directly.
-			(**it).setvar(atomsToVars.at(*it));
-		}
+		(**it).setvar(numVars);
+		varsToAtoms.push_back(*it);
+		++numVars;
+	}
+	if (imageLoaded) {
+		// Gamma's variables are fixed by the image; psi's new atoms go after them.
+		bdd_extvarnum(numVars - firstNewVar);
+	} else {
+		orderVars(atoms, roots);
 	}
-	bdd_setvarnum(numVars);
-	// Clear atomsToVars, it will no longer be used. Vars have been written onto the formulae.
-	atomsToVars.clear();
 	
 	// Since the number of variables is now known, some maps from variables to 
 	// other things can now be appropriately initialised.
-	varsToChildren.resize(numVars + 1);
 	unboxings.resize(numVars + 1);
 	unboxed.resize(numVars + 1);
 	undiamondings.resize(numVars + 1);
 	undiamonded.resize(numVars + 1);
+	unboxingUses.resize(numVars + 1);
+	undiamondingUses.resize(numVars + 1);
 	
 	if (bddNormalise) {
 		std::unordered_map<bdd, int, BddHasher> unboxbddToVar;
@@ -778,13 +2037,69 @@ void relateAtomsAndBDDVars(std::vector<KFormula*>& atoms, std::deque<KFormula*>&
 		if (S4) {
 			// If in S4, we'll unbox by stepping past surface boxes,
 			// so we don't want these 'cause they'll be different.
-			unboxings.clear();
-			unboxings.resize(numVars + 1);
-			unboxed.clear();
-			unboxed.resize(numVars + 1);
+			// (Those of an image's gamma were built for S4 already.)
+			for (int var = firstNewVar; var <= numVars; ++var) {
+				unboxings.at(var) = bdd();
+				unboxed.at(var) = false;
+			}
 		}
 	}
 	
+	// With the variables final, tabulate what the search needs of them.
+	buildVarTable();
+}
+
+/*
+ *	Fills in varInfo for every variable, with the children of the box
+ *	variables (see computeChildren() and computeChildrenBoxS4()) laid out in
+ *	varChildren and varChildrenS4, and lists the box variables of each role.
+ *	The search then reads these flat arrays instead of the formulae.
+ *
+ *	Assumes the variables have been related to their atoms, as they will be
+ *	used in the BDDs.
+ */
+void buildVarTable() {
+	varInfo.assign(numVars, VarInfo());
+	varChildren.clear();
+	varChildrenS4.clear();
+	std::vector<std::vector<int>> boxVarsOfRole(numRoles + 1);
+	VarSet children;// Iterated in order, so the arrays come out sorted.
+	for (int var = 0; var < numVars; ++var) {
+		VarInfo& info = varInfo[var];
+		info.kind = PROP_VAR;
+		info.role = 0;
+		info.childrenBegin = info.childrenEnd = varChildren.size();
+		info.childrenS4Begin = info.childrenS4End = varChildrenS4.size();
+		if (var == existsDia) {
+			info.kind = EXISTS_DIA_VAR;
+			continue;
+		}
+		const KFormula* atom = varsToAtoms.at(var);
+		if (atom->getop() != KFormula::BOX) {
+			continue;
+		}
+		info.kind = BOX_VAR;
+		info.role = atom->getrole();
+		if (info.role >= 0 && info.role <= numRoles) {
+			boxVarsOfRole[info.role].push_back(var);
+		}
+		children.clear();
+		computeChildren(&(atom->getleft()), children);
+		varChildren.insert(varChildren.end(), children.begin(), children.end());
+		info.childrenEnd = varChildren.size();
+		if (S4) {
+			children.clear();
+			computeChildrenBoxS4(&(atom->getleft()), children);
+			varChildrenS4.insert(varChildrenS4.end(), children.begin(), children.end());
+			info.childrenS4End = varChildrenS4.size();
+		}
+	}
+	roleBoxVars.clear();
+	roleBoxVarsBegin.assign(1, 0);
+	for (int role = 0; role <= numRoles; ++role) {
+		roleBoxVars.insert(roleBoxVars.end(), boxVarsOfRole[role].begin(), boxVarsOfRole[role].end());
+		roleBoxVarsBegin.push_back(roleBoxVars.size());
+	}
 }
 
 /*
@@ -792,17 +2107,27 @@ void relateAtomsAndBDDVars(std::vector<KFormula*>& atoms, std::deque<KFormula*>&
  *	that are immediate subformulae of the formula represented by 'var'.
  *	
  *	Assumes formulae are in BoxNNF, and that 'var' is a box formula.
- *	
- *	Makes use of a cache of this relationship, using computeChildren() to 
- *	compute it once and then storing the result.
  */
-std::unordered_set<int>& getChildren(int var) {
-	if (varsToChildren.at(var).empty()) {// Surrogate for 'mapping does not exist'.
-		// Get all immediate children
-		// add them to the global relations.
-		computeChildren(&(varsToAtoms.at(var)->getleft()), varsToChildren.at(var));
-	}
-	return varsToChildren.at(var);
+VarRange getChildren(int var) {
+	const VarInfo& info = varInfo[var];
+	return VarRange(varChildren.data() + info.childrenBegin, varChildren.data() + info.childrenEnd);
+}
+
+/*
+ *	As getChildren(), past any intermediate boxes, for S4 (see
+ *	computeChildrenBoxS4()).
+ */
+VarRange getChildrenS4(int var) {
+	const VarInfo& info = varInfo[var];
+	return VarRange(varChildrenS4.data() + info.childrenS4Begin, varChildrenS4.data() + info.childrenS4End);
+}
+
+/*
+ *	Returns the box variables of the given role.
+ */
+VarRange getRoleBoxVars(int role) {
+	return VarRange(roleBoxVars.data() + roleBoxVarsBegin.at(role),
+			roleBoxVars.data() + roleBoxVarsBegin.at(role + 1));
 }
 
 /*
@@ -812,7 +2137,7 @@ std::unordered_set<int>& getChildren(int var) {
  *	Assumes the given formula is in BoxNNF, and that BDD variable numbers
  *	have been written on to the given formula.
  */
-void computeChildren(const KFormula* formula, std::unordered_set<int>& children) {
+void computeChildren(const KFormula* formula, VarSet& children) {
 	switch (formula->getop()) {
 		case KFormula::AP:// Fall through
 		case KFormula::BOX:
@@ -824,9 +2149,12 @@ void computeChildren(const KFormula* formula, std::unordered_set<int>& children)
 			break;
 		case KFormula::AND:// Fall through
 		case KFormula::OR:
-			// Left to right get from both sides.
-			computeChildren(&(formula->getleft()), children);
-			computeChildren(&(formula->getright()), children);
+		case KFormula::IMP:
+		case KFormula::EQU:
+			// Left to right get from every operand.
+			for (size_t i = 0; i < formula->arity(); ++i) {
+				computeChildren(&(formula->getarg(i)), children);
+			}
 			break;
 		case KFormula::TRUE:
 			break;
@@ -834,62 +2162,656 @@ void computeChildren(const KFormula* formula, std::unordered_set<int>& children)
 			break;
 		case KFormula::DIA:
 			assert(false && "Children getting not defined for <>.");
+		default:
+			assert(false && "Defaulted out of complete switch");
+	}
+}
+
+/*
+ *	Traverse the given formula to find all the atomic propositions and 
+ *	box formulae that are immediate subformulae.
+ *
+ *	S4 version where intermediate boxes are ignored. Note recursion falls
+ *	back to the normal version after a disjunction.
+ *
+ *	Assumes the given formula is in BoxNNF, and that BDD variable numbers
+ *	have been written on to the given formula.
+ */
+void computeChildrenBoxS4(const KFormula* formula, VarSet& children) {
+	switch (formula->getop()) {
+		case KFormula::AP:// Fall through
+			children.insert(formula->getvar());
+			break;
+		case KFormula::BOX:
+			// Continue getting children from past the box.
+			computeChildrenBoxS4(&(formula->getleft()), children);
+			break;
+		case KFormula::NOT:
+			// Continue getting children from past the negation.
+			// (going to be either a box or a prop, by BoxNNF, or anything
+			// in BoxNF)
+			computeChildren(&(formula->getleft()), children);
+			break;
+		case KFormula::AND:
+			// Left to right get from every operand.
+			for (size_t i = 0; i < formula->arity(); ++i) {
+				computeChildrenBoxS4(&(formula->getarg(i)), children);
+			}
+			break;
+		case KFormula::OR:// Fall through
 		case KFormula::IMP:
-			assert(false && "Children getting not defined for =>.");
 		case KFormula::EQU:
-			assert(false && "Children getting not defined for <=>.");
+			// Left to right get from every operand.
+			for (size_t i = 0; i < formula->arity(); ++i) {
+				computeChildren(&(formula->getarg(i)), children);
+			}
+			break;
+		case KFormula::TRUE:
+			break;
+		case KFormula::FALSE:
+			break;
+		case KFormula::DIA:
+			assert(false && "Children getting not defined for <>.");
 		default:
 			assert(false && "Defaulted out of complete switch");
 	}
 }
 
 /*
- *	Traverse the given formula to find all the atomic propositions and 
- *	box formulae that are immediate subformulae.
- *
- *	S4 version where intermediate boxes are ignored. Note recursion falls
- *	back to the normal version after a disjunction.
- *
- *	Assumes the given formula is in BoxNNF, and that BDD variable numbers
- *	have been written on to the given formula.
+ *	Sets up the reordering blocks (one per variable, or one per modal group
+ *	with -modalblocks) and enters the gamma phase. Does nothing unless
+ *	-reorder or -sift is given, or if a learned order was loaded instead.
+ */
+void startReordering() {
+	if ((!reorder && !siftThreshold) || orderLoaded) {
+		return;
+	}
+	if (varBlocks.empty()) {
+		bdd_varblockall();
+	} else {
+		for (size_t i = 0; i < varBlocks.size(); ++i) {
+			bdd_intaddvarblock(varBlocks[i].first, varBlocks[i].second, BDD_REORDER_FREE);
+		}
+	}
+	// Dynamic variable reordering. Super naive, but often effective.
+	if (reorder) {
+		bdd_autoreorder(BDD_REORDER_WIN2ITE);
+	}
+	nextSift = siftThreshold;
+	enterReorderPhase(REORDER_GAMMA);
+}
+
+/*
+ *	Initialises the bdd framework, with tables sized for the given formulae
+ *	(see below).
+ */
+void initBDDFramework(const std::vector<KFormula*>& roots) {
+	// Count the distinct subformulae, and the atoms among them.
+	std::vector<bool> visited(KFormula::arena().size());
+	std::vector<const KFormula*> stack(roots.begin(), roots.end());
+	size_t dagNodes = 0;
+	size_t atoms = 0;
+	while (!stack.empty()) {
+		const KFormula* formula = stack.back();
+		stack.pop_back();
+		if (visited[formula->getid()]) {
+			continue;
+		}
+		visited[formula->getid()] = true;
+		++dagNodes;
+		if (formula->getop() == KFormula::AP || formula->getop() == KFormula::BOX) {
+			++atoms;
+		}
+		for (size_t i = 0; i < formula->arity(); ++i) {
+			stack.push_back(&formula->getarg(i));
+		}
+	}
+	initBDDFramework(dagNodes, atoms);
+}
+
+/*
+ *	Initialises the bdd framework for formulae with the given number of
+ *	distinct subformulae and atoms. The node table starts at a few nodes per
+ *	subformula and atom (and per role, for the unboxings), between the small
+ *	table tiny inputs need and a few million nodes; -bddnodes, -bddcache and
+ *	-maxincrease override the estimates.
+ */
+void initBDDFramework(size_t dagNodes, size_t atoms) {
+	const size_t estimate = 20 * dagNodes + 100 * atoms + 1000 * numRoles;
+	const int nodes = bddNodes ? bddNodes
+		: (int) std::min<size_t>(std::max<size_t>(estimate, 2000), 4000000);
+	bdd_init(nodes, bddCache ? bddCache : std::max(nodes / 8, 1000));
+	if (!bddCache) {
+		// Grow the cache with the node table. Setting the ratio resizes the
+		// cache at once, so a given -bddcache is left without one.
+		bdd_setcacheratio(8);
+	}
+	bdd_setmaxincrease(bddMaxIncrease ? bddMaxIncrease : 2500000);// 50 Mb
+	bdd_gbc_hook(onGarbageCollection);
+	bdd_resize_hook(onNodeTableResize);
+}
+
+/*
+ *	Garbage collection handler. BuDDy grows the node table after a collection
+ *	that frees too little; when collections come so often that they take a
+ *	good share of the time since the last one, the table is made to grow
+ *	earlier (more free nodes wanted) and by more (a larger maximum increase).
+ */
+void onGarbageCollection(int pre, bddGbcStat* stat) {
+	static clock_t lastEnd = 0;
+	if (pre) {
+		return;
+	}
+	++numGarbageCollections;
+	const clock_t now = clock();
+	if (numGarbageCollections > 1 && 10 * stat->time > now - lastEnd) {
+		const int minFree = bdd_setminfreenodes(20);
+		bdd_setminfreenodes(std::min(minFree + 10, 60));
+		if (!bddMaxIncrease) {
+			const int maxIncrease = bdd_setmaxincrease(0);
+			bdd_setmaxincrease(std::min(2 * maxIncrease, 40000000));
+		}
+		++numTableGrowths;
+	}
+	if (nodeBudget && stat->nodes - stat->freenodes > nodeBudget) {
+		memoryPressure = true;
+	}
+	lastEnd = clock();
+}
+
+/*
+ *	Node table resize handler, for the memory governor.
+ */
+void onNodeTableResize(int, int newSize) {
+	if (nodeBudget && newSize > nodeBudget) {
+		memoryPressure = true;
+	}
+}
+
+/*
+ *	When the entry for 'key' was last used, according to 'uses' (0 if never
+ *	stamped).
+ */
+template <typename Uses, typename Key>
+unsigned long lastUse(const Uses& uses, const Key& key) {
+	typename Uses::const_iterator it = uses.find(key);
+	return it == uses.end() ? 0 : it->second;
+}
+
+/*
+ *	Stamps the entry for 'key' as used now, if the memory governor is on.
+ */
+template <typename Uses, typename Key>
+void markUsed(Uses& uses, const Key& key) {
+	if (nodeBudget) {
+		uses[key] = cacheTick;
+	}
+}
+
+/*
+ *	Trims the caches when the memory governor has seen too many BDD nodes in
+ *	use, until the nodes of the evicted entries add up to the excess over
+ *	three quarters of the budget. Caches only speed the tableau up, so any
+ *	entry can go: the memoized subformula BDDs, cached results, unboxings and
+ *	undiamondings are all evicted together, least recently used first. The
+ *	nodes are reclaimed by the next garbage collection.
+ *
+ *	Only called at the start of a tableau call, when no cache is being
+ *	iterated over.
+ */
+void evictCaches() {
+	memoryPressure = false;
+	long excess = bdd_getnodenum() - 3 * (long) nodeBudget / 4;
+	if (excess <= 0) {
+		return;
+	}
+	
+	// Every entry of every cache, as (last use, (cache, index)).
+	enum { FORMULA, SAT, UNSAT, SATURATION_UNSAT, TEMP_SAT, UNBOXING, UNDIAMONDING };
+	std::vector<std::pair<unsigned long, std::pair<int, size_t>>> entries;
+	for (int kind = 0; kind < 3; ++kind) {
+		for (size_t id = 0; id < formulaBDDs[kind].size(); ++id) {
+			if (formulaBDDBuilt[kind][id]) {
+				entries.push_back(std::make_pair(formulaBDDUses[kind][id],
+					std::make_pair((int) FORMULA, 3 * id + kind)));
+			}
+		}
+	}
+	std::vector<bdd> satKeys;
+	for (std::unordered_set<bdd, BddHasher>::iterator it = satCache.begin(); it != satCache.end(); ++it) {
+		entries.push_back(std::make_pair(lastUse(satCacheUses, *it), std::make_pair((int) SAT, satKeys.size())));
+		satKeys.push_back(*it);
+	}
+	std::vector<std::vector<int>> unsatKeys;
+	for (std::map<std::vector<int>, bdd>::iterator it = unsatCache.begin(); it != unsatCache.end(); ++it) {
+		entries.push_back(std::make_pair(lastUse(unsatCacheUses, it->first),
+			std::make_pair((int) UNSAT, unsatKeys.size())));
+		unsatKeys.push_back(it->first);
+	}
+	std::vector<bdd> saturationKeys;
+	for (std::unordered_map<bdd, VarSet, BddHasher>::iterator it = saturationUnsatCache.begin();
+			it != saturationUnsatCache.end(); ++it) {
+		entries.push_back(std::make_pair(lastUse(saturationUnsatCacheUses, it->first),
+			std::make_pair((int) SATURATION_UNSAT, saturationKeys.size())));
+		saturationKeys.push_back(it->first);
+	}
+	std::vector<std::list<std::pair<std::unordered_set<bdd, BddHasher>, bdd>>::iterator> tempSats;
+	for (std::list<std::pair<std::unordered_set<bdd, BddHasher>, bdd>>::iterator it = tempSatCaches.begin();
+			it != tempSatCaches.end(); ++it) {
+		entries.push_back(std::make_pair(lastUse(tempSatCacheUses, it->second),
+			std::make_pair((int) TEMP_SAT, tempSats.size())));
+		tempSats.push_back(it);
+	}
+	for (int var = 1; var < numVars; ++var) {
+		if (unboxed.at(var)) {
+			entries.push_back(std::make_pair(unboxingUses.at(var), std::make_pair((int) UNBOXING, (size_t) var)));
+		}
+		if (undiamonded.at(var)) {
+			entries.push_back(std::make_pair(undiamondingUses.at(var),
+				std::make_pair((int) UNDIAMONDING, (size_t) var)));
+		}
+	}
+	std::sort(entries.begin(), entries.end());
+	
+	for (size_t i = 0; i < entries.size() && excess > 0; ++i) {
+		const size_t index = entries[i].second.second;
+		switch (entries[i].second.first) {
+			case FORMULA: {
+				const int kind = index % 3;
+				const size_t id = index / 3;
+				excess -= bdd_nodecount(formulaBDDs[kind][id]);
+				formulaBDDs[kind][id] = bdd();
+				formulaBDDBuilt[kind][id] = false;
+				break;
+			}
+			case SAT:
+				excess -= bdd_nodecount(satKeys[index]);
+				satCache.erase(satKeys[index]);
+				satCacheUses.erase(satKeys[index]);
+				break;
+			case UNSAT:
+				excess -= bdd_nodecount(unsatCache.at(unsatKeys[index]));
+				unsatCache.erase(unsatKeys[index]);
+				unsatCacheUses.erase(unsatKeys[index]);
+				break;
+			case SATURATION_UNSAT:
+				excess -= bdd_nodecount(saturationKeys[index]);
+				saturationUnsatCache.erase(saturationKeys[index]);
+				saturationUnsatCacheUses.erase(saturationKeys[index]);
+				break;
+			case TEMP_SAT:
+				excess -= bdd_nodecount(tempSats[index]->second);
+				tempSatCaches.erase(tempSats[index]);
+				break;
+			case UNBOXING:
+				excess -= bdd_nodecount(unboxings.at(index));
+				unboxings.at(index) = bdd();
+				unboxed.at(index) = false;
+				break;
+			case UNDIAMONDING:
+				excess -= bdd_nodecount(undiamondings.at(index));
+				undiamondings.at(index) = bdd();
+				undiamonded.at(index) = false;
+				break;
+		}
+		++numEvictions;
+	}
+	
+	// Drop the evicted results from the FIFO orders of their caches, and
+	// the stamps of temporary results that are gone (evicted, confirmed or
+	// rejected).
+	std::deque<bdd> keptSats;
+	for (size_t i = 0; i < satCacheDeque.size(); ++i) {
+		if (satCache.count(satCacheDeque[i]) != 0) {
+			keptSats.push_back(satCacheDeque[i]);
+		}
+	}
+	satCacheDeque.swap(keptSats);
+	std::deque<std::vector<int>> keptUnsats;
+	for (size_t i = 0; i < unsatCacheDeque.size(); ++i) {
+		if (unsatCache.count(unsatCacheDeque[i]) != 0) {
+			keptUnsats.push_back(unsatCacheDeque[i]);
+		}
+	}
+	unsatCacheDeque.swap(keptUnsats);
+	std::deque<bdd> keptSaturations;
+	for (size_t i = 0; i < saturationUnsatCacheDeque.size(); ++i) {
+		if (saturationUnsatCache.count(saturationUnsatCacheDeque[i]) != 0) {
+			keptSaturations.push_back(saturationUnsatCacheDeque[i]);
+		}
+	}
+	saturationUnsatCacheDeque.swap(keptSaturations);
+	std::unordered_map<bdd, unsigned long, BddHasher> keptTempSatUses;
+	for (std::list<std::pair<std::unordered_set<bdd, BddHasher>, bdd>>::iterator it = tempSatCaches.begin();
+			it != tempSatCaches.end(); ++it) {
+		keptTempSatUses[it->second] = lastUse(tempSatCacheUses, it->second);
+	}
+	tempSatCacheUses.swap(keptTempSatUses);
+	
+	if (excess > 0 && bddUnsatCache) {
+		unsatCacheBDD = bddtrue;
+		++numEvictions;
+	}
+}
+
+/*
+ *	Runs the memory governor, if it has seen too many BDD nodes in use.
+ */
+void maybeEvict() {
+	++cacheTick;
+	if (memoryPressure) {
+		evictCaches();
+	}
+}
+
+/*
+ *	Saves the current variable order to the -orderfile, if reordering was
+ *	done to find it.
+ */
+void saveLearnedOrder() {
+	if (!orderFile || orderLoaded || reorderPhase == NO_PHASE) {
+		return;
+	}
+	std::vector<int> order(numVars);
+	for (int level = 0; level < numVars; ++level) {
+		order[level] = bdd_level2var(level);
+	}
+	if (!saveVarOrder(orderFile, atomSetKey, order)) {
+		std::cerr << "WARNING: Could not write variable order file " << orderFile << "." << std::endl;
+	}
+}
+
+/*
+ *	Moves the run into the given phase, allowing or disallowing reordering
+ *	as chosen with -phases.
+ */
+void enterReorderPhase(ReorderPhase phase) {
+	if (reorderPhase == NO_PHASE && phase != REORDER_GAMMA) {
+		// Reordering was never started.
+		return;
+	}
+	reorderPhase = phase;
+	if (reorderPhases & phase) {
+		bdd_enable_reorder();
+	} else {
+		bdd_disable_reorder();
+	}
+}
+
+ReorderScope::ReorderScope(ReorderPhase phase)
+	:previous(reorderPhase)
+{
+	enterReorderPhase(phase);
+}
+
+ReorderScope::~ReorderScope() {
+	enterReorderPhase(previous);
+}
+
+/*
+ *	Sifts the variables if the node count has passed the -sift threshold,
+ *	and reordering is allowed in the current phase.
+ */
+void maybeSift() {
+	if (siftThreshold && (reorderPhases & reorderPhase) && bdd_getnodenum() > nextSift) {
+		bdd_reorder(BDD_REORDER_SIFT);
+		++numSifts;
+		nextSift = std::max(siftThreshold, 2 * bdd_getnodenum());
+	}
+}
+
+/*
+ *	Whether the translations of the formula are worth memoizing: those of
+ *	atoms and constants are a single BuDDy call.
+ */
+static inline bool isCompound(const KFormula* formula) {
+	return formula->arity() > 1
+		|| (formula->getop() == KFormula::NOT && formula->getleft().arity() > 1);
+}
+
+/*
+ *	Returns the given translation of the formula, building it only the
+ *	first time it is asked for. As formulae are hash-consed, every occurrence
+ *	of a subformula, under any box and in any formula, shares one entry.
+ */
+bdd memoizedBDD(FormulaBDDKind kind, const KFormula* formula,
+				bdd (*build)(const KFormula*)) {
+	const uint32_t id = formula->getid();
+	if (id >= formulaBDDBuilt[kind].size()) {
+		formulaBDDs[kind].resize(KFormula::arena().size());
+		formulaBDDBuilt[kind].resize(KFormula::arena().size());
+		formulaBDDUses[kind].resize(KFormula::arena().size());
+	}
+	if (formulaBDDBuilt[kind][id]) {
+		++formulaBDDCacheHits;
+		formulaBDDUses[kind][id] = cacheTick;
+		return formulaBDDs[kind][id];
+	}
+	// Building may recurse into (and grow) the memo tables.
+	bdd b = build(formula);
+	formulaBDDs[kind][id] = b;
+	formulaBDDBuilt[kind][id] = true;
+	formulaBDDUses[kind][id] = cacheTick;
+	++cachedFormulaBDDs;
+	return b;
+}
+
+bdd toBDD(const KFormula* formula) {
+	return isCompound(formula) ? memoizedBDD(PLAIN_BDD, formula, buildBDD) : buildBDD(formula);
+}
+
+bdd toBDDS4Unbox(const KFormula* formula) {
+	return isCompound(formula) ? memoizedBDD(S4_UNBOX_BDD, formula, buildBDDS4Unbox)
+		: buildBDDS4Unbox(formula);
+}
+
+bdd toNotBDD(const KFormula* formula) {
+	return isCompound(formula) ? memoizedBDD(NOT_BDD, formula, buildNotBDD) : buildNotBDD(formula);
+}
+
+// A partial conjunction of the operands of a formula, for -schedule.
+struct PartialConjunction {
+	bdd b;
+	int nodes;
+	std::vector<size_t> operands;// Indices of the operands conjoined into b.
+	bool operator<(const PartialConjunction& other) const {
+		// Reversed, so that priority queues pop the smallest.
+		return nodes > other.nodes;
+	}
+};
+
+/*
+ *	Number of variables in both of the given supports (BDDs of variable sets).
+ */
+static int sharedSupport(bdd first, bdd second) {
+	int shared = 0;
+	while (first != bddtrue && second != bddtrue) {
+		const int firstLevel = bdd_var2level(bdd_var(first));
+		const int secondLevel = bdd_var2level(bdd_var(second));
+		if (firstLevel == secondLevel) {
+			++shared;
+		}
+		if (firstLevel <= secondLevel) {
+			first = bdd_high(first);
+		}
+		if (secondLevel <= firstLevel) {
+			second = bdd_high(second);
+		}
+	}
+	return shared;
+}
+
+/*
+ *	Builds the BDD of a conjunction as chosen with -schedule: either in the
+ *	order of its operands (toBDD()), or from a priority queue of partial
+ *	conjunctions, always conjoining the smallest with the one it shares most
+ *	support with (among the few next smallest), or with the next smallest.
+ *	Keeping the partial BDDs small this way avoids intermediate blowups that
+ *	the final gamma doesn't have.
+ *
+ *	With -gammalimit, exits reporting the operands (axioms) involved when a
+ *	partial BDD grows past the limit.
+ */
+bdd conjunctionBDD(const KFormula* formula) {
+	if (conjunctionSchedule == IN_ORDER || formula->getop() != KFormula::AND) {
+		return toBDD(formula);
+	}
+	return memoizedBDD(PLAIN_BDD, formula, buildScheduledConjunction);
+}
+
+bdd buildScheduledConjunction(const KFormula* formula) {
+	// Number of next smallest partials considered for shared support.
+	static const size_t SUPPORT_CANDIDATES = 8;
+	std::priority_queue<PartialConjunction> partials;
+	for (size_t i = 0; i < formula->arity(); ++i) {
+		PartialConjunction p;
+		p.b = toBDD(&(formula->getarg(i)));
+		if (p.b == bddfalse) {
+			return bddfalse;
+		}
+		p.nodes = bdd_nodecount(p.b);
+		p.operands.push_back(i);
+		partials.push(p);
+	}
+	while (partials.size() > 1) {
+		PartialConjunction first = partials.top();
+		partials.pop();
+		PartialConjunction second = partials.top();
+		partials.pop();
+		if (conjunctionSchedule == SHARED_SUPPORT) {
+			// Swap second for the candidate sharing the most support with first.
+			std::vector<PartialConjunction> candidates(1, second);
+			while (candidates.size() < SUPPORT_CANDIDATES && !partials.empty()) {
+				candidates.push_back(partials.top());
+				partials.pop();
+			}
+			const bdd support = bdd_support(first.b);
+			size_t best = 0;
+			int bestShared = -1;
+			for (size_t c = 0; c < candidates.size(); ++c) {
+				const int shared = sharedSupport(support, bdd_support(candidates[c].b));
+				if (shared > bestShared) {
+					best = c;
+					bestShared = shared;
+				}
+			}
+			second = candidates[best];
+			for (size_t c = 0; c < candidates.size(); ++c) {
+				if (c != best) {
+					partials.push(candidates[c]);
+				}
+			}
+		}
+		PartialConjunction p;
+		p.b = first.b & second.b;
+		maybeSift();
+		if (p.b == bddfalse) {
+			return bddfalse;
+		}
+		p.nodes = bdd_nodecount(p.b);
+		p.operands.swap(first.operands);
+		p.operands.insert(p.operands.end(), second.operands.begin(), second.operands.end());
+		peakConjunctionNodes = std::max(peakConjunctionNodes, p.nodes);
+		if (conjunctionLimit && p.nodes > conjunctionLimit) {
+			std::sort(p.operands.begin(), p.operands.end());
+			std::cerr << "ERROR: Conjunction exceeded " << conjunctionLimit << " BDD nodes ("
+				<< p.nodes << ") conjoining these " << p.operands.size() << " axioms:" << std::endl;
+			for (size_t i = 0; i < p.operands.size(); ++i) {
+				std::cerr << "  " << formula->getarg(p.operands[i]) << std::endl;
+			}
+			exit(1);
+		}
+		partials.push(p);
+	}
+	return partials.top().b;
+}
+
+/*
+ *	Builds gamma for -partition: its axioms are conjoined in order into
+ *	clusters of at most partitionLimit nodes. A cluster goes into the core
+ *	(gammaBDD) unless some assignment to its propositions, consistent with
+ *	those chosen for the earlier clusters outside the core, satisfies it
+ *	whatever its modal variables are. The clusters outside the core are then
+ *	jointly satisfied by that one assignment without any modal formulae, so a
+ *	world that shares no variables with them can leave them out.
+ */
+void partitionGamma(const KFormula* gamma) {
+	std::vector<bdd> clusters;
+	bdd current = bddtrue;
+	const size_t operands = gamma->getop() == KFormula::AND ? gamma->arity() : 1;
+	for (size_t i = 0; i < operands; ++i) {
+		const bdd b = toBDD(gamma->getop() == KFormula::AND ? &(gamma->getarg(i)) : gamma);
+		const bdd joined = current & b;
+		if (current == bddtrue || joined == bddfalse || bdd_nodecount(joined) <= partitionLimit) {
+			current = joined;
+		} else {
+			clusters.push_back(current);
+			current = b;
+		}
+	}
+	clusters.push_back(current);
+	
+	bdd modalVars = bddtrue;
+	for (int var = 0; var < numVars; ++var) {
+		if (varInfo[var].kind != PROP_VAR) {
+			modalVars = modalVars & bdd_ithvar(var);
+		}
+	}
+	gammaBDD = bddtrue;
+	bdd assignment = bddtrue;// Of the propositions of the clusters outside the core.
+	varsToGammaClusters.assign(numVars, std::vector<int>());
+	for (size_t c = 0; c < clusters.size(); ++c) {
+		const bdd withoutModal = bdd_forall(bdd_restrict(clusters[c], assignment), modalVars);
+		if (withoutModal == bddfalse) {
+			gammaBDD = gammaBDD & clusters[c];
+			continue;
+		}
+		assignment = assignment & bdd_satone(withoutModal);
+		gammaClusterVars.push_back(std::vector<int>());
+		for (bdd support = bdd_support(clusters[c]); support != bddtrue; support = bdd_high(support)) {
+			gammaClusterVars.back().push_back(bdd_var(support));
+			varsToGammaClusters.at(bdd_var(support)).push_back(gammaClusters.size());
+		}
+		gammaClusters.push_back(clusters[c]);
+	}
+}
+
+/*
+ *	Conjoins into b every cluster of a partitioned gamma that shares a
+ *	variable with it, widening until no further cluster does. Returns b
+ *	as it is if gamma isn't partitioned.
  */
-void computeChildrenBoxS4(const KFormula* formula, std::unordered_set<int>& children) {
-	switch (formula->getop()) {
-		case KFormula::AP:// Fall through
-			children.insert(formula->getvar());
-			break;
-		case KFormula::BOX:
-			// Continue getting children from past the box.
-			computeChildrenBoxS4(&(formula->getleft()), children);
-			break;
-		case KFormula::NOT:
-			// Continue getting children from past the negation.
-			// (going to be either a box or a prop, by BoxNNF)
-			computeChildren(&(formula->getleft()), children);
-			break;
-		case KFormula::AND:// Fall through
-			// Left to right get from both sides.
-			computeChildrenBoxS4(&(formula->getleft()), children);
-			computeChildrenBoxS4(&(formula->getright()), children);
-			break;
-		case KFormula::OR:
-			// Left to right get from both sides.
-			computeChildren(&(formula->getleft()), children);
-			computeChildren(&(formula->getright()), children);
-			break;
-		case KFormula::TRUE:
-			break;
-		case KFormula::FALSE:
-			break;
-		case KFormula::DIA:
-			assert(false && "Children getting not defined for <>.");
-		case KFormula::IMP:
-			assert(false && "Children getting not defined for =>.");
-		case KFormula::EQU:
-			assert(false && "Children getting not defined for <=>.");
-		default:
-			assert(false && "Defaulted out of complete switch");
+bdd withGamma(bdd b) {
+	if (gammaClusters.empty()) {
+		return b;
+	}
+	std::vector<bool> reached(numVars, false);
+	std::vector<bool> included(gammaClusters.size(), false);
+	std::vector<int> pending;
+	for (bdd support = bdd_support(b); support != bddtrue; support = bdd_high(support)) {
+		reached.at(bdd_var(support)) = true;
+		pending.push_back(bdd_var(support));
+	}
+	while (!pending.empty() && b != bddfalse) {
+		const int var = pending.back();
+		pending.pop_back();
+		for (size_t i = 0; i < varsToGammaClusters.at(var).size(); ++i) {
+			const int c = varsToGammaClusters.at(var)[i];
+			if (included[c]) {
+				continue;
+			}
+			included[c] = true;
+			b = b & gammaClusters[c];
+			++gammaClustersConjoined;
+			for (size_t j = 0; j < gammaClusterVars[c].size(); ++j) {
+				if (!reached.at(gammaClusterVars[c][j])) {
+					reached.at(gammaClusterVars[c][j]) = true;
+					pending.push_back(gammaClusterVars[c][j]);
+				}
+			}
+		}
 	}
+	return b;
 }
 
 /*
@@ -898,7 +2820,7 @@ void computeChildrenBoxS4(const KFormula* formula, std::unordered_set<int>& chil
  *
  *	Assumes the given formula is in BoxNNF.
  */
-bdd toBDD(const KFormula* formula) {
+bdd buildBDD(const KFormula* formula) {
 	switch (formula->getop()) {
 		case KFormula::AP:// Fall through
 		case KFormula::BOX:
@@ -913,23 +2835,46 @@ bdd toBDD(const KFormula* formula) {
 					// Note the presence of a <>. Only for K, not needed for S4.
 				    return bdd_nithvar(formula->getleft().getvar()) & bdd_ithvar(existsDia);
 				}
-			} else {// AP
+			} else if (formula->getleft().getop() == KFormula::AP) {
 				return bdd_nithvar(formula->getleft().getvar());
+			} else {// Any other formula, in BoxNF.
+				return toNotBDD(&(formula->getleft()));
 			}
 		case KFormula::AND:
-			return ( toBDD(&(formula->getleft())) & toBDD(&(formula->getright())) );
+			{bdd b = bddtrue;
+			for (size_t i = 0; i < formula->arity() && b != bddfalse; ++i) {
+				b = b & toBDD(&(formula->getarg(i)));
+				maybeSift();
+			}
+			return b;}
 		case KFormula::OR:
-			return ( toBDD(&(formula->getleft())) | toBDD(&(formula->getright())) );
+			{bdd b = bddfalse;
+			for (size_t i = 0; i < formula->arity() && b != bddtrue; ++i) {
+				b = b | toBDD(&(formula->getarg(i)));
+				maybeSift();
+			}
+			return b;}
 		case KFormula::TRUE:
 			return bddtrue;
 		case KFormula::FALSE:
 			return bddfalse;
+		case KFormula::IMP:// BoxNF only.
+			if (S4 || numRoles > 1 || inverseRoles) {
+				return bdd_imp(toBDD(&(formula->getleft())), toBDD(&(formula->getright())));
+			} else {
+				// Negated boxes on the left need the existsDia variable.
+				return toNotBDD(&(formula->getleft())) | toBDD(&(formula->getright()));
+			}
+		case KFormula::EQU:// BoxNF only.
+			if (S4 || numRoles > 1 || inverseRoles) {
+				return bdd_biimp(toBDD(&(formula->getleft())), toBDD(&(formula->getright())));
+			} else {
+				// Negated boxes on either side need the existsDia variable.
+				return (toBDD(&(formula->getleft())) & toBDD(&(formula->getright())))
+					| (toNotBDD(&(formula->getleft())) & toNotBDD(&(formula->getright())));
+			}
 		case KFormula::DIA:
 			assert(false && "toBDD not defined for <>.");
-		case KFormula::IMP:
-			assert(false && "toBDD not defined for =>.");
-		case KFormula::EQU:
-			assert(false && "toBDD not defined for <=>.");
 		default:
 			assert(false && "Defaulted out of complete switch");
 	}
@@ -945,7 +2890,7 @@ bdd toBDD(const KFormula* formula) {
  *
  *	Assumes the given formula is in BoxNNF.
  */
-bdd toBDDS4Unbox(const KFormula* formula) {
+bdd buildBDDS4Unbox(const KFormula* formula) {
 	switch (formula->getop()) {
 		case KFormula::AP:
 			// Return the bdd to the related variable.
@@ -959,21 +2904,24 @@ bdd toBDDS4Unbox(const KFormula* formula) {
 			return /*bdd_ithvar(formula->getvar()) &*/ toBDDS4Unbox(&(formula->getleft()));
 		case KFormula::NOT:
 			// Due to BoxNNF, getleft() will either be a [] or prop.
-			return bdd_nithvar(formula->getleft().getvar());
+			// (In BoxNF it may be anything, which toBDD() handles.)
+			return toBDD(formula);
 		case KFormula::AND:
-			return ( toBDDS4Unbox(&(formula->getleft())) & toBDDS4Unbox(&(formula->getright())));
-		case KFormula::OR:
-			return ( toBDD(&(formula->getleft())) | toBDD(&(formula->getright())) );
+			{bdd b = bddtrue;
+			for (size_t i = 0; i < formula->arity() && b != bddfalse; ++i) {
+				b = b & toBDDS4Unbox(&(formula->getarg(i)));
+			}
+			return b;}
+		case KFormula::OR:// Fall through
+		case KFormula::IMP:
+		case KFormula::EQU:
+			return toBDD(formula);
 		case KFormula::TRUE:
 			return bddtrue;
 		case KFormula::FALSE:
 			return bddfalse;
 		case KFormula::DIA:
 			assert(false && "toBDDS4Unbox not defined for <>.");
-		case KFormula::IMP:
-			assert(false && "toBDDS4Unbox not defined for =>.");
-		case KFormula::EQU:
-			assert(false && "toBDDS4Unbox not defined for <=>.");
 		default:
 			assert(false && "Defaulted out of complete switch");
 	}
@@ -990,7 +2938,7 @@ bdd toBDDS4Unbox(const KFormula* formula) {
  *
  *	Assumes formula is in BoxNNF
  */
-bdd toNotBDD(const KFormula* formula) {
+bdd buildNotBDD(const KFormula* formula) {
 	switch (formula->getop()) {
 		case KFormula::AP:
 			// Return the bdd to the negation of the related variable.
@@ -1005,21 +2953,36 @@ bdd toNotBDD(const KFormula* formula) {
 			}
 		case KFormula::NOT:
 			// Due to BoxNNF, getleft() will either be a [] or prop.
-			return bdd_ithvar(formula->getleft().getvar());
+			// (In BoxNF it may be anything.)
+			return toBDD(&(formula->getleft()));
 		case KFormula::AND:// Not 'and's become 'or's.
-			return ( toNotBDD(&(formula->getleft())) | toNotBDD(&(formula->getright())) );
+			{bdd b = bddfalse;
+			for (size_t i = 0; i < formula->arity() && b != bddtrue; ++i) {
+				b = b | toNotBDD(&(formula->getarg(i)));
+			}
+			return b;}
 		case KFormula::OR:// Not 'or's become 'and's.
-			return ( toNotBDD(&(formula->getleft())) & toNotBDD(&(formula->getright())) );
+			{bdd b = bddtrue;
+			for (size_t i = 0; i < formula->arity() && b != bddfalse; ++i) {
+				b = b & toNotBDD(&(formula->getarg(i)));
+			}
+			return b;}
 		case KFormula::TRUE:
 			return bddfalse;
 		case KFormula::FALSE:
 			return bddtrue;
+		case KFormula::IMP:// BoxNF only. ~(phi => psi) = phi & ~psi
+			return toBDD(&(formula->getleft())) & toNotBDD(&(formula->getright()));
+		case KFormula::EQU:// BoxNF only.
+			if (S4 || numRoles > 1 || inverseRoles) {
+				return bdd_xor(toBDD(&(formula->getleft())), toBDD(&(formula->getright())));
+			} else {
+				// Negated boxes on either side need the existsDia variable.
+				return (toBDD(&(formula->getleft())) & toNotBDD(&(formula->getright())))
+					| (toNotBDD(&(formula->getleft())) & toBDD(&(formula->getright())));
+			}
 		case KFormula::DIA:
 			assert(false && "toNotBDD not defined for <>.");
-		case KFormula::IMP:
-			assert(false && "toNotBDD not defined for =>.");
-		case KFormula::EQU:
-			assert(false && "toNotBDD not defined for <=>.");
 		default:
 			assert(false && "Defaulted out of complete switch");
 	}
@@ -1028,18 +2991,19 @@ bdd toNotBDD(const KFormula* formula) {
  * Wrapper for the recursive isSatsfiableK function. 
  */
 bool isSatisfiable(bdd formulaBDD) {
+	formulaBDD = withGamma(formulaBDD);
 	if (S4) {
-		std::unordered_set<int> responsibleVars;
+		VarSet responsibleVars;
 		std::unordered_set<bdd, BddHasher> assumedSatBDDs;
 		bdd permanentFactsBDD = bddtrue;
-		std::unordered_set<int> permanentBoxVars;
+		VarSet permanentBoxVars;
 		return isSatisfiableS4(formulaBDD, responsibleVars, assumedSatBDDs,
 													permanentFactsBDD, permanentBoxVars);
 	} else if (inverseRoles) {
 		// Not implemented
 		return false;
 	} else {
-		std::unordered_set<int> responsibleVars;
+		VarSet responsibleVars;
 		std::unordered_set<bdd, BddHasher> assumedSatBDDs;
 		totalModalJumpsExplored++;
 		return isSatisfiableK(formulaBDD, responsibleVars, assumedSatBDDs);
@@ -1056,80 +3020,186 @@ bool isSatisfiable(bdd formulaBDD) {
  *
  *	If the BDD is Satisfiable, 'assumedSatBDDs' will contain, in BDD form,
  *	all the worlds that were assumed true to reach this result (due to cycles).
+ *
+ *	The search runs on an explicit stack of heap allocated frames, one per
+ *	world being examined (see KFrame), rather than recursing for every modal
+ *	jump and refinement, so deep tableaux are bounded by memory and not by
+ *	the size of the call stack. The frames are kept between searches and
+ *	reused (see FrameStack), so the search doesn't allocate once its frames
+ *	have grown to fit.
  */
-bool isSatisfiableK(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
+bool isSatisfiableK(bdd formulaBDD, VarSet& responsibleVars,
 std::unordered_set<bdd, BddHasher>& assumedSatBDDs) {
-	
-	// Statistics:
-	++depth;
-	if (depth > maxDepth) {
-		maxDepth = depth;
-	}
-	
-	// Sat results caching.
-	if (satCache.count(formulaBDD) == 1) {
-		// Then we have already proven this is Satisfiable.
-		++satCacheHits;
-		--depth;
-		++totalSatisfiableModalJumps;
-		return true;
-	}
-	
-	if (useSaturationUnsatCache && saturationUnsatCache.count(formulaBDD) == 1) {
-		++unsatCacheHits;
-		--depth;
-		responsibleVars.insert(saturationUnsatCache.at(formulaBDD).begin(),
-													saturationUnsatCache.at(formulaBDD).end());
-		// Because resVars already includes vars from previous refinements.
-		return false;
-	}
-    
-    // Base cases:
-    if (formulaBDD == bddtrue) {
-    	--depth;
-		++totalSatisfiableModalJumps;
-    	return true;
-    }
-    if (formulaBDD == bddfalse) {
-    	--depth;
-    	return false;
-    }
-	
-	// Get one satisfying valuation out of the formulaBDD:
-	bdd satisfyingValuation;
-	if (rightToLeft) {
-		satisfyingValuation = rightValuation(formulaBDD);
-	} else {
-		satisfyingValuation = bdd_satone(formulaBDD);//leftValuation(formulaBDD);
+	kFrames.push().start(formulaBDD, responsibleVars, assumedSatBDDs);
+	bool result = false;
+	while (!kFrames.empty()) {
+		if (resumeK(kFrames.top(), kFrames, result)) {
+			kFrames.pop();
+		}
 	}
-    // Make sets of the modal formulae in the satisfying valuation.
-    std::vector<int> boxVars;
-    std::vector<int> diaVars;
-    extractSatisfyingModalVars(satisfyingValuation, boxVars, diaVars);
-	
-	if (diaVars.empty()) {
-		// We're at an open, fully saturated tableau branch with no <> formulae.
-		--depth;
-		++totalSatisfiableModalJumps;
-		return true;
-	} else {
-		// There are <> formulae, so we must examine those modal jumps.
-		
-		// Record the current bdd for loop checking.
-		dependentBDDs.insert(formulaBDD);
-		
-		// Consider each role in turn.
-		for (int role = 1; role <= numRoles; ++role) {
-		
-			// Build unboxedBDD by unboxing the box formulae.
-			bdd unboxedBDD = unsatCacheBDD & gammaBDD;// Note gamma is included here.
-			for (std::vector<int>::iterator boxIt = boxVars.begin();
-					boxIt != boxVars.end(); ++boxIt) {
-				
-				if (varsToAtoms.at(*boxIt)->getrole() != role) {
-					continue;// Only looking at a particular role.
+	return result;
+}
+
+/*
+ *	Orders variables by role, for grouping them.
+ */
+bool hasLowerRole(int var, int other) {
+	return varInfo[var].role < varInfo[other].role;
+}
+
+void KFrame::start(const bdd& _formulaBDD, VarSet& _responsibleVars,
+		std::unordered_set<bdd, BddHasher>& _assumedSatBDDs) {
+	state = START;
+	formulaBDD = _formulaBDD;
+	responsibleVars = &_responsibleVars;
+	assumedSatBDDs = &_assumedSatBDDs;
+	boxVars.clear();
+	diaVars.clear();
+	role = 0;
+	boxBegin = boxEnd = 0;
+	dia = diaEnd = 0;
+	postRefinementResVars.clear();
+	isSat = false;
+}
+
+/*
+ *	Drops the frame's BDDs, so that a spare frame doesn't keep their nodes
+ *	alive. Its containers keep their storage for the next world.
+ */
+void KFrame::release() {
+	formulaBDD = bdd();
+	unboxedBDD = bdd();
+	modalJumpBDD = bdd();
+	unsatBDD = bdd();
+}
+
+/*
+ *	Runs a frame of the K tableau until it either needs the result of
+ *	another world, which it pushes onto the stack (returning false, to be
+ *	resumed with that world's result in 'result'), or has its own result,
+ *	which it leaves in 'result' (returning true).
+ */
+bool resumeK(KFrame& frame, FrameStack<KFrame>& stack, bool& result) {
+	VarSet& responsibleVars = *frame.responsibleVars;
+	std::unordered_set<bdd, BddHasher>& assumedSatBDDs = *frame.assumedSatBDDs;
+	bdd& formulaBDD = frame.formulaBDD;
+	std::vector<int>& boxVars = frame.boxVars;
+	std::vector<int>& diaVars = frame.diaVars;
+	while (true) {
+		switch (frame.state) {
+		case KFrame::START: {
+			maybeSift();
+			maybeEvict();
+			// Statistics:
+			++depth;
+			if (depth > maxDepth) {
+				maxDepth = depth;
+			}
+			
+			// Sat results caching.
+			if (satCache.count(formulaBDD) == 1) {
+				// Then we have already proven this is Satisfiable.
+				++satCacheHits;
+				markUsed(satCacheUses, formulaBDD);
+				--depth;
+				++totalSatisfiableModalJumps;
+				result = true;
+				return true;
+			}
+			
+			if (useSaturationUnsatCache && saturationUnsatCache.count(formulaBDD) == 1) {
+				++unsatCacheHits;
+				markUsed(saturationUnsatCacheUses, formulaBDD);
+				--depth;
+				responsibleVars.insert(saturationUnsatCache.at(formulaBDD));
+				// Because resVars already includes vars from previous refinements.
+				result = false;
+				return true;
+			}
+			
+			// Base cases:
+			if (formulaBDD == bddtrue) {
+				--depth;
+				++totalSatisfiableModalJumps;
+				result = true;
+				return true;
+			}
+			if (formulaBDD == bddfalse) {
+				--depth;
+				result = false;
+				return true;
+			}
+			
+			// Get one satisfying valuation out of the formulaBDD:
+			bdd satisfyingValuation;
+			if (rightToLeft) {
+				satisfyingValuation = rightValuation(formulaBDD);
+			} else {
+				satisfyingValuation = bdd_satone(formulaBDD);//leftValuation(formulaBDD);
+			}
+			// Make sets of the modal formulae in the satisfying valuation,
+			// grouped by role.
+			extractSatisfyingModalVars(satisfyingValuation, boxVars, diaVars);
+			if (numRoles > 1) {
+				std::stable_sort(boxVars.begin(), boxVars.end(), hasLowerRole);
+				std::stable_sort(diaVars.begin(), diaVars.end(), hasLowerRole);
+			}
+			
+			if (diaVars.empty()) {
+				// We're at an open, fully saturated tableau branch with no <> formulae.
+				--depth;
+				++totalSatisfiableModalJumps;
+				result = true;
+				return true;
+			}
+			// There are <> formulae, so we must examine those modal jumps.
+			
+			// Record the current bdd for loop checking.
+			dependentBDDs.insert(rawHandle(formulaBDD));
+			
+			// Consider each role in turn.
+			frame.role = 1;
+			frame.state = KFrame::NEXT_ROLE;
+			break;
+		}
+		case KFrame::NEXT_ROLE: {
+			const int role = frame.role;
+			if (role > numRoles) {
+				// All modal jumps were satisfiable:
+				// If currently assumed Sat, this bdd now has a value and need not be assumed.
+				if (assumedSatBDDs.count(formulaBDD) == 1) {
+					assumedSatBDDs.erase(formulaBDD);
 				}
-		
+				// Discharge any Sat assumptions of this bdd.
+				if (everAssumedSatBDDs.count(formulaBDD) == 1) {
+					confirmSatAssumption(formulaBDD);
+				}
+				cacheSat(formulaBDD, assumedSatBDDs);
+				dependentBDDs.erase(rawHandle(formulaBDD));
+				--depth;
+				++totalSatisfiableModalJumps;
+				result = true;
+				return true;
+			}
+			
+			// Only looking at a particular role, whose box and diamond
+			// variables follow those of the previous one.
+			frame.boxBegin = frame.boxEnd;
+			while (frame.boxEnd < boxVars.size() && varInfo[boxVars[frame.boxEnd]].role == role) {
+				++frame.boxEnd;
+			}
+			frame.dia = frame.diaEnd;
+			while (frame.diaEnd < diaVars.size() && varInfo[diaVars[frame.diaEnd]].role == role) {
+				++frame.diaEnd;
+			}
+			const std::vector<int>::iterator roleBoxBegin = boxVars.begin() + frame.boxBegin;
+			const std::vector<int>::iterator roleBoxEnd = boxVars.begin() + frame.boxEnd;
+			
+			// Build unboxedBDD by unboxing the box formulae.
+			bdd& unboxedBDD = frame.unboxedBDD;
+			unboxedBDD = unsatCacheBDD & gammaBDD;// Note gamma is included here.
+			frame.state = KFrame::NEXT_JUMP;
+			for (std::vector<int>::iterator boxIt = roleBoxBegin; boxIt != roleBoxEnd; ++boxIt) {
 				unboxedBDD = unboxedBDD & unbox(*boxIt);
 			
 				// If at any time the unboxedBDD becomes false, we can skip straight
@@ -1159,10 +3229,7 @@ std::unordered_set<bdd, BddHasher>& assumedSatBDDs) {
 							// We're done, the last one added was sufficient to ensure false.
 							break;
 						}
-						for (boxIt = boxVars.begin(); boxIt != endIt; ++boxIt) {
-							if (varsToAtoms.at(*boxIt)->getrole() != role) {
-								continue;// Only looking at a particular role.
-							}
+						for (boxIt = roleBoxBegin; boxIt != endIt; ++boxIt) {
 							unboxedBDD = unboxedBDD & unbox(*boxIt);
 							if (unboxedBDD == bddfalse) {
 								// Then this last one made it false.
@@ -1176,76 +3243,123 @@ std::unordered_set<bdd, BddHasher>& assumedSatBDDs) {
 							}
 						}
 					}
-					unsatBDD = bdd_not(unsatBDD);
-				
-					return refineAndRecurse(unsatBDD, formulaBDD, responsibleVars, assumedSatBDDs);
+					frame.unsatBDD = bdd_not(unsatBDD);
+					frame.state = KFrame::REFINE;
+					break;
 				}
 			}
-		
+			break;
+		}
+		case KFrame::NEXT_JUMP: {
 			// Modal jump for each dia formula.
-			for (std::vector<int>::iterator
-					diaIt = diaVars.begin(); diaIt != diaVars.end(); ++diaIt) {
-				if (varsToAtoms.at(*diaIt)->getrole() != role) {
-					continue;// Only looking at a particular role.
-				}
+			if (frame.dia == frame.diaEnd) {
+				++frame.role;
+				frame.state = KFrame::NEXT_ROLE;
+				break;
+			}
+			const int diaVar = diaVars[frame.dia];
+			const std::vector<int>::iterator roleBoxBegin = boxVars.begin() + frame.boxBegin;
+			const std::vector<int>::iterator roleBoxEnd = boxVars.begin() + frame.boxEnd;
+			// Statistics:
+			++totalModalJumpsExplored;
+			if (periodicSummary && totalModalJumpsExplored % period == 0) {
+				printSummaryStatistics();
+			}
+		
+			// Modal jumps use toNotBDD, as every <>phi is stored as []~phi.
+			bdd& modalJumpBDD = frame.modalJumpBDD;
+			modalJumpBDD = withGamma(frame.unboxedBDD & undiamond(diaVar));
+		
+			// Check if the jump is immediately Unsatisfiable.
+			if (modalJumpBDD == bddfalse) {
 				// Statistics:
-				++totalModalJumpsExplored;
-				if (periodicSummary && totalModalJumpsExplored % period == 0) {
-					printSummaryStatistics();
-				}
+				++numFalseFromDia;
+				numResVarsIgnoredFromDia += boxVars.size();
 			
+				// Then <> and some subset of []s leads to false. (and gamma).
+				// Record responsible vars as only those in the subset.
 				// Modal jumps use toNotBDD, as every <>phi is stored as []~phi.
-				bdd modalJumpBDD = unboxedBDD & undiamond(*diaIt);
+				modalJumpBDD = withGamma(gammaBDD & undiamond(diaVar));
+				responsibleVars.insert(diaVar);
+				// Again, <>phi are stored as []~phi, thus the nith.
+				bdd unsatBDD = bdd_nithvar(diaVar) & bdd_ithvar(existsDia);
 			
-				// Check if the jump is immediately Unsatisfiable.
-				if (modalJumpBDD == bddfalse) {
-					// Statistics:
-					++numFalseFromDia;
-					numResVarsIgnoredFromDia += boxVars.size();
-				
-					// Then <> and some subset of []s leads to false. (and gamma).
-					// Record responsible vars as only those in the subset.
-					// Modal jumps use toNotBDD, as every <>phi is stored as []~phi.
-					modalJumpBDD = gammaBDD & undiamond(*diaIt);
-					responsibleVars.insert(*diaIt);
-					// Again, <>phi are stored as []~phi, thus the nith.
-					bdd unsatBDD = bdd_nithvar(*diaIt) & bdd_ithvar(existsDia);
-				
-					// Determine a minimal unsatisfiable subset.
-					std::vector<int>::iterator endIt = boxVars.end();
-					bdd minimalBDD = modalJumpBDD;
-					while (true) {
-						modalJumpBDD = minimalBDD;
-						if (modalJumpBDD == bddfalse) {
-							// We're done, the last one added was sufficient to ensure false.
-							break;
-						} else {
-							for (std::vector<int>::iterator boxIt = boxVars.begin(); boxIt != endIt; ++boxIt) {
-								if (varsToAtoms.at(*boxIt)->getrole() != role) {
-									continue;// Only looking at a particular role.
-								}
-								modalJumpBDD = modalJumpBDD & unbox(*boxIt);
-								if (modalJumpBDD == bddfalse) {
-									// The last [] introduced the false. Add it to the minimal set, and start again.
-									minimalBDD = minimalBDD & unbox(*boxIt);
-									unsatBDD = unsatBDD & bdd_ithvar(*boxIt);
-									responsibleVars.insert(*boxIt);
-									endIt = boxIt;// No need to go beyond this one again.
-									// Statistics:
-									--numResVarsIgnoredFromDia;
-									break;
-								}
+				// Determine a minimal unsatisfiable subset.
+				std::vector<int>::iterator endIt = roleBoxEnd;
+				bdd minimalBDD = modalJumpBDD;
+				while (true) {
+					modalJumpBDD = minimalBDD;
+					if (modalJumpBDD == bddfalse) {
+						// We're done, the last one added was sufficient to ensure false.
+						break;
+					} else {
+						for (std::vector<int>::iterator boxIt = roleBoxBegin; boxIt != endIt; ++boxIt) {
+							modalJumpBDD = withGamma(modalJumpBDD & unbox(*boxIt));
+							if (modalJumpBDD == bddfalse) {
+								// The last [] introduced the false. Add it to the minimal set, and start again.
+								minimalBDD = withGamma(minimalBDD & unbox(*boxIt));
+								unsatBDD = unsatBDD & bdd_ithvar(*boxIt);
+								responsibleVars.insert(*boxIt);
+								endIt = boxIt;// No need to go beyond this one again.
+								// Statistics:
+								--numResVarsIgnoredFromDia;
+								break;
 							}
 						}
 					}
-				
-					unsatBDD = bdd_not(unsatBDD);
-				
-					return refineAndRecurse(unsatBDD, formulaBDD, responsibleVars, assumedSatBDDs);
 				}
 			
-				// Check for loops:
-				if (dependentBDDs.count(modalJumpBDD) == 1) {
+				frame.unsatBDD = bdd_not(unsatBDD);
+				frame.state = KFrame::REFINE;
+				break;
+			}
+		
+			// Check for loops:
+			if (dependentBDDs.count(rawHandle(modalJumpBDD)) == 1) {
+				// Then we have a cyclic dependency.
+				// Assume that the cycle bdd is satisfiable and continue.
+				// Prevent any Sat caching that relies on this assumption.
+				assumedSatBDDs.insert(modalJumpBDD);
+				everAssumedSatBDDs.insert(modalJumpBDD);
+				// Statistics:
+				++loopsDetected;
+				++frame.dia;
+				break;// To the next modal jump.
+			}
+		
+			// Make space for getting the responsible vars and assumedSatBDDs.
+			frame.postModalJumpResVars.clear();
+			frame.postModalJumpAssumedSatBDDs.clear();
+		
+			// See if we can apply any element of the unsat cache to this new
+			// modal jump.
+			VarSet& cacheResVars = frame.cacheResVars;
+			cacheResVars.clear();
+			if (useUnsatCache && !bddUnsatCache && !useSaturationUnsatCache) {// If using this style of cache.
+				// If the unsat cache is empty, don't bother.
+				if (!unsatCache.empty()) {
+		
+					VarSet& modalJumpModalVars = frame.modalJumpModalVars;
+					getModalVars(modalJumpBDD, modalJumpModalVars);
+			
+					for (std::map<std::vector<int>, bdd>::iterator unsatIt = unsatCache.begin();
+							unsatIt != unsatCache.end(); ++unsatIt) {
+					
+						if (isSubset(unsatIt->first, modalJumpModalVars)) {
+							modalJumpBDD = modalJumpBDD & unsatIt->second;
+							markUsed(unsatCacheUses, unsatIt->first);
+							cacheResVars.insert(unsatIt->first.begin(), unsatIt->first.end());
+							// Statistics:
+							++unsatCacheHits;
+							if (modalJumpBDD == bddfalse) {
+								break;
+							}
+						}
+					}
+				}
+		
+				// Check for loops again after unsat cache:
+				if (dependentBDDs.count(rawHandle(modalJumpBDD)) == 1) {
 					// Then we have a cyclic dependency.
 					// Assume that the cycle bdd is satisfiable and continue.
 					// Prevent any Sat caching that relies on this assumption.
@@ -1253,198 +3367,156 @@ std::unordered_set<bdd, BddHasher>& assumedSatBDDs) {
 					everAssumedSatBDDs.insert(modalJumpBDD);
 					// Statistics:
 					++loopsDetected;
-					continue;// To the next modal jump.
+					++frame.dia;
+					break;// To the next modal jump.
 				}
+			}
+		
+			// Check Satisfiability of the modal jump:
+			frame.state = KFrame::AFTER_JUMP;
+			stack.push().start(modalJumpBDD, frame.postModalJumpResVars,
+					frame.postModalJumpAssumedSatBDDs);
+			return false;
+		}
+		case KFrame::AFTER_JUMP: {
+			const int diaVar = diaVars[frame.dia];
+			VarSet& postModalJumpResVars = frame.postModalJumpResVars;
+			if (!result) {
+				// Unsatisfiable:
+				// Then we want to modify the bdd to remove this branch,
+				// and recurse with that.
+				// Only refine over the []/<> variables that introduced a ResponsibleVariable 
+				// from the modal jump. But if a variable introduces one of those, we'll have
+				// to consider the other variables it introduces as potentially responsible as well.
 			
-				// Make space for getting the responsible vars and assumedSatBDDs.
-				std::unordered_set<int> postModalJumpResVars;
-				std::unordered_set<bdd, BddHasher> postModalJumpAssumedSatBDDs;
-			
-				// See if we can apply any element of the unsat cache to this new
-				// modal jump.
-				std::unordered_set<int> cacheResVars;
-				if (useUnsatCache && !bddUnsatCache && !useSaturationUnsatCache) {// If using this style of cache.
-					// If the unsat cache is empty, don't bother.
-					if (!unsatCache.empty()) {
-			
-						std::unordered_set<int> modalJumpModalVars = getModalVars(modalJumpBDD);
-				
-						for (std::map<std::vector<int>, bdd>::iterator unsatIt = unsatCache.begin();
-								unsatIt != unsatCache.end(); ++unsatIt) {
-						
-							if (isSubset(unsatIt->first, modalJumpModalVars)) {
-								modalJumpBDD = modalJumpBDD & unsatIt->second;
-								cacheResVars.insert(unsatIt->first.begin(), unsatIt->first.end());
-								// Statistics:
-								++unsatCacheHits;
-								if (modalJumpBDD == bddfalse) {
-									break;
-								}
-							}
-						}
-					}
-			
-					// Check for loops again after unsat cache:
-					if (dependentBDDs.count(modalJumpBDD) == 1) {
-						// Then we have a cyclic dependency.
-						// Assume that the cycle bdd is satisfiable and continue.
-						// Prevent any Sat caching that relies on this assumption.
-						assumedSatBDDs.insert(modalJumpBDD);
-						everAssumedSatBDDs.insert(modalJumpBDD);
-						// Statistics:
-						++loopsDetected;
-						continue;// To the next modal jump.
-					}
-				}
+				// Add in resVars from the unsatCache process
+				postModalJumpResVars.insert(frame.cacheResVars);
 			
-				// Check Satisfiability of the modal jump:
-				if (!isSatisfiableK(modalJumpBDD, postModalJumpResVars, postModalJumpAssumedSatBDDs)) {
-					// Unsatisfiable:
-					// Then we want to modify the bdd to remove this branch,
-					// and recurse with that.
-					// Only refine over the []/<> variables that introduced a ResponsibleVariable 
-					// from the modal jump. But if a variable introduces one of those, we'll have
-					// to consider the other variables it introduces as potentially responsible as well.
-				
-					// Add in resVars from the unsatCache process
-					postModalJumpResVars.insert(cacheResVars.begin(), cacheResVars.end());
-				
-					// Statistics:
-					numResVarsIgnoredFromGeneral += boxVars.size() + 1;
-					
-					// If using this style of unsat cache
-					if (useSaturationUnsatCache) {
-						cacheUnsat(postModalJumpResVars, modalJumpBDD);
-					}
-					
-					bdd unsatBDD = bdd_ithvar(existsDia);
-					bool newPostModalJumpResVarsAdded = true;
-					while (newPostModalJumpResVarsAdded) {
-						newPostModalJumpResVarsAdded = false;
-						for (std::vector<int>::iterator boxIt = boxVars.begin(); boxIt != boxVars.end(); ++boxIt) {
-							if (varsToAtoms.at(*boxIt)->getrole() != role) {
-								continue;// Only looking at a particular role.
-							}
-							if (responsibleVars.count(*boxIt) != 0) {
-								// Don't bother, we've already accounted for this box var.
-							} else if (shareAnElement(postModalJumpResVars, getChildren(*boxIt))) {
-								unsatBDD = unsatBDD & bdd_ithvar(*boxIt);
-								responsibleVars.insert(*boxIt);
-								// Add in other children to postModalJumpResVars
-								postModalJumpResVars.insert(getChildren(*boxIt).begin(),
-															getChildren(*boxIt).end());
-								newPostModalJumpResVarsAdded = true;
-								// Statistics:
-								--numResVarsIgnoredFromGeneral;
-							}
-						}
-						if (responsibleVars.count(*diaIt) != 0) {
-							// Don't bother, we've already accounted for this dia var.
-						} else if (shareAnElement(postModalJumpResVars, getChildren(*diaIt))) {
-							unsatBDD = unsatBDD & bdd_nithvar(*diaIt);// Note, stored as [] formula, thus the nith.
-							responsibleVars.insert(*diaIt);
+				// Statistics:
+				numResVarsIgnoredFromGeneral += boxVars.size() + 1;
+				
+				// If using this style of unsat cache
+				if (useSaturationUnsatCache) {
+					cacheUnsat(postModalJumpResVars, frame.modalJumpBDD);
+				}
+				
+				bdd unsatBDD = bdd_ithvar(existsDia);
+				bool newPostModalJumpResVarsAdded = true;
+				while (newPostModalJumpResVarsAdded) {
+					newPostModalJumpResVarsAdded = false;
+					for (std::vector<int>::iterator boxIt = boxVars.begin() + frame.boxBegin;
+							boxIt != boxVars.begin() + frame.boxEnd; ++boxIt) {
+						if (responsibleVars.contains(*boxIt)) {
+							// Don't bother, we've already accounted for this box var.
+						} else if (shareAnElement(postModalJumpResVars, getChildren(*boxIt))) {
+							unsatBDD = unsatBDD & bdd_ithvar(*boxIt);
+							responsibleVars.insert(*boxIt);
 							// Add in other children to postModalJumpResVars
-							postModalJumpResVars.insert(getChildren(*diaIt).begin(),
-														getChildren(*diaIt).end());
+							postModalJumpResVars.insert(getChildren(*boxIt).begin(),
+														getChildren(*boxIt).end());
 							newPostModalJumpResVarsAdded = true;
 							// Statistics:
 							--numResVarsIgnoredFromGeneral;
 						}
 					}
-					unsatBDD = bdd_not(unsatBDD);
-				
-					return refineAndRecurse(unsatBDD, formulaBDD, responsibleVars, assumedSatBDDs);
+					if (responsibleVars.contains(diaVar)) {
+						// Don't bother, we've already accounted for this dia var.
+					} else if (shareAnElement(postModalJumpResVars, getChildren(diaVar))) {
+						unsatBDD = unsatBDD & bdd_nithvar(diaVar);// Note, stored as [] formula, thus the nith.
+						responsibleVars.insert(diaVar);
+						// Add in other children to postModalJumpResVars
+						postModalJumpResVars.insert(getChildren(diaVar).begin(),
+													getChildren(diaVar).end());
+						newPostModalJumpResVarsAdded = true;
+						// Statistics:
+						--numResVarsIgnoredFromGeneral;
+					}
 				}
-			
-				// Modal jump was Satisfiable:
-				// Accumulate assumedSatBDDS, if there were any.
-				assumedSatBDDs.insert(postModalJumpAssumedSatBDDs.begin(), postModalJumpAssumedSatBDDs.end());
-			
-				// Continue to the next modal jump
+				frame.unsatBDD = bdd_not(unsatBDD);
+				frame.state = KFrame::REFINE;
+				break;
 			}
-		}
 		
-		// All modal jumps were satisfiable:
-		// If currently assumed Sat, this bdd now has a value and need not be assumed.
-		if (assumedSatBDDs.count(formulaBDD) == 1) {
-			assumedSatBDDs.erase(formulaBDD);
-		}
-		// Discharge any Sat assumptions of this bdd.
-		if (everAssumedSatBDDs.count(formulaBDD) == 1) {
-			confirmSatAssumption(formulaBDD);
+			// Modal jump was Satisfiable:
+			// Accumulate assumedSatBDDS, if there were any.
+			assumedSatBDDs.insert(frame.postModalJumpAssumedSatBDDs.begin(),
+					frame.postModalJumpAssumedSatBDDs.end());
+		
+			// Continue to the next modal jump
+			++frame.dia;
+			frame.state = KFrame::NEXT_JUMP;
+			break;
 		}
-		cacheSat(formulaBDD, assumedSatBDDs);
-		dependentBDDs.erase(formulaBDD);
-		--depth;
-		++totalSatisfiableModalJumps;
-		return true;
-	}
-	
-}
-
-bool refineAndRecurse(bdd& unsatBDD, bdd& formulaBDD, std::unordered_set<int>& responsibleVars,
-						std::unordered_set<bdd, BddHasher>& assumedSatBDDs) {
-	if (!useSaturationUnsatCache) {// Only if we're using this style of cache.
-		// Cache this unsatisfiable branch
-		cacheUnsat(responsibleVars, unsatBDD);
-	}
-	
-	// Perform the refinement:
-	bdd refinedBDD = formulaBDD & unsatBDD;
-	
-	// Statistics:
-	++totalBDDRefinements;
-	
-	// Ignore accumulated assumptions, as we are now looking at a new branch.
-	assumedSatBDDs.clear();
-
-	// Make space for getting the responsible vars.
-	std::unordered_set<int> postRefinementResVars;
-
-	bool isSat;
-	// Catch refinement immediate unsatisfiability.
-	if (refinedBDD == bddfalse) {
-		++numFalseFromRef;
-		isSat = false;
-	}// Check for loops here as well:
-	else if (dependentBDDs.count(refinedBDD) == 1) {
-		// Then we have a cyclic dependency.
-		// Assume that the cycle bdd is satisfiable and continue.
-		// Prevent any Sat caching that relies on this assumption.
-		assumedSatBDDs.insert(refinedBDD);
-		everAssumedSatBDDs.insert(refinedBDD);
-		// Statistics:
-		++loopsDetected;
-		isSat = true;
-	} else {// Determine the satisfiability of the refined bdd.
-		// Statisticis:
-		--depth;
-		isSat = isSatisfiableK(refinedBDD, postRefinementResVars, assumedSatBDDs);
-		++depth;
-	}
-	
-	// If currently assumed Sat, this bdd now has a value and need not be assumed.
-	if (assumedSatBDDs.count(formulaBDD) == 1) {
-		assumedSatBDDs.erase(formulaBDD);
-	}
-
-	if (isSat) {
-		if (everAssumedSatBDDs.count(formulaBDD) == 1) {
-			// Discharge any Sat assumptions of this bdd.
-			confirmSatAssumption(formulaBDD);
+		case KFrame::REFINE: {
+			if (!useSaturationUnsatCache) {// Only if we're using this style of cache.
+				// Cache this unsatisfiable branch
+				cacheUnsat(responsibleVars, frame.unsatBDD);
+			}
+			
+			// Perform the refinement:
+			bdd refinedBDD = formulaBDD & frame.unsatBDD;
+			
+			// Statistics:
+			++totalBDDRefinements;
+			
+			// Ignore accumulated assumptions, as we are now looking at a new branch.
+			assumedSatBDDs.clear();
+			
+			// Catch refinement immediate unsatisfiability.
+			frame.state = KFrame::FINISH_REFINEMENT;
+			if (refinedBDD == bddfalse) {
+				++numFalseFromRef;
+				frame.isSat = false;
+			}// Check for loops here as well:
+			else if (dependentBDDs.count(rawHandle(refinedBDD)) == 1) {
+				// Then we have a cyclic dependency.
+				// Assume that the cycle bdd is satisfiable and continue.
+				// Prevent any Sat caching that relies on this assumption.
+				assumedSatBDDs.insert(refinedBDD);
+				everAssumedSatBDDs.insert(refinedBDD);
+				// Statistics:
+				++loopsDetected;
+				frame.isSat = true;
+			} else {// Determine the satisfiability of the refined bdd.
+				// Statisticis:
+				--depth;
+				frame.state = KFrame::AFTER_REFINEMENT;
+				stack.push().start(refinedBDD, frame.postRefinementResVars, assumedSatBDDs);
+				return false;
+			}
+			break;
 		}
-		cacheSat(formulaBDD, assumedSatBDDs);
-	} else {
-		// Pass back responsible variables from all refinements.
-		responsibleVars.insert(postRefinementResVars.begin(), postRefinementResVars.end());
-		if (everAssumedSatBDDs.count(formulaBDD) == 1) {
-			// Reject any Sat assumptions of this bdd.
-			rejectSatAssumption(formulaBDD);
+		case KFrame::AFTER_REFINEMENT:
+			++depth;
+			frame.isSat = result;
+			frame.state = KFrame::FINISH_REFINEMENT;
+			break;
+		case KFrame::FINISH_REFINEMENT:
+			// If currently assumed Sat, this bdd now has a value and need not be assumed.
+			if (assumedSatBDDs.count(formulaBDD) == 1) {
+				assumedSatBDDs.erase(formulaBDD);
+			}
+			
+			if (frame.isSat) {
+				if (everAssumedSatBDDs.count(formulaBDD) == 1) {
+					// Discharge any Sat assumptions of this bdd.
+					confirmSatAssumption(formulaBDD);
+				}
+				cacheSat(formulaBDD, assumedSatBDDs);
+			} else {
+				// Pass back responsible variables from all refinements.
+				responsibleVars.insert(frame.postRefinementResVars);
+				if (everAssumedSatBDDs.count(formulaBDD) == 1) {
+					// Reject any Sat assumptions of this bdd.
+					rejectSatAssumption(formulaBDD);
+				}
+			}
+			--depth;
+			dependentBDDs.erase(rawHandle(formulaBDD));
+			result = frame.isSat;
+			return true;
 		}
 	}
-	--depth;
-	dependentBDDs.erase(formulaBDD);
-	return isSat;
 }
 
 /* Takes a satisfying valuation of a bdd (ie from bdd_satone),
@@ -1452,28 +3524,29 @@ bool refineAndRecurse(bdd& unsatBDD, bdd& formulaBDD, std::unordered_set<int>& r
  * (Non-modal vars are ignored.)
  * (Assumes BoxNNF, ie all modal formula represented by []s.)
  */
-void extractSatisfyingModalVars (bdd satValuation,
+void extractSatisfyingModalVars (const bdd& satValuation,
 		std::vector<int>& extBoxVars,
 		std::vector<int>& extDiaVars) {
-	while (satValuation != bddtrue) {
-		if (bdd_low(satValuation) == bddfalse) {
+	// Walked by raw handle; satValuation keeps its nodes referenced.
+	BddHandle node = rawHandle(satValuation);
+	while (node != rawHandle(bddtrue)) {
+		const int var = bdd_var(node);
+		if (bdd_low(node) == rawHandle(bddfalse)) {
 			// Only consider the modal ones: (and ignore the existsDia var)
-			if (bdd_var(satValuation) != existsDia
-			&& varsToAtoms.at(bdd_var(satValuation))->getop() == KFormula::BOX) {
+			if (varInfo[var].kind == BOX_VAR) {
 				// Formula is true in the valuation:
-				extBoxVars.push_back(bdd_var(satValuation));
+				extBoxVars.push_back(var);
 			}
 			// Extract formulae from the rest of the satisfying valuation.
-			satValuation = bdd_high(satValuation);
+			node = bdd_high(node);
 		} else {//bdd_high == bddfalse, by defn of satone.
 			// Only consider the modal ones: (and ignore the existsDia var)
-			if (bdd_var(satValuation) != existsDia
-			&& varsToAtoms.at(bdd_var(satValuation))->getop() == KFormula::BOX) {
+			if (varInfo[var].kind == BOX_VAR) {
 				// Formula was false in the valuation.
-				extDiaVars.push_back(bdd_var(satValuation));
+				extDiaVars.push_back(var);
 			}
 			// Extract formulae from the rest of the satisfying valuation.
-			satValuation = bdd_low(satValuation);
+			node = bdd_low(node);
 		}
 	}
 }
@@ -1486,17 +3559,20 @@ void cacheSat(bdd& b, std::unordered_set<bdd, BddHasher>& assumedSatBDDs) {
 		if (satCache.size() >= maxCacheSize) {
 			// Remove one element, in a FIFO fashion.
 			satCache.erase(satCacheDeque.front());
+			satCacheUses.erase(satCacheDeque.front());
 			satCacheDeque.pop_front();
 		}
 		if (satCache.count(b) == 0) {
 			satCacheDeque.push_back(b);
 			satCache.insert(b);
+			markUsed(satCacheUses, b);
 			// Statistics:
 			++satCacheAdds;
 		}
 	} else {
 		if (tempSatCaches.size() < maxCacheSize) {
 			tempSatCaches.push_back(std::pair<std::unordered_set<bdd, BddHasher>, bdd>(assumedSatBDDs, b));
+			markUsed(tempSatCacheUses, b);
 			// Statistics:
 			++numTempSatCaches;
 		}
@@ -1506,7 +3582,7 @@ void cacheSat(bdd& b, std::unordered_set<bdd, BddHasher>& assumedSatBDDs) {
 /*
  *	Cache an Unsatisfiable result.
  */
-void cacheUnsat(std::unordered_set<int>& vars, bdd& b) {
+void cacheUnsat(VarSet& vars, bdd& b) {
 	if (useUnsatCache) {
 		if (bddUnsatCache) {
 			unsatCacheBDD = unsatCacheBDD & b;
@@ -1515,27 +3591,29 @@ void cacheUnsat(std::unordered_set<int>& vars, bdd& b) {
 			if (saturationUnsatCache.size() >= maxCacheSize) {
 				// Remove one element, in a FIFO fashion.
 				saturationUnsatCache.erase(saturationUnsatCacheDeque.front());
+				saturationUnsatCacheUses.erase(saturationUnsatCacheDeque.front());
 				saturationUnsatCacheDeque.pop_front();
 			}
 			
-			saturationUnsatCache.insert(std::pair<bdd, std::unordered_set<int>>(b, vars));
+			saturationUnsatCache.insert(std::pair<bdd, VarSet>(b, vars));
+			markUsed(saturationUnsatCacheUses, b);
 			saturationUnsatCacheDeque.push_back(b);
 		} else {
 			if (unsatCache.size() >= maxCacheSize) {
 				// Remove one element, in a FIFO fashion.
 				unsatCache.erase(unsatCacheDeque.front());
+				unsatCacheUses.erase(unsatCacheDeque.front());
 				unsatCacheDeque.pop_front();
 			}
-			// Make an ordered vector from the unordered_set of vars.
-			std::vector<int> orderedVars;
-			orderedVars.insert(orderedVars.begin(), vars.begin(), vars.end());
-			std::sort(orderedVars.begin(), orderedVars.end());
+			// Make an ordered vector of the vars (a VarSet is iterated in order).
+			std::vector<int> orderedVars(vars.begin(), vars.end());
 			if (unsatCache.count(orderedVars) != 0) {
 				// Cache already contains these vars.
 				// Can get here from dia or box instafalse, ie false before checking the
 				// unsat cache.
 			} else {
 				unsatCache.insert(std::pair<std::vector<int>, bdd>(orderedVars, b));
+				markUsed(unsatCacheUses, orderedVars);
 				unsatCacheDeque.push_back(orderedVars);
 			}
 		}
@@ -1545,59 +3623,44 @@ void cacheUnsat(std::unordered_set<int>& vars, bdd& b) {
 }
 
 
+/*
+ *	Determine whether a set shares any elements with a range of variables.
+ */
+bool shareAnElement(const VarSet& set, VarRange range) {
+	return set.intersects(range.begin(), range.end());
+}
+
 /*
  *	Determine whether two sets share any elements.
  */
-bool shareAnElement(const std::unordered_set<int>& firstSet,
-					const std::unordered_set<int>& secondSet) {
-	if (firstSet.size() < secondSet.size()) {
-		for (std::unordered_set<int>::const_iterator it = firstSet.begin(); it != firstSet.end(); ++it) {
-			if (secondSet.count(*it) != 0) {
-				return true;
-			}
-		}
-		return false;
-	} else {
-		for (std::unordered_set<int>::const_iterator it = secondSet.begin(); it != secondSet.end(); ++it) {
-			if (firstSet.count(*it) != 0) {
-				return true;
-			}
-		}
-		return false;
-	}
+bool shareAnElement(const VarSet& firstSet, const VarSet& secondSet) {
+	return firstSet.intersects(secondSet);
 }
 
 /*
  *	Get all the variables from the given BDD that represent modal formulae.
  */
-std::unordered_set<int> getModalVars(bdd& b) {
+void getModalVars(bdd& b, VarSet& modalVars) {
 	bdd support = bdd_support(b);
-	std::unordered_set<int> modalVars;
+	modalVars.clear();
 	if (b != bddtrue && b != bddfalse) {
 		extractModalVars(support, modalVars);
 	}
-	return modalVars;
 }
-void extractModalVars(bdd support, std::unordered_set<int>& modalVars) {
-	if (support == bddtrue) {
-		return;
-	}
-	if (bdd_var(support) != existsDia// existsDia needs to be explicitly handled.
-	&& varsToAtoms.at(bdd_var(support))->getop() == KFormula::BOX) {
-		modalVars.insert(bdd_var(support));
+void extractModalVars(const bdd& support, VarSet& modalVars) {
+	for (BddHandle node = rawHandle(support); node != rawHandle(bddtrue); node = bdd_high(node)) {
+		if (varInfo[bdd_var(node)].kind == BOX_VAR) {
+			modalVars.insert(bdd_var(node));
+		}
 	}
-	extractModalVars(bdd_high(support), modalVars);
 }
 
 /*
  *	Determine whether the given vector is a subset of the given set.
  */
-bool isSubset(std::vector<int> vector, std::unordered_set<int>& set) {
-	if (vector.size() > set.size()) {
-		return false;
-	}
+bool isSubset(const std::vector<int>& vector, const VarSet& set) {
 	for (size_t i = 0; i < vector.size(); ++i) {
-		if (set.count(vector.at(i)) == 0) {
+		if (!set.contains(vector[i])) {
 			return false;
 		}
 	}
@@ -1665,247 +3728,332 @@ void rejectSatAssumption(bdd& b) {
  *	The permanent variables denote the [] formulae, and the result of their
  *	unboxing, that will be true at all subsequent worlds, due to the 
  *	transitivity of the relation.
+ *
+ *	As for K, the search runs on an explicit stack of reused frames (see
+ *	S4Frame).
  */
-bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
+bool isSatisfiableS4(bdd formulaBDD, VarSet& responsibleVars,
 					 std::unordered_set<bdd, BddHasher>& assumedSatBDDs,
 					 bdd permanentFactsBDD, 
-					 std::unordered_set<int> permanentBoxVars) {
-
-
-	// Statistics:
-	++depth;
-	if (depth > maxDepth) {
-		maxDepth = depth;
+					 VarSet permanentBoxVars) {
+	s4Frames.push().start(formulaBDD, responsibleVars, assumedSatBDDs,
+			permanentFactsBDD, permanentBoxVars);
+	bool result = false;
+	while (!s4Frames.empty()) {
+		if (resumeS4(s4Frames.top(), s4Frames, result)) {
+			s4Frames.pop();
+		}
 	}
+	return result;
+}
 
-	// Sat results caching.
-	if (satCache.count(formulaBDD) == 1) {
-		// Then we have already proven this is Satisfiable.
-		++satCacheHits;
-		--depth;
-		++totalSatisfiableModalJumps;
-		return true;
-	}
-	
-	// Unsat results caching.
-	if (useSaturationUnsatCache && saturationUnsatCache.count(formulaBDD) == 1) {
-		// Then we have already proven this is Unsatisfiable.
-		++unsatCacheHits;
-		--depth;
-		responsibleVars.insert(saturationUnsatCache.at(formulaBDD).begin(),
-													saturationUnsatCache.at(formulaBDD).end());
-		return false;
-	}
+void S4Frame::start(const bdd& _formulaBDD, VarSet& _responsibleVars,
+		std::unordered_set<bdd, BddHasher>& _assumedSatBDDs,
+		const bdd& _permanentFactsBDD, const VarSet& _permanentBoxVars) {
+	state = START;
+	formulaBDD = _formulaBDD;
+	responsibleVars = &_responsibleVars;
+	assumedSatBDDs = &_assumedSatBDDs;
+	permanentFactsBDD = _permanentFactsBDD;
+	permanentBoxVars = _permanentBoxVars;
+	boxVars.clear();
+	diaVars.clear();
+	newBoxVars.clear();
+	postUnboxingResVars.clear();
+	postUnboxingAssumedSatBDDs.clear();
+	dia = 0;
+	postRefinementResVars.clear();
+	isSat = false;
+}
 
-	// Base cases:
-	if (formulaBDD == bddtrue) {
-		--depth;
-		++totalSatisfiableModalJumps;
-		return true;
-	}
-	if (formulaBDD == bddfalse) {
-		--depth;
-		return false;
-	}
-	
-	// Get one satisfying valuation out of the formulaBDD:
-	bdd satisfyingValuation;
-	if (rightToLeft) {
-		satisfyingValuation = rightValuation(formulaBDD);
-	} else {
-		satisfyingValuation = bdd_satone(formulaBDD);//leftValuation(formulaBDD);
-	}
-	
-	// Get sets of the modal formulae in the satisfying valuation.
-	std::vector<int> boxVars;
-	std::vector<int> diaVars;
-	extractSatisfyingModalVars(satisfyingValuation, boxVars, diaVars);
-	
-	
-	// If we have new box vars to unbox, unbox them and recurse.
-	bdd postUnboxingPermanentFactsBDD = permanentFactsBDD;
-	std::unordered_set<int> postUnboxingPermanentBoxVars = permanentBoxVars;
-	bdd satValWithUnboxedBDD = satisfyingValuation;
-	std::vector<int> newBoxVars;
-	for (std::vector<int>::iterator boxIt = boxVars.begin(); boxIt != boxVars.end(); ++boxIt) {
-		if (postUnboxingPermanentBoxVars.count(*boxIt) == 0) {
-			// unbox, record the new var, add to permaFacts, permaVars and
-			// satValWithUnboxed
-			newBoxVars.push_back(*boxIt);
-			bdd unboxedBDD = unboxS4(*boxIt);//toBDDS4Unbox(&((varsToAtoms.at(*boxIt))->getleft()), postUnboxingPermanentBoxVars);
-			postUnboxingPermanentFactsBDD = postUnboxingPermanentFactsBDD & unboxedBDD & bdd_ithvar(*boxIt);
-			postUnboxingPermanentBoxVars.insert(*boxIt);
-			satValWithUnboxedBDD = satValWithUnboxedBDD & unboxedBDD;
+/*
+ *	As KFrame::release().
+ */
+void S4Frame::release() {
+	formulaBDD = bdd();
+	permanentFactsBDD = bdd();
+	satisfyingValuation = bdd();
+	postUnboxingPermanentFactsBDD = bdd();
+	satValWithUnboxedBDD = bdd();
+	modalJumpBDD = bdd();
+	unsatBDD = bdd();
+}
+
+/*
+ *	Runs a frame of the S4 tableau, as resumeK() does for K.
+ */
+bool resumeS4(S4Frame& frame, FrameStack<S4Frame>& stack, bool& result) {
+	VarSet& responsibleVars = *frame.responsibleVars;
+	std::unordered_set<bdd, BddHasher>& assumedSatBDDs = *frame.assumedSatBDDs;
+	bdd& formulaBDD = frame.formulaBDD;
+	bdd& permanentFactsBDD = frame.permanentFactsBDD;
+	VarSet& permanentBoxVars = frame.permanentBoxVars;
+	bdd& satisfyingValuation = frame.satisfyingValuation;
+	std::vector<int>& diaVars = frame.diaVars;
+	std::vector<int>& newBoxVars = frame.newBoxVars;
+	while (true) {
+		switch (frame.state) {
+		case S4Frame::START: {
+			maybeSift();
+			maybeEvict();
+			// Statistics:
+			++depth;
+			if (depth > maxDepth) {
+				maxDepth = depth;
+			}
+		
+			// Sat results caching.
+			if (satCache.count(formulaBDD) == 1) {
+				// Then we have already proven this is Satisfiable.
+				++satCacheHits;
+				markUsed(satCacheUses, formulaBDD);
+				--depth;
+				++totalSatisfiableModalJumps;
+				result = true;
+				return true;
+			}
 			
-			if (satValWithUnboxedBDD == bddfalse) {
-				// Statistics:
-				++numFalseFromBox;
-				
-				// Determine a minimal set of newBoxVars that lead to the false.
-				// The last one was definitely necessary:
-				bdd minBoxVarsBDD = unboxedBDD;
-				satValWithUnboxedBDD = satisfyingValuation & unboxedBDD;
-				responsibleVars.insert(*boxIt);
-				bdd unsatBDD = bdd_ithvar(*boxIt);
-				// Find a minimal set of previous ones that are necessary.
-				std::vector<int>::iterator endIt = --(newBoxVars.end());
-				bdd minimalBDD = satValWithUnboxedBDD;
-				while (true) {
-					satValWithUnboxedBDD = minimalBDD;
+			// Unsat results caching.
+			if (useSaturationUnsatCache && saturationUnsatCache.count(formulaBDD) == 1) {
+				// Then we have already proven this is Unsatisfiable.
+				++unsatCacheHits;
+				markUsed(saturationUnsatCacheUses, formulaBDD);
+				--depth;
+				responsibleVars.insert(saturationUnsatCache.at(formulaBDD));
+				result = false;
+				return true;
+			}
+		
+			// Base cases:
+			if (formulaBDD == bddtrue) {
+				--depth;
+				++totalSatisfiableModalJumps;
+				result = true;
+				return true;
+			}
+			if (formulaBDD == bddfalse) {
+				--depth;
+				result = false;
+				return true;
+			}
+			
+			// Get one satisfying valuation out of the formulaBDD:
+			if (rightToLeft) {
+				satisfyingValuation = rightValuation(formulaBDD);
+			} else {
+				satisfyingValuation = bdd_satone(formulaBDD);//leftValuation(formulaBDD);
+			}
+			
+			// Get sets of the modal formulae in the satisfying valuation.
+			std::vector<int>& boxVars = frame.boxVars;
+			extractSatisfyingModalVars(satisfyingValuation, boxVars, diaVars);
+			
+			
+			// If we have new box vars to unbox, unbox them and recurse.
+			frame.postUnboxingPermanentFactsBDD = permanentFactsBDD;
+			frame.postUnboxingPermanentBoxVars = permanentBoxVars;
+			bdd& satValWithUnboxedBDD = frame.satValWithUnboxedBDD;
+			satValWithUnboxedBDD = satisfyingValuation;
+			for (std::vector<int>::iterator boxIt = boxVars.begin(); boxIt != boxVars.end(); ++boxIt) {
+				if (!frame.postUnboxingPermanentBoxVars.contains(*boxIt)) {
+					// unbox, record the new var, add to permaFacts, permaVars and
+					// satValWithUnboxed
+					newBoxVars.push_back(*boxIt);
+					bdd unboxedBDD = unboxS4(*boxIt);//toBDDS4Unbox(&((varsToAtoms.at(*boxIt))->getleft()), postUnboxingPermanentBoxVars);
+					frame.postUnboxingPermanentFactsBDD = frame.postUnboxingPermanentFactsBDD
+							& unboxedBDD & bdd_ithvar(*boxIt);
+					frame.postUnboxingPermanentBoxVars.insert(*boxIt);
+					satValWithUnboxedBDD = satValWithUnboxedBDD & unboxedBDD;
+					
 					if (satValWithUnboxedBDD == bddfalse) {
-						// We're done, the last one added to minimal was
-						// sufficient to ensure false, we have a minimal set.
-						break;
-					}
-					for (std::vector<int>::iterator newBoxIt = newBoxVars.begin();
-							newBoxIt != endIt; ++newBoxIt) {
-						satValWithUnboxedBDD = satValWithUnboxedBDD
-												& unboxS4(*newBoxIt);//toBDDS4Unbox(&((varsToAtoms.at(*newBoxIt))->getleft()), postUnboxingPermanentBoxVars);
-						if (satValWithUnboxedBDD == bddfalse) {
-							// Then this last one made it false.
-							minimalBDD = minimalBDD & unboxS4(*newBoxIt);//toBDDS4Unbox(&((varsToAtoms.at(*newBoxIt))->getleft()), postUnboxingPermanentBoxVars);
-							minBoxVarsBDD = minBoxVarsBDD & unboxS4(*newBoxIt);//toBDDS4Unbox(&((varsToAtoms.at(*newBoxIt))->getleft()), postUnboxingPermanentBoxVars);
-							unsatBDD = unsatBDD & bdd_ithvar(*newBoxIt);
-							responsibleVars.insert(*newBoxIt);
-							endIt = newBoxIt;
-							break;
-						}
-					}
-				}
-				
-				// Determine a minimal set of other satVal vars that lead
-				// to false with the minimal set of newboxVars.
-				std::vector<std::pair<int, bool>> satValVars;
-				extractAllVars(satisfyingValuation, satValVars);
-				std::vector<std::pair<int, bool>>::iterator satEndIt = satValVars.end();
-				minimalBDD = minBoxVarsBDD;
-				while (true) {
-					minBoxVarsBDD = minimalBDD;
-					if (minBoxVarsBDD == bddfalse) {
-						// We're done, the last one added was sufficient to ensure false,
-						// we have a minimal set.
-						break;
-					}
-					for (std::vector<std::pair<int, bool>>::iterator varIt = satValVars.begin();
-							varIt != satEndIt; ++varIt) {
-						if (varIt->second == true) {
-							minBoxVarsBDD = minBoxVarsBDD & bdd_ithvar(varIt->first);
-						} else {
-							minBoxVarsBDD = minBoxVarsBDD & bdd_nithvar(varIt->first);
+						// Statistics:
+						++numFalseFromBox;
+						
+						// Determine a minimal set of newBoxVars that lead to the false.
+						// The last one was definitely necessary:
+						bdd minBoxVarsBDD = unboxedBDD;
+						satValWithUnboxedBDD = satisfyingValuation & unboxedBDD;
+						responsibleVars.insert(*boxIt);
+						bdd unsatBDD = bdd_ithvar(*boxIt);
+						// Find a minimal set of previous ones that are necessary.
+						std::vector<int>::iterator endIt = --(newBoxVars.end());
+						bdd minimalBDD = satValWithUnboxedBDD;
+						while (true) {
+							satValWithUnboxedBDD = minimalBDD;
+							if (satValWithUnboxedBDD == bddfalse) {
+								// We're done, the last one added to minimal was
+								// sufficient to ensure false, we have a minimal set.
+								break;
+							}
+							for (std::vector<int>::iterator newBoxIt = newBoxVars.begin();
+									newBoxIt != endIt; ++newBoxIt) {
+								satValWithUnboxedBDD = satValWithUnboxedBDD
+														& unboxS4(*newBoxIt);//toBDDS4Unbox(&((varsToAtoms.at(*newBoxIt))->getleft()), postUnboxingPermanentBoxVars);
+								if (satValWithUnboxedBDD == bddfalse) {
+									// Then this last one made it false.
+									minimalBDD = minimalBDD & unboxS4(*newBoxIt);//toBDDS4Unbox(&((varsToAtoms.at(*newBoxIt))->getleft()), postUnboxingPermanentBoxVars);
+									minBoxVarsBDD = minBoxVarsBDD & unboxS4(*newBoxIt);//toBDDS4Unbox(&((varsToAtoms.at(*newBoxIt))->getleft()), postUnboxingPermanentBoxVars);
+									unsatBDD = unsatBDD & bdd_ithvar(*newBoxIt);
+									responsibleVars.insert(*newBoxIt);
+									endIt = newBoxIt;
+									break;
+								}
+							}
 						}
-						if (minBoxVarsBDD == bddfalse) {
-							// Then this last one made it false.
-							if (varIt->second == true) {
-								minimalBDD = minimalBDD & bdd_ithvar(varIt->first);
-								unsatBDD = unsatBDD & bdd_ithvar(varIt->first);
-							} else {
-								minimalBDD = minimalBDD & bdd_nithvar(varIt->first);
-								unsatBDD = unsatBDD & bdd_nithvar(varIt->first);
+						
+						// Determine a minimal set of other satVal vars that lead
+						// to false with the minimal set of newboxVars.
+						std::vector<std::pair<int, bool>> satValVars;
+						extractAllVars(satisfyingValuation, satValVars);
+						std::vector<std::pair<int, bool>>::iterator satEndIt = satValVars.end();
+						minimalBDD = minBoxVarsBDD;
+						while (true) {
+							minBoxVarsBDD = minimalBDD;
+							if (minBoxVarsBDD == bddfalse) {
+								// We're done, the last one added was sufficient to ensure false,
+								// we have a minimal set.
+								break;
+							}
+							for (std::vector<std::pair<int, bool>>::iterator varIt = satValVars.begin();
+									varIt != satEndIt; ++varIt) {
+								if (varIt->second == true) {
+									minBoxVarsBDD = minBoxVarsBDD & bdd_ithvar(varIt->first);
+								} else {
+									minBoxVarsBDD = minBoxVarsBDD & bdd_nithvar(varIt->first);
+								}
+								if (minBoxVarsBDD == bddfalse) {
+									// Then this last one made it false.
+									if (varIt->second == true) {
+										minimalBDD = minimalBDD & bdd_ithvar(varIt->first);
+										unsatBDD = unsatBDD & bdd_ithvar(varIt->first);
+									} else {
+										minimalBDD = minimalBDD & bdd_nithvar(varIt->first);
+										unsatBDD = unsatBDD & bdd_nithvar(varIt->first);
+									}
+									responsibleVars.insert(varIt->first);
+									satEndIt = varIt;
+									break;
+								}
 							}
-							responsibleVars.insert(varIt->first);
-							satEndIt = varIt;
-							break;
 						}
+						
+						frame.unsatBDD = bdd_not(unsatBDD);
+						frame.state = S4Frame::REFINE;
+						break;
 					}
 				}
+			}
+			if (frame.state == S4Frame::REFINE) {
+				break;
+			}
+			if (!newBoxVars.empty()) {
+				// We performed an unboxing phase, and should recurse.
 				
-				unsatBDD = bdd_not(unsatBDD);
+				// Record the current bdd for loop checking.
+				dependentBDDs.insert(rawHandle(formulaBDD));
 				
-				return refineAndRecurseS4(unsatBDD, formulaBDD, responsibleVars,
-							assumedSatBDDs, permanentFactsBDD, permanentBoxVars);
+				// And check for unsatisfiability of this branch with the
+				// newly unboxed formulae, into fresh responsibleVars and
+				// assumedSatBDDs.
+				// Depth stat:
+				--depth;
+				frame.state = S4Frame::AFTER_UNBOXING;
+				stack.push().start(satValWithUnboxedBDD, frame.postUnboxingResVars,
+						frame.postUnboxingAssumedSatBDDs, frame.postUnboxingPermanentFactsBDD,
+						frame.postUnboxingPermanentBoxVars);
+				return false;
 			}
-		}
-	}
-	if (!newBoxVars.empty()) {
-		// We performed an unboxing phase, and should recurse.
-		
-		// Record the current bdd for loop checking.
-		dependentBDDs.insert(formulaBDD);
-		
-		// Make space for getting the responsibleVars and assumedSatBDDs.
-		std::unordered_set<int> postUnboxingResVars;
-		std::unordered_set<bdd, BddHasher> postUnboxingAssumedSatBDDs;
-		
-		// And check for unsatisfiability of this branch with the
-		// newly unboxed formulae.
-		// Depth stat:
-		--depth;
-		bool unboxedSat = isSatisfiableS4(satValWithUnboxedBDD, postUnboxingResVars,
-				postUnboxingAssumedSatBDDs, postUnboxingPermanentFactsBDD,
-				postUnboxingPermanentBoxVars);
-		++depth;
-		
-		if (!unboxedSat) {
-			// If Unsatisfiable:
-			// Then we want to modify the bdd, and recurse with that.
 			
-			// Here, the res vars are local vars, so generally aren't interested
-			// in children.
-			// Except for those box vars we unboxed. If their children were involved,
-			// then they were involved.
-			std::vector<std::pair<int, bool>> satValVars;
-			extractAllVars(satisfyingValuation, satValVars);
+			// No unboxing was necessary:
 			
-			bdd unsatBDD = bddtrue;
-			for (std::vector<std::pair<int, bool>>::iterator varIt = satValVars.begin();
-					varIt != satValVars.end(); ++varIt) {
-				// If a var is a responsible var
-				if (postUnboxingResVars.count(varIt->first) == 1) {
-					if (varIt->second == true) {
-						unsatBDD = unsatBDD & bdd_ithvar(varIt->first);
-					} else {
-						unsatBDD = unsatBDD & bdd_nithvar(varIt->first);
+			if (diaVars.empty()) {
+				--depth;
+				++totalSatisfiableModalJumps;
+				result = true;
+				return true;
+			}
+			
+			// Record the current bdd for loop checking.
+			dependentBDDs.insert(rawHandle(formulaBDD));
+			frame.state = S4Frame::NEXT_JUMP;
+			break;
+		}
+		case S4Frame::AFTER_UNBOXING: {
+			++depth;
+			VarSet& postUnboxingResVars = frame.postUnboxingResVars;
+			if (!result) {
+				// If Unsatisfiable:
+				// Then we want to modify the bdd, and recurse with that.
+				
+				// Here, the res vars are local vars, so generally aren't interested
+				// in children.
+				// Except for those box vars we unboxed. If their children were involved,
+				// then they were involved.
+				std::vector<std::pair<int, bool>> satValVars;
+				extractAllVars(satisfyingValuation, satValVars);
+				
+				bdd unsatBDD = bddtrue;
+				for (std::vector<std::pair<int, bool>>::iterator varIt = satValVars.begin();
+						varIt != satValVars.end(); ++varIt) {
+					// If a var is a responsible var
+					if (postUnboxingResVars.contains(varIt->first)) {
+						if (varIt->second == true) {
+							unsatBDD = unsatBDD & bdd_ithvar(varIt->first);
+						} else {
+							unsatBDD = unsatBDD & bdd_nithvar(varIt->first);
+						}
+						responsibleVars.insert(varIt->first);
 					}
-					responsibleVars.insert(varIt->first);
 				}
-			}
-			for (std::vector<int>::iterator newBoxIt = newBoxVars.begin();
-					newBoxIt != newBoxVars.end(); ++newBoxIt) {
-				// See if any of it's children were involved.
-				// That would mean that this var is responsible.
-				std::unordered_set<int> children;// TODO temporary fix, ned to add caching back in.
-				computeChildrenBoxS4(&(varsToAtoms.at(*newBoxIt)->getleft()), children);
-				if (shareAnElement(postUnboxingResVars, children)) {
-					unsatBDD = unsatBDD & bdd_ithvar(*newBoxIt);
-					responsibleVars.insert(*newBoxIt);
+				for (std::vector<int>::iterator newBoxIt = newBoxVars.begin();
+						newBoxIt != newBoxVars.end(); ++newBoxIt) {
+					// See if any of it's children were involved.
+					// That would mean that this var is responsible.
+					if (shareAnElement(postUnboxingResVars, getChildrenS4(*newBoxIt))) {
+						unsatBDD = unsatBDD & bdd_ithvar(*newBoxIt);
+						responsibleVars.insert(*newBoxIt);
+					}
 				}
+				frame.unsatBDD = bdd_not(unsatBDD);
+				frame.state = S4Frame::REFINE;
+				break;
 			}
-			unsatBDD = bdd_not(unsatBDD);
 			
-			return refineAndRecurseS4(unsatBDD, formulaBDD, responsibleVars,
-							assumedSatBDDs, permanentFactsBDD, permanentBoxVars);
+			// Unboxing was satisfiable:
+			// If currently assumed Sat, it now has a value and need not be assumed.
+			if (assumedSatBDDs.count(formulaBDD) == 1) {
+				assumedSatBDDs.erase(formulaBDD);
+			}
+			// Discharge any Sat assumptions of this bdd.
+			if (everAssumedSatBDDs.count(formulaBDD) == 1) {
+				confirmSatAssumption(formulaBDD);
+			}
+			cacheSat(formulaBDD, assumedSatBDDs);
+			dependentBDDs.erase(rawHandle(formulaBDD));
+			--depth;
+			result = true;
+			return true;
 		}
-		
-		// Unboxing was satisfiable:
-		// If currently assumed Sat, it now has a value and need not be assumed.
-		if (assumedSatBDDs.count(formulaBDD) == 1) {
-			assumedSatBDDs.erase(formulaBDD);
-		}
-		// Discharge any Sat assumptions of this bdd.
-		if (everAssumedSatBDDs.count(formulaBDD) == 1) {
-			confirmSatAssumption(formulaBDD);
-		}
-		cacheSat(formulaBDD, assumedSatBDDs);
-		dependentBDDs.erase(formulaBDD);
-		--depth;
-		return true;
-		
-	}
-
-	// No unboxing was necessary:
-    
-	if (diaVars.empty()) {
-		--depth;
-		++totalSatisfiableModalJumps;
-		return true;
-	} else {
-		
-		// Record the current bdd for loop checking.
-		dependentBDDs.insert(formulaBDD);
-		
-		// Modal jump for each dia formula.
-		for (std::vector<int>::iterator
-				diaIt = diaVars.begin(); diaIt != diaVars.end(); ++diaIt) {
+		case S4Frame::NEXT_JUMP: {
+			// Modal jump for each dia formula.
+			if (frame.dia == diaVars.size()) {
+				// All modal jumps were satisfiable:
+				// If currently assumed Sat, this BDD now has a value and need not be assumed.
+				if (assumedSatBDDs.count(formulaBDD) == 1) {
+					assumedSatBDDs.erase(formulaBDD);
+				}
+				// Discharge any Sat assumptions of this bdd.
+				if (everAssumedSatBDDs.count(formulaBDD) == 1) {
+					confirmSatAssumption(formulaBDD);
+				}
+				cacheSat(formulaBDD, assumedSatBDDs);
+				dependentBDDs.erase(rawHandle(formulaBDD));
+				--depth;
+				++totalSatisfiableModalJumps;
+				result = true;
+				return true;
+			}
+			const int diaVar = diaVars[frame.dia];
 			// Statistics:
 			++totalModalJumpsExplored;
 			if (periodicSummary && totalModalJumpsExplored % period == 0) {
@@ -1913,8 +4061,9 @@ bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
 			}
 			
 			// Modal jumps use toNotBDD, as <>phi are stored as []~phi.
-			bdd modalJumpBDD = unsatCacheBDD & gammaBDD & permanentFactsBDD
-								& undiamond(*diaIt);
+			bdd& modalJumpBDD = frame.modalJumpBDD;
+			modalJumpBDD = unsatCacheBDD & gammaBDD & permanentFactsBDD
+								& undiamond(diaVar);
 								
 			// Check for immediate Unsatisfiability of the modal jump.
 			if (modalJumpBDD == bddfalse) {
@@ -1926,13 +4075,13 @@ bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
 				// leads to false.
 				// Record responsible vars as only those in the subset.
 				// Modal jumps use toNotBDD, as <>phi are stored as []~phi.
-				modalJumpBDD = unsatCacheBDD & gammaBDD & undiamond(*diaIt);
-				responsibleVars.insert(*diaIt);
+				modalJumpBDD = unsatCacheBDD & gammaBDD & undiamond(diaVar);
+				responsibleVars.insert(diaVar);
 				// Again, <>phi are stored as []~phi, thus the nith.
-				bdd unsatBDD = bdd_nithvar(*diaIt);
+				bdd unsatBDD = bdd_nithvar(diaVar);
 				
 				// Determine a minimal unsatisfiable subset.
-				std::unordered_set<int>::iterator endIt = permanentBoxVars.end();
+				VarSet::const_iterator endIt = permanentBoxVars.end();
 				bdd minimalBDD = modalJumpBDD;
 				while (true) {
 					modalJumpBDD = minimalBDD;
@@ -1940,7 +4089,7 @@ bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
 						// We're done, the last one added was sufficient to ensure false.
 						break;
 					} else {
-						for (std::unordered_set<int>::iterator
+						for (VarSet::const_iterator
 								boxIt = permanentBoxVars.begin();
 								boxIt != endIt; ++boxIt) {
 							modalJumpBDD = modalJumpBDD & unboxS4(*boxIt)
@@ -1960,20 +4109,19 @@ bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
 					}
 				}
 				
-				unsatBDD = bdd_not(unsatBDD);
+				frame.unsatBDD = bdd_not(unsatBDD);
 				
 				if (!useSaturationUnsatCache) {
 					// Cache this unsatisfiable branch
-					cacheUnsat(responsibleVars, unsatBDD);
-	      }
-	            
-				return refineAndRecurseS4(unsatBDD, formulaBDD, responsibleVars,
-										  assumedSatBDDs, permanentFactsBDD,
-										  permanentBoxVars);
+					cacheUnsat(responsibleVars, frame.unsatBDD);
+				}
+				
+				frame.state = S4Frame::REFINE;
+				break;
 			}
 			
 			// Check for loops:
-			if (dependentBDDs.count(modalJumpBDD) == 1) {
+			if (dependentBDDs.count(rawHandle(modalJumpBDD)) == 1) {
 				// Then we have a cyclic dependency.
 				// Assume that the cycle bdd is satisfiable and continue.
 				// Prevent any Sat caching that relies on this assumption.
@@ -1981,19 +4129,23 @@ bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
 				everAssumedSatBDDs.insert(modalJumpBDD);
 				// Statistics:
 				++loopsDetected;
-				continue;// To the next modal jump.
+				++frame.dia;
+				break;// To the next modal jump.
 			}
 			
 			// See if we can apply any cached Unsat results:
-			std::unordered_set<int> cacheResVars;
+			VarSet& cacheResVars = frame.cacheResVars;
+			cacheResVars.clear();
 			if (useUnsatCache && !bddUnsatCache) {// if using this style of cache.
 				// If the unsat cache is empty, don't bother.
 				if (!unsatCache.empty()) {
-					std::unordered_set<int> modalJumpModalVars = getModalVars(modalJumpBDD);
+					VarSet& modalJumpModalVars = frame.modalJumpModalVars;
+					getModalVars(modalJumpBDD, modalJumpModalVars);
 					for (std::map<std::vector<int>, bdd>::iterator unsatIt = unsatCache.begin();
 					unsatIt != unsatCache.end(); ++unsatIt) {
 						if (isSubset(unsatIt->first, modalJumpModalVars)) {
 							modalJumpBDD = modalJumpBDD & unsatIt->second;
+							markUsed(unsatCacheUses, unsatIt->first);
 							cacheResVars.insert(unsatIt->first.begin(), unsatIt->first.end());
 							++unsatCacheHits;
 							if (modalJumpBDD == bddfalse) {
@@ -2004,7 +4156,7 @@ bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
 				}
 			
 				// Check for loops again after the unsat cache application:
-				if (dependentBDDs.count(modalJumpBDD) == 1) {
+				if (dependentBDDs.count(rawHandle(modalJumpBDD)) == 1) {
 					// Then we have a cyclic dependency.
 					// Assume that the cycle bdd is satisfiable and continue.
 					// Prevent any Sat caching that relies on this assumption.
@@ -2012,26 +4164,34 @@ bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
 					everAssumedSatBDDs.insert(modalJumpBDD);
 					// Statistics:
 					++loopsDetected;
-					continue;// To the next modal jump.
+					++frame.dia;
+					break;// To the next modal jump.
 				}
 			}
 			
 			// Make space for getting the responsibleVars and assumedSatBDDs.
-			std::unordered_set<int> postModalJumpResVars;
-			std::unordered_set<bdd, BddHasher> postModalJumpAssumedSatBDDs;
+			frame.postModalJumpResVars.clear();
+			frame.postModalJumpAssumedSatBDDs.clear();
 			
 			// And check for unsatisfiability of the world beyond the modal jump.
-			if (!isSatisfiableS4(modalJumpBDD, postModalJumpResVars,
-					postModalJumpAssumedSatBDDs, permanentFactsBDD, permanentBoxVars)) {
+			frame.state = S4Frame::AFTER_JUMP;
+			stack.push().start(modalJumpBDD, frame.postModalJumpResVars,
+					frame.postModalJumpAssumedSatBDDs, permanentFactsBDD, permanentBoxVars);
+			return false;
+		}
+		case S4Frame::AFTER_JUMP: {
+			const int diaVar = diaVars[frame.dia];
+			VarSet& postModalJumpResVars = frame.postModalJumpResVars;
+			if (!result) {
 				// Unsatisfiable:
 				// Then we want to modify the bdd, and recurse with that.
 				
 				// Include resVars we used from the unsat cache
-				postModalJumpResVars.insert(cacheResVars.begin(), cacheResVars.end());
+				postModalJumpResVars.insert(frame.cacheResVars);
 				
 				// If using a saturation style cache
 				if (useSaturationUnsatCache) {
-					cacheUnsat(postModalJumpResVars, modalJumpBDD);
+					cacheUnsat(postModalJumpResVars, frame.modalJumpBDD);
 				}
 				
 				// Only refine over variables that introduce a responsible variable.
@@ -2045,139 +4205,128 @@ bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
 				bool newPostModalJumpResVarsAdded = true;
 				while (newPostModalJumpResVarsAdded) {
 					newPostModalJumpResVarsAdded = false;
-					for (std::unordered_set<int>::iterator boxIt = permanentBoxVars.begin();
+					for (VarSet::const_iterator boxIt = permanentBoxVars.begin();
 							boxIt != permanentBoxVars.end(); ++boxIt) {
-						if (responsibleVars.count(*boxIt) != 0) {
+						if (responsibleVars.contains(*boxIt)) {
 							// Don't bother, we've already accounted for this box var.
 							continue;
 						}
-						std::unordered_set<int> children = getChildren(*boxIt);
-						children.insert(*boxIt);
-						if (shareAnElement(postModalJumpResVars, children)) {
+						// (A box is also a child of itself.)
+						const VarRange children = getChildren(*boxIt);
+						if (postModalJumpResVars.contains(*boxIt)
+								|| shareAnElement(postModalJumpResVars, children)) {
 							unsatBDD = unsatBDD & bdd_ithvar(*boxIt);
 							responsibleVars.insert(*boxIt);
 							// Add in other children to postModalJumpResVars
 							postModalJumpResVars.insert(children.begin(),
 														children.end());
+							postModalJumpResVars.insert(*boxIt);
 							newPostModalJumpResVarsAdded = true;
 							// Statistics:
 							--numResVarsIgnoredFromGeneral;
 						}
 					}
-					if (responsibleVars.count(*diaIt) != 0) {
+					if (responsibleVars.contains(diaVar)) {
 						// Don't bother, we've already accounted for this dia var.
-					} else if (shareAnElement(postModalJumpResVars, getChildren(*diaIt))) {
+					} else if (shareAnElement(postModalJumpResVars, getChildren(diaVar))) {
 						// Note, <>phi stored as []~phi, thus the nith.
-						unsatBDD = unsatBDD & bdd_nithvar(*diaIt);
-						responsibleVars.insert(*diaIt);
+						unsatBDD = unsatBDD & bdd_nithvar(diaVar);
+						responsibleVars.insert(diaVar);
 						// Add in other children to postModalJumpResVars
-						postModalJumpResVars.insert(getChildren(*diaIt).begin(),
-													getChildren(*diaIt).end());
+						postModalJumpResVars.insert(getChildren(diaVar).begin(),
+													getChildren(diaVar).end());
 						newPostModalJumpResVarsAdded = true;
 						// Statistics:
 						--numResVarsIgnoredFromGeneral;
 					}
 				}
-				unsatBDD = bdd_not(unsatBDD);
+				frame.unsatBDD = bdd_not(unsatBDD);
 				
-	      if (!useSaturationUnsatCache) {
+				if (!useSaturationUnsatCache) {
 					// Cache this unsatisfiable branch
-					cacheUnsat(responsibleVars, unsatBDD);
-	      }
-	      
-				return refineAndRecurseS4(unsatBDD, formulaBDD, responsibleVars,
-										  assumedSatBDDs, permanentFactsBDD,
-										  permanentBoxVars);
+					cacheUnsat(responsibleVars, frame.unsatBDD);
+				}
+				
+				frame.state = S4Frame::REFINE;
+				break;
 			}
 			
 			// Modal jump was Satisfiable:
 			// Accumulate assumedSatBDDS
-			assumedSatBDDs.insert(postModalJumpAssumedSatBDDs.begin(), postModalJumpAssumedSatBDDs.end());
+			assumedSatBDDs.insert(frame.postModalJumpAssumedSatBDDs.begin(),
+					frame.postModalJumpAssumedSatBDDs.end());
 			
 			// Continue to the next modal jump.
+			++frame.dia;
+			frame.state = S4Frame::NEXT_JUMP;
+			break;
 		}
-		
-		// All modal jumps were satisfiable:
-		// If currently assumed Sat, this BDD now has a value and need not be assumed.
-		if (assumedSatBDDs.count(formulaBDD) == 1) {
-			assumedSatBDDs.erase(formulaBDD);
-		}
-		// Discharge any Sat assumptions of this bdd.
-		if (everAssumedSatBDDs.count(formulaBDD) == 1) {
-			confirmSatAssumption(formulaBDD);
-		}
-		cacheSat(formulaBDD, assumedSatBDDs);
-		dependentBDDs.erase(formulaBDD);
-		--depth;
-		++totalSatisfiableModalJumps;
-		return true;
-	}
-}
-
-
-bool refineAndRecurseS4(bdd& unsatBDD, bdd& formulaBDD,
-						std::unordered_set<int>& responsibleVars,
-						std::unordered_set<bdd, BddHasher>& assumedSatBDDs,
-						bdd& permanentFactsBDD,
-						std::unordered_set<int>& permanentBoxVars) {
-	
-	// Perform the refinement:
-	bdd refinedBDD = formulaBDD & unsatBDD;
-	
-	// Statistics:
-	++totalBDDRefinements;
-	
-	// Ignore accumulated assumptions. We are now exploring a new branch.
-	assumedSatBDDs.clear();
-
-	// Make space for getting the responsible vars.
-	std::unordered_set<int> postRefinementResVars;
-
-	bool isSat;
-	// Catch refinement immediate Unsatisfiability.
-	if (refinedBDD == bddfalse) {
-		++numFalseFromRef;
-		isSat = false;
-	}// Check for loops here as well:
-	else if (dependentBDDs.count(refinedBDD) == 1) {
-		// Then we have a cyclic dependency.
-		// Assume that the cycle bdd is satisfiable and continue.
-		// Prevent any Sat caching that relies on this assumption.
-		assumedSatBDDs.insert(refinedBDD);
-		everAssumedSatBDDs.insert(refinedBDD);
-		// Statistics:
-		++loopsDetected;
-		isSat = true;
-	} else {// Go determine the satisfiability of the refined bdd.
-		// Statistics:
-		--depth;
-		isSat = isSatisfiableS4(refinedBDD, postRefinementResVars, assumedSatBDDs,
-								permanentFactsBDD, permanentBoxVars);
-		++depth;
-	}
-	
-	// If currently assumed Sat, this BDD now has a value and need not be assumed.
-	if (assumedSatBDDs.count(formulaBDD) == 1) {
-		assumedSatBDDs.erase(formulaBDD);
-	}
-
-	if (isSat) {
-		if (everAssumedSatBDDs.count(formulaBDD) == 1) {
-			// Discharge any Sat assumptions of this bdd.
-			confirmSatAssumption(formulaBDD);
+		case S4Frame::REFINE: {
+			// Perform the refinement:
+			bdd refinedBDD = formulaBDD & frame.unsatBDD;
+			
+			// Statistics:
+			++totalBDDRefinements;
+			
+			// Ignore accumulated assumptions. We are now exploring a new branch.
+			assumedSatBDDs.clear();
+			
+			// Catch refinement immediate Unsatisfiability.
+			frame.state = S4Frame::FINISH_REFINEMENT;
+			if (refinedBDD == bddfalse) {
+				++numFalseFromRef;
+				frame.isSat = false;
+			}// Check for loops here as well:
+			else if (dependentBDDs.count(rawHandle(refinedBDD)) == 1) {
+				// Then we have a cyclic dependency.
+				// Assume that the cycle bdd is satisfiable and continue.
+				// Prevent any Sat caching that relies on this assumption.
+				assumedSatBDDs.insert(refinedBDD);
+				everAssumedSatBDDs.insert(refinedBDD);
+				// Statistics:
+				++loopsDetected;
+				frame.isSat = true;
+			} else {// Go determine the satisfiability of the refined bdd.
+				// Statistics:
+				--depth;
+				frame.state = S4Frame::AFTER_REFINEMENT;
+				stack.push().start(refinedBDD, frame.postRefinementResVars, assumedSatBDDs,
+						permanentFactsBDD, permanentBoxVars);
+				return false;
+			}
+			break;
 		}
-		cacheSat(formulaBDD, assumedSatBDDs);
-	} else {
-		// Pass back responsible variables from all refinements.
-		responsibleVars.insert(postRefinementResVars.begin(), postRefinementResVars.end());
-		if (everAssumedSatBDDs.count(formulaBDD) == 1) {
-			// Reject any Sat assumptions of this bdd.
-			rejectSatAssumption(formulaBDD);
+		case S4Frame::AFTER_REFINEMENT:
+			++depth;
+			frame.isSat = result;
+			frame.state = S4Frame::FINISH_REFINEMENT;
+			break;
+		case S4Frame::FINISH_REFINEMENT:
+			// If currently assumed Sat, this BDD now has a value and need not be assumed.
+			if (assumedSatBDDs.count(formulaBDD) == 1) {
+				assumedSatBDDs.erase(formulaBDD);
+			}
+			
+			if (frame.isSat) {
+				if (everAssumedSatBDDs.count(formulaBDD) == 1) {
+					// Discharge any Sat assumptions of this bdd.
+					confirmSatAssumption(formulaBDD);
+				}
+				cacheSat(formulaBDD, assumedSatBDDs);
+			} else {
+				// Pass back responsible variables from all refinements.
+				responsibleVars.insert(frame.postRefinementResVars);
+				if (everAssumedSatBDDs.count(formulaBDD) == 1) {
+					// Reject any Sat assumptions of this bdd.
+					rejectSatAssumption(formulaBDD);
+				}
+			}
+			--depth;
+			dependentBDDs.erase(rawHandle(formulaBDD));
+			result = frame.isSat;
+			return true;
 		}
 	}
-	--depth;
-	dependentBDDs.erase(formulaBDD);
-	return isSat;
 }
 
 
@@ -2186,27 +4335,21 @@ bool refineAndRecurseS4(bdd& unsatBDD, bdd& formulaBDD,
  *	a more convenient form.
  *	Don't pass bddtrue of bddfalse here. It's not handled like that.
  */
-void extractAllVars(bdd satValuation,
+void extractAllVars(const bdd& satValuation,
 					std::vector<std::pair<int, bool>>& satValVars) {
-	if (bdd_low(satValuation) == bddfalse) {
+	BddHandle node = rawHandle(satValuation);
+	while (true) {
+		const int var = bdd_var(node);
+		const bool value = bdd_low(node) == rawHandle(bddfalse);
 		// ignore the existsDia var
-		if (bdd_var(satValuation) != existsDia) {
-			// Formula is true in the valuation:
-			satValVars.push_back(std::pair<int, bool>(bdd_var(satValuation), true));
+		if (var != existsDia) {
+			// Formula is true (or false) in the valuation:
+			satValVars.push_back(std::pair<int, bool>(var, value));
 		}
-		if (bdd_high(satValuation) != bddtrue) {
-			// Extract formulae from the rest of the bdd.
-			extractAllVars(bdd_high(satValuation), satValVars);
-		}
-	} else {//bdd_high == bddfalse, by def of satone.
-		// ignore the existsDia var
-		if (bdd_var(satValuation) != existsDia) {
-			// Formula was false in the valuation.
-			satValVars.push_back(std::pair<int, bool>(bdd_var(satValuation), false));
-		}
-		if (bdd_low(satValuation) != bddtrue) {
-			// Extract formulae from the rest of the bdd.
-			extractAllVars(bdd_low(satValuation), satValVars);
+		//bdd_high == bddfalse if value is false, by def of satone.
+		node = value ? bdd_high(node) : bdd_low(node);
+		if (node == rawHandle(bddtrue)) {
+			break;
 		}
 	}
 }
@@ -2257,13 +4400,14 @@ bdd rightValuation(bdd b) {
  *	Performs the standard unboxing of a box variable.
  *	
  *	Utilises a cache of previous unboxings.
- *	Cache is currently unbounded in size. Everything will be cached the
- *	first time it is unboxed.
+ *	Everything will be cached the first time it is unboxed, until evicted
+ *	by the memory governor (see evictCaches()).
  *	
  *	Assumes 'var' is a box variable.
  */
-bdd unbox(int var) {
+const bdd& unbox(int var) {
 	if (!unboxed.at(var)) {
+		ReorderScope scope(REORDER_CACHE);
 		unboxed.at(var) = true;
 		//if (S4 || !undiamonded.at(var)) {
 			unboxings.at(var) = toBDD(&((varsToAtoms.at(var))->getleft()));
@@ -2274,6 +4418,7 @@ bdd unbox(int var) {
 		++cachedUnboxings;
 		--unboxCacheHits;
 	}
+	unboxingUses.at(var) = cacheTick;
 	// Statistics:
 	++unboxCacheHits;
 	return unboxings.at(var);
@@ -2283,15 +4428,16 @@ bdd unbox(int var) {
  *	Performs the standard undiamonding of a diamond variable.
  *	
  *	Utilises a cache of previous undiamondings.
- *	Cache is currently unbounded in size. Everything will be cached the
- *	first time it is undiamonded.
+ *	Everything will be cached the first time it is undiamonded, until
+ *	evicted by the memory governor (see evictCaches()).
  *	
  *	Assumes 'var' is a diamond variable (stored in BoxNNF as []~phi).
  *	
  *	For K, can check for the same var unboxed, and take it's negation.
  */
-bdd undiamond(int var) {
+const bdd& undiamond(int var) {
 	if (!undiamonded.at(var)) {
+		ReorderScope scope(REORDER_CACHE);
 		undiamonded.at(var) = true;
 		//if (S4 || !unboxed.at(var)) {
 			undiamondings.at(var) = toNotBDD(&((varsToAtoms.at(var))->getleft()));
@@ -2302,6 +4448,7 @@ bdd undiamond(int var) {
 		++cachedUndiamondings;
 		--undiamondCacheHits;
 	}
+	undiamondingUses.at(var) = cacheTick;
 	// Statistics:
 	++undiamondCacheHits;
 	return undiamondings.at(var);
@@ -2312,19 +4459,21 @@ bdd undiamond(int var) {
  *	they are only conjunctions away from their parent box.
  *	
  *	Utilises a cache of previous unboxings.
- *	Cache is currently unbounded in size. Everything will be cached the
- *	first time it is unboxed.
+ *	Everything will be cached the first time it is unboxed, until evicted
+ *	by the memory governor (see evictCaches()).
  *	
  *	Assumes 'var' is a box variable.
  */
-bdd unboxS4(int var) {
+const bdd& unboxS4(int var) {
 	if (!unboxed.at(var)) {
+		ReorderScope scope(REORDER_CACHE);
 		unboxed.at(var) = true;
 		unboxings.at(var) = toBDDS4Unbox(&((varsToAtoms.at(var))->getleft()));
 		// Statistics:
 		++cachedUnboxings;
 		--unboxCacheHits;
 	}
+	unboxingUses.at(var) = cacheTick;
 	// Statistics:
 	++unboxCacheHits;
 	return unboxings.at(var);
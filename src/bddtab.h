@@ -8,6 +8,11 @@
 #define _BDDTAB_H_
 
 #include "KFormula.h"
+#include "InputReader.h"
+#include "BenchmarkReader.h"
+#include "OwlReader.h"
+#include "VarOrder.h"
+#include "VarSet.h"
 #include <bdd.h>
 #include <iostream>
 #include <assert.h>
@@ -19,10 +24,22 @@
 #include <deque>
 #include <vector>
 #include <list>
+#include <queue>
+#include <thread>
 #include <cstring>
+#include <cstdlib>
+#include <sstream>
 #include <sys/resource.h>
+#include <time.h>
 
 
+// Raw BuDDy node handles, for the parts of the search that only look BDDs
+// up or walk their nodes. Unlike a bdd, a handle is copied without touching
+// reference counts, so it is only good while some bdd holding the same node
+// keeps it referenced: the world of a frame on the stack, or a cache entry.
+typedef BDD BddHandle;
+inline BddHandle rawHandle(const bdd& b) { return b.id(); }
+
 // Hasher class for unordered_maps and unordered_sets of bdds:
 class BddHasher {
 	public:
@@ -31,72 +48,276 @@ class BddHasher {
 		}
 };
 
+// Phases of a run, in which dynamic reordering can be allowed separately.
+enum ReorderPhase {
+	NO_PHASE = 0,
+	REORDER_GAMMA = 1,// Building the BDDs of the input.
+	REORDER_CACHE = 2,// Building unboxings and undiamondings for their caches.
+	REORDER_SEARCH = 4,// Everything else during the tableau search.
+	REORDER_ALL_PHASES = 7
+};
+
+// Switches to a reordering phase for the lifetime of the scope.
+class ReorderScope {
+	public:
+		explicit ReorderScope(ReorderPhase phase);
+		~ReorderScope();
+	private:
+		ReorderPhase previous;
+};
+
+// What a BDD variable stands for.
+enum VarKind { PROP_VAR, BOX_VAR, EXISTS_DIA_VAR };
+
+// What the search needs to know about a BDD variable, in one flat table
+// indexed by variable (see buildVarTable()). The children of a box are
+// varChildren[childrenBegin, childrenEnd), and its children in S4, past
+// intermediate boxes, varChildrenS4[childrenS4Begin, childrenS4End).
+struct VarInfo {
+	uint8_t kind;
+	int32_t role;
+	uint32_t childrenBegin, childrenEnd;
+	uint32_t childrenS4Begin, childrenS4End;
+};
+
+// A range of variables in one of the flat arrays.
+class VarRange {
+	public:
+		VarRange(const int* _first, const int* _last) : first(_first), last(_last) {}
+		const int* begin() const { return first; }
+		const int* end() const { return last; }
+		size_t size() const { return last - first; }
+	private:
+		const int* first;
+		const int* last;
+};
+
+// How the operands of large conjunctions (gamma) are conjoined: in order,
+// smallest partial BDDs first, or by shared support (see conjunctionBDD()).
+enum ConjunctionSchedule { IN_ORDER, SMALLEST_FIRST, SHARED_SUPPORT };
+
+// The explicit stack of a tableau search. Frames above the top aren't
+// destroyed but kept for the next world pushed at that depth, so their
+// containers keep the storage they have grown, and a search that stays
+// within the depths seen before doesn't allocate for them. A deque doesn't
+// move its elements as it grows, so frames can keep pointers to the sets of
+// the frames below them.
+template <class Frame>
+class FrameStack {
+	public:
+		FrameStack() : depth(0) {}
+		// The next frame, to be set up with its start().
+		Frame& push() {
+			if (depth == frames.size()) {
+				frames.push_back(Frame());
+			}
+			return frames[depth++];
+		}
+		Frame& top() { return frames[depth - 1]; }
+		void pop() { frames[--depth].release(); }
+		bool empty() const { return depth == 0; }
+		// Frees the spare frames as well.
+		void clear() { frames.clear(); depth = 0; }
+	private:
+		std::deque<Frame> frames;
+		size_t depth;
+};
+
+// A world being examined by the K tableau, with the state of its search,
+// on the explicit stack of isSatisfiableK(). Its responsibleVars and
+// assumedSatBDDs are those of the frame that asked about it.
+struct KFrame {
+	enum State {
+		START,// Check the caches and base cases, and choose a valuation.
+		NEXT_ROLE,// Unbox the boxes of the current role.
+		NEXT_JUMP,// Make the modal jump of the current diamond.
+		AFTER_JUMP,// Resumed with the result of that jump.
+		REFINE,// Refine the formula by unsatBDD, and examine that.
+		AFTER_REFINEMENT,// Resumed with the result of the refinement.
+		FINISH_REFINEMENT
+	};
+	void start(const bdd& formulaBDD, VarSet& responsibleVars,
+			std::unordered_set<bdd, BddHasher>& assumedSatBDDs);
+	void release();
+	
+	State state;
+	bdd formulaBDD;
+	VarSet* responsibleVars;
+	std::unordered_set<bdd, BddHasher>* assumedSatBDDs;
+	std::vector<int> boxVars;
+	std::vector<int> diaVars;
+	int role;
+	// The variables of the current role are boxVars[boxBegin, boxEnd) and
+	// diaVars[dia, diaEnd), dia being the next diamond to jump from.
+	size_t boxBegin, boxEnd;
+	size_t dia, diaEnd;
+	bdd unboxedBDD;
+	bdd modalJumpBDD;
+	VarSet modalJumpModalVars;
+	VarSet cacheResVars;
+	VarSet postModalJumpResVars;
+	std::unordered_set<bdd, BddHasher> postModalJumpAssumedSatBDDs;
+	bdd unsatBDD;
+	VarSet postRefinementResVars;
+	bool isSat;
+};
+
+// As KFrame, for the S4 tableau of isSatisfiableS4(). Each frame has its
+// own copy of the permanent facts and box variables.
+struct S4Frame {
+	enum State {
+		START,// Check the caches and base cases, and unbox new boxes.
+		AFTER_UNBOXING,// Resumed with the result of the unboxing.
+		NEXT_JUMP,
+		AFTER_JUMP,
+		REFINE,
+		AFTER_REFINEMENT,
+		FINISH_REFINEMENT
+	};
+	void start(const bdd& formulaBDD, VarSet& responsibleVars,
+			std::unordered_set<bdd, BddHasher>& assumedSatBDDs,
+			const bdd& permanentFactsBDD, const VarSet& permanentBoxVars);
+	void release();
+	
+	State state;
+	bdd formulaBDD;
+	VarSet* responsibleVars;
+	std::unordered_set<bdd, BddHasher>* assumedSatBDDs;
+	bdd permanentFactsBDD;
+	VarSet permanentBoxVars;
+	bdd satisfyingValuation;
+	std::vector<int> boxVars;
+	std::vector<int> diaVars;
+	std::vector<int> newBoxVars;
+	bdd postUnboxingPermanentFactsBDD;
+	VarSet postUnboxingPermanentBoxVars;
+	bdd satValWithUnboxedBDD;
+	VarSet postUnboxingResVars;
+	std::unordered_set<bdd, BddHasher> postUnboxingAssumedSatBDDs;
+	size_t dia;
+	bdd modalJumpBDD;
+	VarSet modalJumpModalVars;
+	VarSet cacheResVars;
+	VarSet postModalJumpResVars;
+	std::unordered_set<bdd, BddHasher> postModalJumpAssumedSatBDDs;
+	bdd unsatBDD;
+	VarSet postRefinementResVars;
+	bool isSat;
+};
+
 // ------------------------ Function Declarations --------------------------- //
 void processArgs(int argc, char * argv[]);
 void printUsage();
 void printSummaryStatistics();
-bool kformulaComp(const KFormula* f1, const KFormula* f2);
+int parseReorderPhases(const char* list);
+void startReordering();
+void enterReorderPhase(ReorderPhase phase);
+void maybeSift();
+void saveLearnedOrder();
+void initBDDFramework(const std::vector<KFormula*>& roots);
+void initBDDFramework(size_t dagNodes, size_t atoms);
+void onGarbageCollection(int pre, bddGbcStat* stat);
+void onNodeTableResize(int oldSize, int newSize);
+void evictCaches();
+void maybeEvict();
+void proveBenchmarks();
+bool prove(KFormula* notpsiNNF, KFormula* gammaNNF);
+void resetState();
+KFormula* readGlobalAssumptions(InputReader& input);
+KFormula* readNormalisedGamma(InputReader& input);
+KFormula* parallelFrontEnd(InputReader& input);
 KFormula* toBoxNNF(KFormula* f);
-void findAllRoles(KFormula* f, std::unordered_set<std::string>& roles);
-void assignRoleInts(std::unordered_set<std::string>& roles,
-		std::unordered_map<std::string, int>& roleMap);
-void applyRoleInts(KFormula* f, std::unordered_map<std::string, int>& roleMap);
+KFormula* toBoxNNF(KFormula* f, bool positive);
+KFormula* toBoxNF(KFormula* f);
+KFormula* normalise(KFormula* f);
+KFormula* defineSubformulae(std::vector<KFormula*>& formulae, KFormula* gamma);
+bool isDefinitionSymbol(uint32_t symbol);
+void findAllRoles(KFormula* f, std::vector<bool>& roles);
+void assignRoleInts(std::vector<bool>& roles, std::vector<int>& roleMap);
+void applyRoleInts(KFormula* f, std::vector<int>& roleMap);
 void relateAtomsAndBDDVars(std::vector<KFormula*>& atoms, std::deque<KFormula*>& formulae);
-std::unordered_set<int>& getChildren(int var);
-void computeChildren(const KFormula* formula, std::unordered_set<int>& children);
-void computeChildrenBoxS4(const KFormula* formula, std::unordered_set<int>& children);
+void orderVars(std::vector<KFormula*>& atoms, const std::vector<KFormula*>& roots);
+void buildVarTable();
+VarRange getChildren(int var);
+VarRange getChildrenS4(int var);
+VarRange getRoleBoxVars(int role);
+void computeChildren(const KFormula* formula, VarSet& children);
+void computeChildrenBoxS4(const KFormula* formula, VarSet& children);
+// Translations of formulae into BDDs, memoized per subformula (see memoizedBDD()).
+enum FormulaBDDKind { NOT_BDD, PLAIN_BDD, S4_UNBOX_BDD };
+bdd memoizedBDD(FormulaBDDKind kind, const KFormula* formula,
+				bdd (*build)(const KFormula*));
 bdd toBDD(const KFormula* formula);
-void performClassification();
+bdd toBDDS4Unbox(const KFormula* formula);
+bdd toNotBDD(const KFormula* formula);
+bdd buildBDD(const KFormula* formula);
+bdd buildBDDS4Unbox(const KFormula* formula);
+bdd buildNotBDD(const KFormula* formula);
+bdd conjunctionBDD(const KFormula* formula);
+void partitionGamma(const KFormula* gamma);
+bdd withGamma(bdd b);
+bdd buildScheduledConjunction(const KFormula* formula);
+void performClassification(InputReader& input);
+KFormula* setUpGamma(KFormula* gammaNNF);
+void buildGammaBDD(KFormula* gammaNNF);
+void compileGammaImage(const char* path, KFormula* gammaNNF);
+KFormula* loadGammaImage(const char* path);
 bool isSatisfiable(bdd formulaBDD);
-bool isSatisfiableK(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
+bool isSatisfiableK(bdd formulaBDD, VarSet& responsibleVars,
 				   std::unordered_set<bdd, BddHasher>& assumedSatBDDs);
-void extractSatisfyingModalVars(bdd satValuation,
+void extractSatisfyingModalVars(const bdd& satValuation,
 								std::vector<int>& extBoxVars,
 								std::vector<int>& extDiaVars);
-bool refineAndRecurse(bdd& unsatBDD, bdd& formulaBDD, std::unordered_set<int>& responsibleVars,
-					  std::unordered_set<bdd, BddHasher>& assumedSatBDDs);
+bool hasLowerRole(int var, int other);
+bool resumeK(KFrame& frame, FrameStack<KFrame>& stack, bool& result);
 void cacheSat(bdd& b, std::unordered_set<bdd, BddHasher>& assumedSatBDDs);
-void cacheUnsat(std::unordered_set<int>& vars, bdd& b);
-bool shareAnElement(const std::unordered_set<int>& firstSet,
-					const std::unordered_set<int>& secondSet);
-std::unordered_set<int> getModalVars(bdd& b);
-void extractModalVars(bdd support, std::unordered_set<int>& modalVars);
-bool isSubset(std::vector<int> vector, std::unordered_set<int>& set);
+void cacheUnsat(VarSet& vars, bdd& b);
+bool shareAnElement(const VarSet& set, VarRange range);
+bool shareAnElement(const VarSet& firstSet, const VarSet& secondSet);
+void getModalVars(bdd& b, VarSet& modalVars);
+void extractModalVars(const bdd& support, VarSet& modalVars);
+bool isSubset(const std::vector<int>& vector, const VarSet& set);
 void confirmSatAssumption(bdd& b);
 void rejectSatAssumption(bdd& b);
 
-bool refineAndRecurseS4(bdd& unsatBDD, bdd& formulaBDD,
-						std::unordered_set<int>& responsibleVars,
-						std::unordered_set<bdd, BddHasher>& assumedSatBDDs,
-						bdd& permanentFactsBDD,
-						std::unordered_set<int>& permanentBoxVars);
-bool isSatisfiableS4(bdd formulaBDD, std::unordered_set<int>& responsibleVars,
+bool isSatisfiableS4(bdd formulaBDD, VarSet& responsibleVars,
 					 std::unordered_set<bdd, BddHasher>& assumedSatBDDs,
 					 bdd permanentFactsBDD,
-					 std::unordered_set<int> permanentBoxVars);
-void extractAllVars(bdd satValuation,
+					 VarSet permanentBoxVars);
+bool resumeS4(S4Frame& frame, FrameStack<S4Frame>& stack, bool& result);
+void extractAllVars(const bdd& satValuation,
 					std::vector<std::pair<int, bool>>& satValVars);
 bdd leftValuation(bdd b);
 bdd rightValuation(bdd b);
-bdd unbox(int var);
-bdd undiamond(int var);
-bdd unboxS4(int var);
+const bdd& unbox(int var);
+const bdd& undiamond(int var);
+const bdd& unboxS4(int var);
 
 
 // ----------------------- Global variable declarations --------------------- //
-// Correspondence between KFormulae and BDD variables:
-extern bool(*compareptr)(const KFormula*, const KFormula*);
-extern std::map<const KFormula*, int, bool(*)(const KFormula*,const KFormula*)> atomsToVars;
+// Correspondence between BDD variables and KFormulae:
 extern std::vector<const KFormula*> varsToAtoms;
 
-// Correspondence between modal BDD variables (/formulae) and their 'children' variables (/formulae).
-extern std::vector<std::unordered_set<int>> varsToChildren;
+// Kinds, roles and children of the BDD variables, and box variables by role.
+extern std::vector<VarInfo> varInfo;
+extern std::vector<int> varChildren;
+extern std::vector<int> varChildrenS4;
+extern std::vector<int> roleBoxVars;
+extern std::vector<uint32_t> roleBoxVarsBegin;
+
+// Memoized BoxNNF conversions, indexed by formula id: [0] of ~f, [1] of f.
+extern thread_local std::vector<KFormula*> boxNNFs[2];
+// Memoized BoxNF conversions, indexed by formula id.
+extern thread_local std::vector<KFormula*> boxNFs;
 
 // Cache of unboxings and undiamondings:
 extern std::vector<bdd> unboxings;
 extern std::vector<bool> unboxed;
 extern std::vector<bdd> undiamondings;
 extern std::vector<bool> undiamonded;
+extern std::vector<bdd> formulaBDDs[3];
+extern std::vector<bool> formulaBDDBuilt[3];
+extern std::vector<unsigned long> formulaBDDUses[3];
 // Note: as bdd variables are integers in a fixed range, vectors are the most
 // efficient standard containers for mapping from variables to other things.
 // (In terms of time, that is)
@@ -118,10 +339,16 @@ extern std::deque<bdd> satCacheDeque;
 extern std::map<std::vector<int>, bdd> unsatCache;
 extern std::deque<std::vector<int>> unsatCacheDeque;
 extern size_t maxCacheSize;
+extern std::unordered_map<bdd, unsigned long, BddHasher> satCacheUses;
+extern std::map<std::vector<int>, unsigned long> unsatCacheUses;
+extern std::unordered_map<bdd, unsigned long, BddHasher> saturationUnsatCacheUses;
+extern std::unordered_map<bdd, unsigned long, BddHasher> tempSatCacheUses;
 
 // Loop checking / cyclic dependencies:
 // All previous worlds on the current branch of the tableau.
-extern std::unordered_set<bdd, BddHasher> dependentBDDs;
+extern std::unordered_set<BddHandle> dependentBDDs;
+extern FrameStack<KFrame> kFrames;
+extern FrameStack<S4Frame> s4Frames;
 // All worlds that are currently undecided, but have been assumed true at some point.
 extern std::unordered_set<bdd, BddHasher> everAssumedSatBDDs;
 // Temporary cache of sat results made while under certain assumptions.
@@ -131,7 +358,11 @@ extern std::list<std::pair<std::unordered_set<bdd, BddHasher>, bdd>> tempSatCach
 // Global assumptions:
 extern bool globalAssumptions;
 extern bdd gammaBDD;
-extern std::unordered_set<int> gammaChildren;
+extern VarSet gammaChildren;
+extern int partitionLimit;
+extern std::vector<bdd> gammaClusters;
+extern std::vector<std::vector<int>> gammaClusterVars;
+extern std::vector<std::vector<int>> varsToGammaClusters;
 
 // S4 flag
 extern bool S4;
@@ -149,10 +380,37 @@ extern bool rightToLeft;
 
 // Enable dynamic BDD variable reordering
 extern bool reorder;
+extern int reorderPhases;
+extern ReorderPhase reorderPhase;
+extern bool modalBlocks;
+extern std::vector<std::pair<int, int>> varBlocks;
+extern int siftThreshold;
+extern int bddNodes;
+extern int bddCache;
+extern int bddMaxIncrease;
+extern int nodeBudget;
+extern ConjunctionSchedule conjunctionSchedule;
+extern int conjunctionLimit;
+extern const char* orderFile;
+extern bool orderLoaded;
+extern const char* compileFile;
+extern const char* imageFile;
+extern bool imageLoaded;
+extern std::vector<int> imageRoleMap;
 
 // Use BDDs to completely normalise all formulae as a preprocessing step.
 extern bool bddNormalise;
 
+// Only normalise the modal operators (BoxNF instead of BoxNNF), and build
+// BDDs for the propositional connectives directly.
+extern bool nativeConnectives;
+
+// Definitional abstraction of large or shared subformulae under boxes.
+extern size_t defineSize;
+extern size_t defineShared;
+extern bool showDefinitions;
+extern std::vector<bool> definitionSymbols;
+
 
 // Algorithm statistics:
 extern bool verbose;
@@ -168,6 +426,8 @@ extern int cachedUnboxings;
 extern int unboxCacheHits;
 extern int cachedUndiamondings;
 extern int undiamondCacheHits;
+extern int cachedFormulaBDDs;// Compound subformulae translated (see memoizedBDD()).
+extern int formulaBDDCacheHits;
 
 extern int satCacheAdds;//   Number of sat results that were cached.
 extern int unsatCacheAdds;// Number of unsat results that were cached.
@@ -189,6 +449,9 @@ extern int tempSatCachesRejected;// Results whose assumptions were rejected.
 
 extern int numVarsReduced;// BoxVars determined semantically equivalent through bdd normalisation.
 
+extern size_t inputFormulaSize;// Distinct subformulae of the input, before and after
+extern size_t nnfFormulaSize;//   conversion to BoxNNF.
+
 
 
 #endif